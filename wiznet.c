@@ -1,9 +1,6 @@
-// TODO: use built-in WIZNET timeout feature instead of _millis() (need interrupts)
 // TODO: implement wiznet_sw_reset() and wiznet_phy_reset() functions
 // TODO: complete architecture: store and use Wiznet status, sockets statuses,
 //       change them after every send/receive and so on
-// TODO: separate low-level interface (SPI, GPIO etc.): some sort of read/write byte,
-//       read/write chunk of bytes, assert/release pin
 // TODO: switch debug statements (#ifndef NDEBUG)
 // TODO: align macroses and variables
 // TODO: migrate from enums where there is no needs in them: (e.g.
@@ -12,19 +9,27 @@
 
 #include "wiznet.h"
 
+#include <string.h>
+
 
 /*
  *  Other global settings and definitions
  */
 
 #define MAX_TCP_SEGMENT_SIZE 1460  // recommended datasheet value
+#define UDP_HEADER_SIZE 8  // prepended by the chip to every datagram in HW RX buffer
+#define MACRAW_HEADER_SIZE 2  // prepended by the chip to every frame (length including itself)
+#define SOCK_DEFAULT_BUF_SIZE 2  // size of each HW TX (RX) buffer after reset (in KB)
+#define WIZNET_BUF_MEM_SIZE 16  // total HW TX (RX) memory shared by all sockets (in KB)
 
 // different timeouts (in milliseconds)
 #define WIZNET_TIMEOUT_RESET 8000
 #define SOCK_TIMEOUT_OPEN 1000
-#define SOCK_TIMEOUT_CONNECT 2000
 #define SOCK_TIMEOUT_CLOSE 1000
-#define SOCK_TIMEOUT_DISCON 2000
+// CONNECT and DISCON are ended by the chip itself (TIMEOUT interrupt after RTR/RCR retries), this
+// is only a guard on top of that time
+#define SOCK_TIMEOUT_HW_GUARD 500
+#define SOCK_TIMEOUT_SEND 2000  // for sendto(): waiting for free space in HW TX buffer
 // Wiznet' Interrupt Assert Waiting Time
 #define IAWT 31249  // 31249 - 5ms @ 25MHz
 // timeout for SPI transmitting/receiving (in milliseconds)
@@ -32,39 +37,6 @@
 #define WIZNET_SPI_RX_TIMEOUT 100
 
 
-/*
- *  BSB[4:0] bits of Control Phase
- */
-const uint8_t sock_n_registers[NUM_OF_SOCKETS] = {
-    SOCKET_0_REGISTERS,
-    SOCKET_1_REGISTERS,
-    SOCKET_2_REGISTERS,
-    SOCKET_3_REGISTERS,
-    SOCKET_4_REGISTERS,
-    SOCKET_5_REGISTERS,
-    SOCKET_6_REGISTERS,
-    SOCKET_7_REGISTERS
-};
-const uint8_t sock_n_tx_buffers[NUM_OF_SOCKETS] = {
-    SOCKET_0_TX_BUFFER,
-    SOCKET_1_TX_BUFFER,
-    SOCKET_2_TX_BUFFER,
-    SOCKET_3_TX_BUFFER,
-    SOCKET_4_TX_BUFFER,
-    SOCKET_5_TX_BUFFER,
-    SOCKET_6_TX_BUFFER,
-    SOCKET_7_TX_BUFFER
-};
-const uint8_t sock_n_rx_buffers[NUM_OF_SOCKETS] = {
-    SOCKET_0_RX_BUFFER,
-    SOCKET_1_RX_BUFFER,
-    SOCKET_2_RX_BUFFER,
-    SOCKET_3_RX_BUFFER,
-    SOCKET_4_RX_BUFFER,
-    SOCKET_5_RX_BUFFER,
-    SOCKET_6_RX_BUFFER,
-    SOCKET_7_RX_BUFFER
-};
 
 
 
@@ -73,346 +45,1875 @@ const uint8_t sock_n_rx_buffers[NUM_OF_SOCKETS] = {
  */
 uint32_t wiznets_cnt = 0;
 wiznet_t *wiznets[NUM_OF_WIZNETS];
+static volatile bool _wiznets_lock = false;  // protects the array and the counter
+
+
+static void _wiznets_acquire(void) {
+    while (__atomic_test_and_set(&_wiznets_lock, __ATOMIC_ACQUIRE));
+}
+
+
+static void _wiznets_release(void) {
+    __atomic_clear(&_wiznets_lock, __ATOMIC_RELEASE);
+}
+
+
+
+/*
+ *  Locks of the thread-safe mode (see WIZNET_THREAD_SAFE). The chip lock is held for a single
+ *  SPI frame or a short sequence touching chip-wide state, the socket lock - for a whole
+ *  operation on the socket. They are always taken in this order: socket, then chip. Both are
+ *  no-ops without the OS hooks
+ */
+static void _chip_lock(wiznet_t *wiznet) {
+#if WIZNET_THREAD_SAFE
+    if (wiznet->_mutex != NULL) wiznet->os->mutex_lock(wiznet->_mutex);
+#endif
+}
+
+
+static void _chip_unlock(wiznet_t *wiznet) {
+#if WIZNET_THREAD_SAFE
+    if (wiznet->_mutex != NULL) wiznet->os->mutex_unlock(wiznet->_mutex);
+#endif
+}
+
+
+/*
+ *  Let other tasks run while waiting for something
+ */
+static void _yield(wiznet_t *wiznet) {
+#if WIZNET_THREAD_SAFE
+    if ((wiznet->os != NULL) && (wiznet->os->yield != NULL)) wiznet->os->yield();
+#endif
+}
+
+
+/*
+ *  Take the lock of socket 'sock' to make several calls (e.g. recv_peek() and recv_consume())
+ *  a single operation for other tasks. Nested calls are allowed. Every function of the library
+ *  taking a socket locks it by itself
+ */
+void sock_lock(socket_t *sock) {
+#if WIZNET_THREAD_SAFE
+    if ((sock->_mutex != NULL) && (sock->_host_wiznet != NULL)) sock->_host_wiznet->os->mutex_lock(sock->_mutex);
+#endif
+}
+
+
+void sock_unlock(socket_t *sock) {
+#if WIZNET_THREAD_SAFE
+    if ((sock->_mutex != NULL) && (sock->_host_wiznet != NULL)) sock->_host_wiznet->os->mutex_unlock(sock->_mutex);
+#endif
+}
 
 
 
+#if WIZNET_USE_HAL
 /*
- *  Implement this to use timeouts when polling something
+ *  STM32 HAL implementation of the transport. Use it as a reference for your own port
  */
-static uint32_t _millis(void) {
+
+static uint32_t _hal_millis(wiznet_t *wiznet) {
     return HAL_GetTick();
 }
 
 
+// DWT cycle counter should be enabled by the application (CoreDebug->DEMCR, DWT->CTRL)
+static uint32_t _hal_cycles(wiznet_t *wiznet) {
+    return DWT->CYCCNT;
+}
+
+
 /*
- *  Private low-level routine to write 'len' bytes of 'data' buffer to corresponding 'wiznet', 'bank'
- *  and 'addr'
+ *  Short frames are assembled in a single buffer so they go through the bus in one HAL call
+ *  (reads use full-duplex transfer where the header is followed by dummy bytes). Long data
+ *  phases are clocked directly from/to the user buffer right after the header
  */
-static void _write_spi(wiznet_t *wiznet, uint16_t addr, uint8_t bank, uint8_t *data, uint16_t len) {
+static void _hal_cs(wiznet_t *wiznet, GPIO_PinState state) {
+#if WIZNET_USE_FDM
+    if (wiznet->fdm) return;  // CS is tied low
+#endif
+    HAL_GPIO_WritePin(wiznet->RST_CS_Port, wiznet->CS_Pin, state);
+}
 
-    // BSB[4:0] bits
-    uint8_t ctrl_phase = bank << 3;
-    // 'Write' flag
-    ctrl_phase |= 1<<RWB;
 
-    addr = SWAP_TWO_BYTES(addr);
+static void _hal_transfer(wiznet_t *wiznet, wiznet_frame_t *frame) {
+
+    uint8_t tx_buf[3+WIZNET_SPI_FRAME_BUF_SIZE];
+    uint8_t rx_buf[3+WIZNET_SPI_FRAME_BUF_SIZE];
+    bool is_write = frame->header[2] & (1<<RWB);
 
     // CS select
-    HAL_GPIO_WritePin(wiznet->RST_CS_Port, wiznet->CS_Pin, GPIO_PIN_RESET);
+    _hal_cs(wiznet, GPIO_PIN_RESET);
 
-    // Address Phase, Control Phase and Data Phase
-    HAL_SPI_Transmit(wiznet->hspi, (uint8_t *)&addr, sizeof(uint16_t), WIZNET_SPI_TX_TIMEOUT);
-    HAL_SPI_Transmit(wiznet->hspi, &ctrl_phase, sizeof(uint8_t), WIZNET_SPI_TX_TIMEOUT);
-    HAL_SPI_Transmit(wiznet->hspi, data, len, WIZNET_SPI_TX_TIMEOUT);
+    if (frame->len <= WIZNET_SPI_FRAME_BUF_SIZE) {
+        memcpy(tx_buf, frame->header, 3);
+        if (is_write) {
+            memcpy(&tx_buf[3], frame->data, frame->len);
+            HAL_SPI_Transmit(wiznet->hspi, tx_buf, 3+frame->len, WIZNET_SPI_TX_TIMEOUT);
+        }
+        else {
+            memset(&tx_buf[3], 0, frame->len);
+            HAL_SPI_TransmitReceive(wiznet->hspi, tx_buf, rx_buf, 3+frame->len, WIZNET_SPI_RX_TIMEOUT);
+            memcpy(frame->data, &rx_buf[3], frame->len);
+        }
+    }
+    else {
+        HAL_SPI_Transmit(wiznet->hspi, frame->header, 3, WIZNET_SPI_TX_TIMEOUT);
+        if (is_write) HAL_SPI_Transmit(wiznet->hspi, frame->data, frame->len, WIZNET_SPI_TX_TIMEOUT);
+        else HAL_SPI_Receive(wiznet->hspi, frame->data, frame->len, WIZNET_SPI_RX_TIMEOUT);
+    }
 
     // CS deselect
-    HAL_GPIO_WritePin(wiznet->RST_CS_Port, wiznet->CS_Pin, GPIO_PIN_SET);
+    _hal_cs(wiznet, GPIO_PIN_SET);
+}
+
+
+static void _hal_hw_reset(wiznet_t *wiznet) {
+    // toggle RST pin from '1' to '0' and then back to '1'
+    HAL_GPIO_WritePin(wiznet->RST_CS_Port, wiznet->RST_Pin, GPIO_PIN_RESET);
+    HAL_Delay(1);  // 500 us - from datasheet
+    HAL_GPIO_WritePin(wiznet->RST_CS_Port, wiznet->RST_Pin, GPIO_PIN_SET);
+    HAL_Delay(1);  // 1 ms - from datasheet
 }
 
 
+const wiznet_transport_t wiznet_hal_transport = {
+    .transfer = _hal_transfer,
+    .millis = _hal_millis,
+    .hw_reset = _hal_hw_reset,
+    .cycles = _hal_cycles
+};
+
+
 /*
- *  Private low-level routine to read 'len' bytes to 'buf' buffer of corresponding 'wiznet', 'bank'
- *  and 'addr'
+ *  DMA-driven variant of the HAL transport. Enable DMA streams for the SPI and call
+ *  wiznet_hal_dma_complete() from HAL_SPI_TxCpltCallback(), HAL_SPI_RxCpltCallback() and
+ *  HAL_SPI_TxRxCpltCallback() for the Wiznet' SPI handle. Short frames go as a single DMA
+ *  transfer, long ones as the header and then the Data Phase chained from the completion
  */
-static void _read_spi(wiznet_t *wiznet, uint16_t addr, uint8_t bank, uint8_t *buf, uint16_t len) {
-
-    // BSB[4:0] bits
-    uint8_t ctrl_phase = bank << 3;
-    // 'Read' flag - '0' means read operation so we simply don't set it
-    // ctrl_phase &= ~(1<<RWB);
+static void _hal_dma_start(wiznet_t *wiznet, wiznet_frame_t *frame) {
 
-    addr = SWAP_TWO_BYTES(addr);
+    bool is_write = frame->header[2] & (1<<RWB);
+    wiznet->_dma_frame = frame;
 
     // CS select
     HAL_GPIO_WritePin(wiznet->RST_CS_Port, wiznet->CS_Pin, GPIO_PIN_RESET);
 
-    // Address Phase, Control Phase and Data Phase
-    HAL_SPI_Transmit(wiznet->hspi, (uint8_t *)&addr, sizeof(uint16_t), WIZNET_SPI_TX_TIMEOUT);
-    HAL_SPI_Transmit(wiznet->hspi, &ctrl_phase, sizeof(uint8_t), WIZNET_SPI_TX_TIMEOUT);
-    HAL_SPI_Receive(wiznet->hspi, buf, len, WIZNET_SPI_RX_TIMEOUT);
+    if (frame->len <= WIZNET_SPI_FRAME_BUF_SIZE) {
+        wiznet->_dma_stage = 1;
+        memcpy(wiznet->_dma_tx_buf, frame->header, 3);
+        if (is_write) {
+            memcpy(&wiznet->_dma_tx_buf[3], frame->data, frame->len);
+            HAL_SPI_Transmit_DMA(wiznet->hspi, wiznet->_dma_tx_buf, 3+frame->len);
+        }
+        else {
+            memset(&wiznet->_dma_tx_buf[3], 0, frame->len);
+            HAL_SPI_TransmitReceive_DMA(wiznet->hspi, wiznet->_dma_tx_buf, wiznet->_dma_rx_buf, 3+frame->len);
+        }
+    }
+    else {
+        wiznet->_dma_stage = 0;
+        HAL_SPI_Transmit_DMA(wiznet->hspi, frame->header, 3);
+    }
+}
+
+
+/*
+ *  Call this from the SPI DMA completion callbacks (interrupt context)
+ */
+void wiznet_hal_dma_complete(wiznet_t *wiznet) {
+
+    wiznet_frame_t *frame = wiznet->_dma_frame;
+    bool is_write = frame->header[2] & (1<<RWB);
+
+    // header is out, chain the Data Phase
+    if (wiznet->_dma_stage == 0) {
+        wiznet->_dma_stage = 1;
+        if (is_write) HAL_SPI_Transmit_DMA(wiznet->hspi, frame->data, frame->len);
+        else HAL_SPI_Receive_DMA(wiznet->hspi, frame->data, frame->len);
+        return;
+    }
+
+    if (!is_write && (frame->len <= WIZNET_SPI_FRAME_BUF_SIZE))
+        memcpy(frame->data, &wiznet->_dma_rx_buf[3], frame->len);
 
     // CS deselect
     HAL_GPIO_WritePin(wiznet->RST_CS_Port, wiznet->CS_Pin, GPIO_PIN_SET);
+
+    wiznet_xfer_complete(wiznet);
+}
+
+
+static uint32_t _hal_lock(wiznet_t *wiznet) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    return primask;
+}
+
+
+static void _hal_unlock(wiznet_t *wiznet, uint32_t state) {
+    __set_PRIMASK(state);
 }
 
 
+const wiznet_transport_t wiznet_hal_dma_transport = {
+    .transfer = _hal_transfer,
+    .millis = _hal_millis,
+    .hw_reset = _hal_hw_reset,
+    .cycles = _hal_cycles,
+    .start = _hal_dma_start,
+    .lock = _hal_lock,
+    .unlock = _hal_unlock
+};
+#endif
+
+
+
+#if WIZNET_USE_POOL || WIZNET_USE_STATS
+static uint32_t _cycles(wiznet_t *wiznet) {
+    return wiznet->transport->cycles ? wiznet->transport->cycles(wiznet) : 0;
+}
+#endif
+
 
+
+#if WIZNET_USE_POOL
 /*
- *  Initialize 'Wiznet' structure with default values. Always call this function before
- *  any other operations with Wiznet to prevent undefined behavior
- *
- *    ex.: wiznet_t my_wiznet = wiznet_t_init()
- *
+ *  Fixed-block pool of every Wiznet. Storage is static (so no heap is needed) and is bound to
+ *  the Wiznet by its ID at wiznet_init(). Allocation and freeing are O(1): free blocks of each
+ *  class form a singly linked list through their first word. A bitmap of allocated blocks
+ *  catches frees of blocks which aren't in use (they would corrupt the list)
  */
-wiznet_t wiznet_t_init(void) {
+static uint32_t _pool_small[NUM_OF_WIZNETS][WIZNET_POOL_SMALL_BLOCK*WIZNET_POOL_SMALL_COUNT/4];
+static uint32_t _pool_medium[NUM_OF_WIZNETS][WIZNET_POOL_MEDIUM_BLOCK*WIZNET_POOL_MEDIUM_COUNT/4];
+static uint32_t _pool_large[NUM_OF_WIZNETS][WIZNET_POOL_LARGE_BLOCK*WIZNET_POOL_LARGE_COUNT/4];
+static uint32_t _pool_small_used[NUM_OF_WIZNETS][(WIZNET_POOL_SMALL_COUNT+31)/32];
+static uint32_t _pool_medium_used[NUM_OF_WIZNETS][(WIZNET_POOL_MEDIUM_COUNT+31)/32];
+static uint32_t _pool_large_used[NUM_OF_WIZNETS][(WIZNET_POOL_LARGE_COUNT+31)/32];
+
+
+static void _pool_class_init(wiznet_pool_class_t *class, uint32_t *storage, uint32_t *used,
+                             uint16_t block_size, uint16_t num_blocks) {
+
+    class->storage = (uint8_t *)storage;
+    class->used = used;
+    memset(used, 0, (num_blocks+31)/32*sizeof(uint32_t));
+    class->free_list = NULL;
+    for (int32_t i=num_blocks-1; i>=0; i--) {
+        void **block = (void **)(class->storage + i*block_size);
+        *block = class->free_list;
+        class->free_list = block;
+    }
 
-    wiznet_t wiznet = {
-        // fill private members
-        ._id = -1,
-        ._sockets_cnt = 0,
-        ._sockets_taken = 0b00000000,
-        ._sockets = {NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL},
+    memset(&class->stats, 0, sizeof(wiznet_pool_stats_t));
+    class->stats.block_size = block_size;
+    class->stats.num_blocks = num_blocks;
+}
 
-        // fill in public members in case user will forget to define them
-        .mac_addr = {0,0,0,0,0,0},
-        .ip_addr = {0,0,0,0},
-        .ip_gateway_addr = {0,0,0,0},
-        .subnet_mask = {0,0,0,0}
-    };
 
-    return wiznet;
+static void _pool_init(wiznet_t *wiznet) {
+    if ((wiznet->_id < 0) || (wiznet->_id >= NUM_OF_WIZNETS)) return;
+
+    _pool_class_init(&wiznet->_pool[0], _pool_small[wiznet->_id], _pool_small_used[wiznet->_id],
+                     WIZNET_POOL_SMALL_BLOCK, WIZNET_POOL_SMALL_COUNT);
+    _pool_class_init(&wiznet->_pool[1], _pool_medium[wiznet->_id], _pool_medium_used[wiznet->_id],
+                     WIZNET_POOL_MEDIUM_BLOCK, WIZNET_POOL_MEDIUM_COUNT);
+    _pool_class_init(&wiznet->_pool[2], _pool_large[wiznet->_id], _pool_large_used[wiznet->_id],
+                     WIZNET_POOL_LARGE_BLOCK, WIZNET_POOL_LARGE_COUNT);
+}
+
+
+// index of 'block' in its 'class'
+static inline uint16_t _pool_block_index(const wiznet_pool_class_t *class, const void *block) {
+    return ((const uint8_t *)block - class->storage) / class->stats.block_size;
 }
 
 
 /*
- *  Initialize new Wiznet. Before calling this function, fill in all necessary fields of
- *  the 'wiznet' structure. Returns '0' at success and non-zero value otherwise
+ *  Take a block of at least 'size' bytes from the pool of the 'wiznet'. The smallest fitting
+ *  class is used, bigger ones serve as a fallback. Returns NULL if there is no free block
  */
-int32_t wiznet_init(wiznet_t *wiznet) {
+void *wiznet_pool_alloc(wiznet_t *wiznet, uint16_t size) {
+
+    uint32_t start = _cycles(wiznet);
+    _chip_lock(wiznet);
+
+    wiznet_pool_class_t *best = NULL;
+    void **block = NULL;
+    for (uint8_t i=0; i<WIZNET_POOL_NUM_CLASSES; i++) {
+        wiznet_pool_class_t *class = &wiznet->_pool[i];
+        if ((class->storage == NULL) || (class->stats.block_size < size)) continue;
+        if (best == NULL) best = class;
+        if (class->free_list != NULL) {
+            block = class->free_list;
+            class->free_list = *block;
+            uint16_t index = _pool_block_index(class, block);
+            class->used[index/32] |= 1UL << (index%32);
+
+            class->stats.allocs++;
+            if (++class->stats.in_use > class->stats.peak_in_use)
+                class->stats.peak_in_use = class->stats.in_use;
+            class->stats.requested_bytes += size;
+            class->stats.granted_bytes += class->stats.block_size;
+            if (class != best) best->stats.fallbacks++;
+            break;
+        }
+    }
+
+    // no 'best' - too big for any class
+    if (best != NULL) {
+        if (block == NULL) best->stats.failures++;
 
-    // initialize Wiznets array
-    static bool is_first_wiznet = true;
-    if (is_first_wiznet) {
-        is_first_wiznet = false;
-        for (uint8_t i=0; i<NUM_OF_WIZNETS; i++) wiznets[i] = NULL;
+        uint32_t cycles = _cycles(wiznet)-start;
+        best->stats.alloc_cycles_total += cycles;
+        if (cycles > best->stats.alloc_cycles_max) best->stats.alloc_cycles_max = cycles;
     }
 
-    // add this Wiznet to the array of Wiznets
-    if (++wiznets_cnt > NUM_OF_WIZNETS) {
-        printf("TOO MANY WIZNETS\n");
-        wiznets_cnt--;
-        return -1;
+    _chip_unlock(wiznet);
+    return block;
+}
+
+
+static wiznet_pool_class_t *_pool_class_of(wiznet_t *wiznet, const void *block) {
+    for (uint8_t i=0; i<WIZNET_POOL_NUM_CLASSES; i++) {
+        wiznet_pool_class_t *class = &wiznet->_pool[i];
+        if (class->storage == NULL) continue;
+        const uint8_t *end = class->storage + class->stats.block_size*class->stats.num_blocks;
+        if (((const uint8_t *)block >= class->storage) && ((const uint8_t *)block < end))
+            return class;
     }
-    else {
-        for (uint32_t i=0; i<NUM_OF_WIZNETS; i++) {
-            if (wiznets[i] == NULL) {
-                wiznets[i] = wiznet;
-                wiznet->_id = i;
-            }
-        }
+    return NULL;
+}
+
+
+/*
+ *  Return 'block' obtained by wiznet_pool_alloc() to the pool. NULL is ignored, so are pointers
+ *  which aren't the start of an allocated block (e.g. a block freed twice)
+ */
+void wiznet_pool_free(wiznet_t *wiznet, void *block) {
+    if (block == NULL) return;
+
+    wiznet_pool_class_t *class = _pool_class_of(wiznet, block);
+    if ((class == NULL) ||
+        ((((const uint8_t *)block - class->storage) % class->stats.block_size) != 0)) {
+        printf("Block doesn't belong to the pool\n");
+        return;
     }
 
-    wiznet_hw_reset(wiznet);
+    _chip_lock(wiznet);
+    uint16_t index = _pool_block_index(class, block);
+    uint32_t bit = 1UL << (index%32);
+    if (!(class->used[index/32] & bit)) {
+        class->stats.bad_frees++;
+        _chip_unlock(wiznet);
+        printf("Block is not allocated\n");
+        return;
+    }
+    class->used[index/32] &= ~bit;
+    *(void **)block = class->free_list;
+    class->free_list = block;
+    class->stats.frees++;
+    class->stats.in_use--;
+    _chip_unlock(wiznet);
+}
 
-    // set Interrupt Assert Waiting Time
-    uint16_t i_awt = IAWT;
-    i_awt = SWAP_TWO_BYTES(i_awt);
-    _write_spi(wiznet, INTLEVEL, COMMON_REGISTERS, (uint8_t *)&i_awt, sizeof(uint16_t));
 
-    // set MAC address
-    _write_spi(wiznet, SHAR, COMMON_REGISTERS, wiznet->mac_addr, 6);
-    // set this Wiznet' IP address
-    _write_spi(wiznet, SIPR, COMMON_REGISTERS, wiznet->ip_addr, 4);
-    // set gateway' IP address
-    _write_spi(wiznet, GAR, COMMON_REGISTERS, wiznet->ip_gateway_addr, 4);
-    // set subnet mask
-    _write_spi(wiznet, SUBR, COMMON_REGISTERS, wiznet->subnet_mask, 4);
+/*
+ *  Copy statistics of all pool classes (from the smallest to the largest) to 'stats'
+ */
+void wiznet_pool_get_stats(wiznet_t *wiznet, wiznet_pool_stats_t stats[WIZNET_POOL_NUM_CLASSES]) {
+    for (uint8_t i=0; i<WIZNET_POOL_NUM_CLASSES; i++) stats[i] = wiznet->_pool[i].stats;
+}
 
-    // DEBUG START
-    uint8_t mac_addr_2[6];
-    uint8_t ip_addr_2[4];
-    uint8_t ip_gateway_addr_2[4];
-    uint8_t subnet_mask_2[4];
-    _read_spi(wiznet, SHAR, COMMON_REGISTERS, mac_addr_2, 6);
-    _read_spi(wiznet, SIPR, COMMON_REGISTERS, ip_addr_2, 4);
-    _read_spi(wiznet, GAR, COMMON_REGISTERS, ip_gateway_addr_2, 4);
-    _read_spi(wiznet, SUBR, COMMON_REGISTERS, subnet_mask_2, 4);
-    printf("WIZNET MAC-address: 0x%X.0x%X.0x%X.0x%X.0x%X.0x%X\n",
-            mac_addr_2[0],
-            mac_addr_2[1],
-            mac_addr_2[2],
-            mac_addr_2[3],
-            mac_addr_2[4],
-            mac_addr_2[5]);
-    printf("WIZNET IP-address: %d.%d.%d.%d\n",
-            ip_addr_2[0],
-            ip_addr_2[1],
-            ip_addr_2[2],
-            ip_addr_2[3]);
-    printf("WIZNET IPgateway-address: %d.%d.%d.%d\n",
-            ip_gateway_addr_2[0],
-            ip_gateway_addr_2[1],
-            ip_gateway_addr_2[2],
-            ip_gateway_addr_2[3]);
-    printf("WIZNET subnet mask: %d.%d.%d.%d\n",
-            subnet_mask_2[0],
-            subnet_mask_2[1],
-            subnet_mask_2[2],
-            subnet_mask_2[3]);
-    printf("WIZNET version: %d\n", wiznet_get_version(wiznet));
-    // DEBUG END
 
-    uint8_t version = wiznet_get_version(wiznet);
-    return (version == 4) ? 0 : -1;
+/*
+ *  Zero the counters of the pool statistics. Current and peak usage start from the blocks
+ *  that are in use right now
+ */
+void wiznet_pool_reset_stats(wiznet_t *wiznet) {
+    for (uint8_t i=0; i<WIZNET_POOL_NUM_CLASSES; i++) {
+        wiznet_pool_stats_t *stats = &wiznet->_pool[i].stats;
+        wiznet_pool_stats_t reset = {
+            .block_size = stats->block_size,
+            .num_blocks = stats->num_blocks,
+            .in_use = stats->in_use,
+            .peak_in_use = stats->in_use
+        };
+        *stats = reset;
+    }
 }
+#endif
+
 
 
 /*
- *  Unregister Wiznet 'wiznet'
+ *  Statistics. Counters of a socket are always updated along with the ones of its Wiznet under
+ *  the lock of the Wiznet so snapshots are consistent
  */
-void wiznet_deinit(wiznet_t *wiznet) {
-    wiznet_hw_reset(wiznet);
+#if WIZNET_USE_STATS
+#define STATS_ADD(sock, field, n) do {                  \
+        _chip_lock((sock)->_host_wiznet);               \
+        (sock)->_stats.field += (n);                    \
+        (sock)->_host_wiznet->_stats.field += (n);      \
+        _chip_unlock((sock)->_host_wiznet);             \
+    } while (0)
+#else
+#define STATS_ADD(sock, field, n) do {} while (0)
+#endif
+
+
+/*
+ *  Time source of the statistics ('0' if they are disabled or 'wiznet' is NULL)
+ */
+static uint32_t _stats_clock(wiznet_t *wiznet) {
+#if WIZNET_USE_STATS
+    return (wiznet != NULL) ? _cycles(wiznet) : 0;
+#else
+    return 0;
+#endif
+}
 
-	wiznet->_id = -1;  // mark the structure as invalid from now
-    if (wiznets_cnt) wiznets_cnt--;
-    wiznets[wiznet->_id] = NULL;
+
+#if WIZNET_USE_STATS
+static void _latency_add(wiznet_latency_t *latency, uint32_t cycles) {
+    latency->calls++;
+    latency->cycles_total += cycles;
+    if (cycles > latency->cycles_max) latency->cycles_max = cycles;
+    // log4 of the latency
+    uint8_t bin = cycles ? (31-__builtin_clz(cycles))/2 : 0;
+    if (bin >= WIZNET_STATS_LATENCY_BINS) bin = WIZNET_STATS_LATENCY_BINS-1;
+    latency->bins[bin]++;
 }
+#endif
 
 
 /*
- *  Reset Wiznet using hardware pin
+ *  Account the call 'call' of socket 'sock' started at 'start' (see _stats_clock())
  */
-void wiznet_hw_reset(wiznet_t *wiznet) {
+static void _stats_latency(socket_t *sock, wiznet_stats_call_t call, uint32_t start) {
+#if WIZNET_USE_STATS
+    wiznet_t *wiznet = sock->_host_wiznet;
+    if (wiznet == NULL) return;
+    uint32_t cycles = _cycles(wiznet)-start;
+    _chip_lock(wiznet);
+    _latency_add(&sock->_stats.latency[call], cycles);
+    _latency_add(&wiznet->_stats.latency[call], cycles);
+    _chip_unlock(wiznet);
+#endif
+}
 
-    // toggle RST pin from '1' to '0' and then back to '1'
-    HAL_GPIO_WritePin(wiznet->RST_CS_Port, wiznet->RST_Pin, GPIO_PIN_RESET);
-    HAL_Delay(1);  // 500 us - from datasheet
-    HAL_GPIO_WritePin(wiznet->RST_CS_Port, wiznet->RST_Pin, GPIO_PIN_SET);
-    HAL_Delay(1);  // 1 ms - from datasheet
 
-    // wait for reset completing and PHY link up
-    uint8_t byte;
-    uint32_t timeout_start = _millis();
-    while (1) {
-        // read status
-        _read_spi(wiznet, PHYCFGR, COMMON_REGISTERS, &byte, sizeof(uint8_t));
-        // OK
-        if ((byte & (1<<PHYCFGR_RST)) && (byte & (1<<LNK))) {
-            printf("WIZNET RESET OK\n");
-            break;
-        }
-        // handle timeout
-        if ((_millis()-timeout_start) == WIZNET_TIMEOUT_RESET) {
-            printf("WIZNET RESET ERROR\n");
-            break;
-        }
+/*
+ *  Account 'num' frames 'frames' of 'wiznet' which took 'cycles' (call it under the lock of the
+ *  Wiznet). Library submits frames of a single socket at once so the time of the whole batch
+ *  goes to the socket of its first frame
+ */
+static void _stats_frames(wiznet_t *wiznet, wiznet_frame_t *frames[], uint8_t num, uint32_t cycles) {
+#if WIZNET_USE_STATS
+    wiznet->_stats.spi_cycles += cycles;
+    for (uint8_t i=0; i<num; i++) {
+        uint8_t bank = frames[i]->header[2] >> 3;
+        uint8_t block = bank & 0b11;
+        wiznet->_stats.spi_frames++;
+        wiznet->_stats.spi_bytes[block] += frames[i]->len;
+
+        socket_t *sock = (bank != COMMON_REGISTERS) ? wiznet->_sockets[bank >> 2] : NULL;
+        if (sock == NULL) continue;
+        sock->_stats.spi_frames++;
+        sock->_stats.spi_bytes[block] += frames[i]->len;
+        if (i == 0) sock->_stats.spi_cycles += cycles;
     }
+#endif
 }
 
 
+#if WIZNET_USE_STATS
 /*
- *  Get HW version of Wiznet chip from VERSIONR register. According to the datasheet, version
- *  is always should be read as 0x04
+ *  Take a snapshot of statistics of 'wiznet' (totals of all its sockets) to 'stats'
  */
-uint8_t wiznet_get_version(wiznet_t *wiznet) {
-    uint8_t version = 0;
-    _read_spi(wiznet, VERSIONR, COMMON_REGISTERS, &version, sizeof(uint8_t));
-    return version;
+void wiznet_get_stats(wiznet_t *wiznet, wiznet_stats_t *stats) {
+    _chip_lock(wiznet);
+    *stats = wiznet->_stats;
+    _chip_unlock(wiznet);
 }
 
 
 /*
- *  Single universal handler to manage all types of interrupts of given 'wiznet'. Connect
- *  INTn pin and call this function every falling edge of INTn signal. It automatically
- *  defines interrupt type and clears interrupt in the end
- *
- *  NOTE: currently only Sockets 0-7 interrupts are supported
+ *  Zero statistics of 'wiznet' (statistics of its sockets are kept)
  */
-void wiznet_isr_handler(wiznet_t *wiznet) {
+void wiznet_reset_stats(wiznet_t *wiznet) {
+    _chip_lock(wiznet);
+    memset(&wiznet->_stats, 0, sizeof(wiznet_stats_t));
+    _chip_unlock(wiznet);
+}
 
-    // read SIR register to find out what Socket trigger an interrupt
-    uint8_t sock_int_reg;
-    _read_spi(wiznet, SIR, COMMON_REGISTERS, &sock_int_reg, sizeof(uint8_t));
-//  if (!sock_int_reg) return;
-//  printf("SIR: %d\n", sock_int_reg);
 
-    // get socket with interrupt
-    socket_t *sock;
-    for (uint8_t idx=0; idx<NUM_OF_SOCKETS; idx++) {
-        if ((1<<idx) & sock_int_reg) {
-            sock = wiznet->_sockets[idx];
-            break;
-        }
-    }
+/*
+ *  Take a snapshot of statistics of socket 'sock' to 'stats'. Statistics are kept while the
+ *  socket is reopened, even on another Wiznet
+ */
+void sock_get_stats(socket_t *sock, wiznet_stats_t *stats) {
+    if (sock->_host_wiznet != NULL) _chip_lock(sock->_host_wiznet);
+    *stats = sock->_stats;
+    if (sock->_host_wiznet != NULL) _chip_unlock(sock->_host_wiznet);
+}
 
-    uint8_t sock_n_register = sock_n_registers[sock->_id];
 
-    // identify interrupt type
-    uint8_t ir_type = 0;
-    _read_spi(wiznet, Sn_IR, sock_n_register, &ir_type, sizeof(uint8_t));
-//  printf("Sn_IR: %d\n", ir_type);
-//  if (!ir_type) return;
+void sock_reset_stats(socket_t *sock) {
+    if (sock->_host_wiznet != NULL) _chip_lock(sock->_host_wiznet);
+    memset(&sock->_stats, 0, sizeof(wiznet_stats_t));
+    if (sock->_host_wiznet != NULL) _chip_unlock(sock->_host_wiznet);
+}
 
-    for (uint8_t type=0; type<NUM_OF_SOCK_IRS; type++) {
-        if ((1<<type) & ir_type) {
-            // insert your code here
-            switch (type) {
-            case SOCK_IR_CON:
-                printf("ISR: CONNECTED\n");
-                break;
-            case SOCK_IR_DISCON:
-                printf("ISR: DISCONNECTED\n");
-                break;
-            case SOCK_IR_RECV:
-                printf("ISR: RECEIVED\n");
-                break;
-            case SOCK_IR_TIMEOUT:
-                printf("ISR: TIMEOUT\n");
-                break;
-            case SOCK_IR_SEND_OK:
-                printf("ISR: SEND OK\n");
-                break;
-            }
-        }
-    }
 
-    // clear interrupt
-    _write_spi(wiznet, Sn_IR, sock_n_register, &ir_type, sizeof(uint8_t));
-    uint8_t byte = 0;
-    _write_spi(wiznet, SIR, COMMON_REGISTERS, &byte, sizeof(uint8_t));
+/*
+ *  Payload bytes (sent and received) per 1000 bytes clocked through SPI (including headers of
+ *  the frames)
+ */
+uint32_t wiznet_stats_efficiency(const wiznet_stats_t *stats) {
+    uint64_t spi_bytes = 3*(uint64_t)stats->spi_frames;
+    for (uint8_t i=0; i<NUM_OF_STATS_BLOCKS; i++) spi_bytes += stats->spi_bytes[i];
+    if (spi_bytes == 0) return 0;
+    return ((uint64_t)stats->tx_bytes + stats->rx_bytes)*1000 / spi_bytes;
 }
+#endif
 
 
 
 /*
- *  Initialize 'Socket' structure with default values. Always call this function before
- *  any other operations with Socket to prevent undefined behavior
- *
- *    ex.: socket_t my_sock = socket_t_init();
- *
+ *  Timeouts source used when polling something
  */
-socket_t socket_t_init(void) {
-
-    socket_t sock = {
-        // private members will be initialized in case of successful socket creation
-        ._id = -1,
-        ._host_wiznet = NULL,
+static uint32_t _millis(wiznet_t *wiznet) {
+    return wiznet->transport->millis(wiznet);
+}
 
-        // fill in public members in case user will forget to define them
-        .type = SOCK_TYPE_CLOSED,
-        .status = SOCK_STATUS_CLOSED,
-        .ip = {0,0,0,0},
-        .port = 0,
-        .macraw_dst = {0,0,0,0,0,0}
-    };
 
-    return sock;
+/*
+ *  Fill in the transfer descriptor 'xfer' to write (read) 'len' bytes of 'data' buffer to (from)
+ *  'addr' of 'bank'. 'callback' with 'arg' will be called after the completion
+ */
+void wiznet_xfer_prepare(wiznet_xfer_t *xfer, uint16_t addr, uint8_t bank, bool write, uint8_t *data,
+                         uint16_t len, wiznet_xfer_cb_t callback, void *arg) {
+
+    // Address Phase
+    xfer->frame.header[0] = addr >> 8;
+    xfer->frame.header[1] = addr & 0xFF;
+    // Control Phase: BSB[4:0] bits and 'Write' flag ('0' means read operation)
+    xfer->frame.header[2] = bank << 3;
+    if (write) xfer->frame.header[2] |= 1<<RWB;
+    // Data Phase
+    xfer->frame.data = data;
+    xfer->frame.len = len;
+
+    xfer->callback = callback;
+    xfer->arg = arg;
+    xfer->_next = NULL;
+    xfer->_done = false;
 }
 
 
 /*
- *  Initialize the new socket 'sock' of the 'wiznet' chip. Function automatically finds free
- *  Socket in Wiznet and assigns ID number depends on requested type of socket. It also
- *  trying to open (and connect, in case of TCP) socket. Before calling this function, fill in
- *  all necessary fields of the 'sock' structure
- *
- *  NOTE: currently TCP supports only client role
+ *  Mark 'xfer' as completed and notify its owner. Descriptor can be reused (even resubmitted)
+ *  right in the callback
  */
-sock_status_t socket(wiznet_t *wiznet, socket_t *sock) {
+static void _xfer_finish(wiznet_t *wiznet, wiznet_xfer_t *xfer) {
+    wiznet_xfer_cb_t callback = xfer->callback;
+    xfer->_done = true;
+    if (callback) callback(wiznet, xfer);
+}
 
-    // if there are no more free sockets, exit immediately
-    if (wiznet->_sockets_cnt >= NUM_OF_SOCKETS) {
-        printf("Number of sockets for this WIZNET has been exceeded\n");
-        sock->status = SOCK_STATUS_NUM_EXCEEDED;
-        return sock->status;
-    }
 
-    // for MACRAW socket, only Socket0 is suitable
-    if (sock->type == SOCK_TYPE_MACRAW) {
+/*
+ *  Wait for the turn of the caller on the shared 'bus' and take it (for a single frame)
+ */
+static void _bus_acquire(wiznet_t *wiznet, wiznet_bus_t *bus) {
+    uint32_t ticket = __atomic_fetch_add(&bus->_next_ticket, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&bus->_now_serving, __ATOMIC_ACQUIRE) != ticket) _yield(wiznet);
+}
+
+
+static void _bus_release(wiznet_bus_t *bus) {
+    __atomic_store_n(&bus->_now_serving, bus->_now_serving+1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ *  Clock 'frame' through the blocking transport. In the fixed length data mode it goes as a
+ *  sequence of 4-, 2- and 1-byte frames, the address is advanced for every one of them
+ */
+static void _transfer(wiznet_t *wiznet, wiznet_frame_t *frame) {
+#if WIZNET_USE_FDM
+    if (wiznet->fdm) {
+        uint16_t addr = (frame->header[0]<<8) | frame->header[1];
+        for (uint16_t offset=0; offset<frame->len; ) {
+            uint16_t left = frame->len - offset;
+            uint8_t len = (left >= 4) ? 4 : (left >= 2) ? 2 : 1;
+            wiznet_frame_t fixed = {
+                .header = {(addr+offset) >> 8, (addr+offset) & 0xFF,
+                           frame->header[2] | ((len == 4) ? OM_FDM_4 : (len == 2) ? OM_FDM_2 : OM_FDM_1)},
+                .data = frame->data+offset,
+                .len = len
+            };
+            wiznet->transport->transfer(wiznet, &fixed);
+            offset += len;
+        }
+        return;
+    }
+#endif
+    wiznet->transport->transfer(wiznet, frame);
+}
+
+
+/*
+ *  Put the transfer 'xfer' into the queue of 'wiznet'. Transfers are executed strictly in the
+ *  order of submission, each one as a separate CS assertion. If the transport is asynchronous
+ *  the function returns immediately, otherwise the transfer is completed (and its callback is
+ *  called) before the return
+ */
+void wiznet_xfer_submit(wiznet_t *wiznet, wiznet_xfer_t *xfer) {
+
+    xfer->_next = NULL;
+    xfer->_done = false;
+
+    // blocking transport - nothing to queue (but frames of different tasks mustn't overlap)
+    if (wiznet->transport->start == NULL) {
+        _chip_lock(wiznet);
+        if (wiznet->bus != NULL) _bus_acquire(wiznet, wiznet->bus);
+        uint32_t start = _stats_clock(wiznet);
+        _transfer(wiznet, &xfer->frame);
+        wiznet_frame_t *frame = &xfer->frame;
+        _stats_frames(wiznet, &frame, 1, _stats_clock(wiznet)-start);
+        if (wiznet->bus != NULL) _bus_release(wiznet->bus);
+        _chip_unlock(wiznet);
+        _xfer_finish(wiznet, xfer);
+        return;
+    }
+
+    uint32_t state = wiznet->transport->lock(wiznet);
+    if (wiznet->_xfer_tail) wiznet->_xfer_tail->_next = xfer;
+    else wiznet->_xfer_head = xfer;
+    wiznet->_xfer_tail = xfer;
+    bool is_idle = (wiznet->_xfer_head == xfer);
+    wiznet->transport->unlock(wiznet, state);
+
+    if (is_idle) wiznet->transport->start(wiznet, &xfer->frame);
+}
+
+
+/*
+ *  Put 'num' transfers 'xfers' into the queue of 'wiznet' in this order (see wiznet_xfer_submit()).
+ *  Blocking transports with 'transfer_batch' get up to WIZNET_XFER_BATCH_SIZE of them at once
+ *  (a shared bus is held for the whole batch) so, e.g., a Linux port spends a single system
+ *  call instead of one per frame
+ */
+void wiznet_xfer_submit_many(wiznet_t *wiznet, wiznet_xfer_t *xfers[], uint8_t num) {
+
+    bool is_fdm = false;
+#if WIZNET_USE_FDM
+    is_fdm = wiznet->fdm;
+#endif
+    if ((wiznet->transport->start != NULL) || (wiznet->transport->transfer_batch == NULL) || is_fdm) {
+        for (uint8_t i=0; i<num; i++) wiznet_xfer_submit(wiznet, xfers[i]);
+        return;
+    }
+
+    for (uint8_t first=0; first<num; first+=WIZNET_XFER_BATCH_SIZE) {
+        uint8_t batch_len = ((num-first) > WIZNET_XFER_BATCH_SIZE) ? WIZNET_XFER_BATCH_SIZE : (num-first);
+        wiznet_frame_t *frames[WIZNET_XFER_BATCH_SIZE];
+        for (uint8_t i=0; i<batch_len; i++) {
+            xfers[first+i]->_next = NULL;
+            xfers[first+i]->_done = false;
+            frames[i] = &xfers[first+i]->frame;
+        }
+
+        _chip_lock(wiznet);
+        if (wiznet->bus != NULL) _bus_acquire(wiznet, wiznet->bus);
+        uint32_t start = _stats_clock(wiznet);
+        wiznet->transport->transfer_batch(wiznet, frames, batch_len);
+        _stats_frames(wiznet, frames, batch_len, _stats_clock(wiznet)-start);
+        if (wiznet->bus != NULL) _bus_release(wiznet->bus);
+        _chip_unlock(wiznet);
+
+        for (uint8_t i=0; i<batch_len; i++) _xfer_finish(wiznet, xfers[first+i]);
+    }
+}
+
+
+bool wiznet_xfer_done(wiznet_xfer_t *xfer) {
+    return xfer->_done;
+}
+
+
+/*
+ *  Asynchronous transports call this when the frame of the transfer at the head of the queue
+ *  is over. It finishes that transfer and starts the next one
+ */
+void wiznet_xfer_complete(wiznet_t *wiznet) {
+
+    uint32_t state = wiznet->transport->lock(wiznet);
+    wiznet_xfer_t *xfer = wiznet->_xfer_head;
+    wiznet_xfer_t *next = xfer->_next;
+    wiznet->_xfer_head = next;
+    if (next == NULL) wiznet->_xfer_tail = NULL;
+    wiznet_frame_t *frame = &xfer->frame;
+    _stats_frames(wiznet, &frame, 1, 0);
+    wiznet->transport->unlock(wiznet, state);
+
+    _xfer_finish(wiznet, xfer);
+    if (next) wiznet->transport->start(wiznet, &next->frame);
+}
+
+
+/*
+ *  Submit 'xfer' and wait until it (and so all transfers queued before it) is completed. Never
+ *  call blocking functions of the library from transfer callbacks
+ */
+static void _xfer_sync(wiznet_t *wiznet, wiznet_xfer_t *xfer) {
+    wiznet_xfer_submit(wiznet, xfer);
+    while (!xfer->_done) _yield(wiznet);
+}
+
+
+/*
+ *  Submit 'num' transfers 'xfers' at once and wait until all of them are completed
+ */
+static void _xfer_sync_many(wiznet_t *wiznet, wiznet_xfer_t *xfers[], uint8_t num) {
+    wiznet_xfer_submit_many(wiznet, xfers, num);
+    while (!xfers[num-1]->_done) _yield(wiznet);
+}
+
+
+/*
+ *  Private low-level routine to write 'len' bytes of 'data' buffer to corresponding 'wiznet', 'bank'
+ *  and 'addr'
+ */
+static void _write_spi(wiznet_t *wiznet, uint16_t addr, uint8_t bank, uint8_t *data, uint16_t len) {
+    wiznet_xfer_t xfer;
+    wiznet_xfer_prepare(&xfer, addr, bank, true, data, len, NULL, NULL);
+    _xfer_sync(wiznet, &xfer);
+}
+
+
+/*
+ *  Private low-level routine to read 'len' bytes to 'buf' buffer of corresponding 'wiznet', 'bank'
+ *  and 'addr'
+ */
+static void _read_spi(wiznet_t *wiznet, uint16_t addr, uint8_t bank, uint8_t *buf, uint16_t len) {
+    wiznet_xfer_t xfer;
+    wiznet_xfer_prepare(&xfer, addr, bank, false, buf, len, NULL, NULL);
+    _xfer_sync(wiznet, &xfer);
+}
+
+
+
+/*
+ *  Coalescing of register writes. Writes to the same block are collected in the batch and then
+ *  flushed as the minimal number of frames - one per run of adjacent bytes (e.g. Sn_DIPR and
+ *  Sn_DPORT go as a single 6-byte frame). Order of writes inside the batch isn't preserved so
+ *  never put command registers (Sn_CR) here
+ */
+#define REG_BATCH_SIZE 64  // covers both common (0x0000-0x0039) and socket registers
+
+typedef struct RegBatch {
+    uint8_t bank;
+    uint64_t dirty;  // bit per byte of 'data'
+    uint8_t data[REG_BATCH_SIZE];
+} reg_batch_t;
+
+
+static void _batch_init(reg_batch_t *batch, uint8_t bank) {
+    batch->bank = bank;
+    batch->dirty = 0;
+}
+
+
+static void _batch_write(reg_batch_t *batch, uint16_t addr, uint8_t *data, uint16_t len) {
+    for (uint16_t i=0; i<len; i++) {
+        batch->data[addr+i] = data[i];
+        batch->dirty |= (uint64_t)1 << (addr+i);
+    }
+}
+
+
+static void _batch_flush(wiznet_t *wiznet, reg_batch_t *batch) {
+    // frames of the runs are submitted together (see wiznet_xfer_submit_many())
+    wiznet_xfer_t xfers[WIZNET_XFER_BATCH_SIZE];
+    wiznet_xfer_t *queue[WIZNET_XFER_BATCH_SIZE];
+    uint8_t num = 0;
+
+    uint16_t addr = 0;
+    while (batch->dirty) {
+        // find next run of adjacent dirty bytes
+        while ((batch->dirty & ((uint64_t)1 << addr)) == 0) addr++;
+        uint16_t run_start = addr;
+        while ((addr < REG_BATCH_SIZE) && (batch->dirty & ((uint64_t)1 << addr))) {
+            batch->dirty &= ~((uint64_t)1 << addr);
+            addr++;
+        }
+        wiznet_xfer_prepare(&xfers[num], run_start, batch->bank, true, &batch->data[run_start],
+                            addr-run_start, NULL, NULL);
+        queue[num] = &xfers[num];
+        num++;
+
+        if ((num == WIZNET_XFER_BATCH_SIZE) || !batch->dirty) {
+            _xfer_sync_many(wiznet, queue, num);
+            num = 0;
+        }
+    }
+}
+
+
+/*
+ *  Typed accessors of the registers generated from WIZNET_REGS table (values are in natural
+ *  byte-ordering):
+ *
+ *    _read_<name>(wiznet), _write_<name>(wiznet, value), _batch_<name>(batch, value) - common
+ *    registers;
+ *    _read_sock_<name>(wiznet, sock_n), _write_sock_<name>(wiznet, sock_n, value),
+ *    _batch_sock_<name>(batch, value), _prepare_sock_<name>(xfer, sock_n, raw, value, callback,
+ *    arg) - registers of socket 'sock_n' ('raw' keeps the encoded value till the transfer is
+ *    done).
+ *
+ *  Read-only registers have no writers and only plain ones can be batched. All accessors are
+ *  inline so for a constant socket number the address, the Control Phase and the byte-ordering
+ *  fold into constants
+ */
+#define REG_TYPE(width) REG_TYPE_##width
+#define REG_TYPE_1 uint8_t
+#define REG_TYPE_2 uint16_t
+
+static inline uint16_t _reg_decode(const uint8_t *raw, uint8_t width) {
+    return (width == 2) ? (uint16_t)((raw[0]<<8) | raw[1]) : raw[0];
+}
+
+static inline void _reg_encode(uint8_t *raw, uint16_t value, uint8_t width) {
+    if (width == 2) {
+        raw[0] = value >> 8;
+        raw[1] = value & 0xFF;
+    }
+    else raw[0] = value;
+}
+
+static inline uint16_t _read_reg(wiznet_t *wiznet, uint16_t addr, uint8_t bank, uint8_t width) {
+    uint8_t raw[2];
+    _read_spi(wiznet, addr, bank, raw, width);
+    return _reg_decode(raw, width);
+}
+
+static inline void _write_reg(wiznet_t *wiznet, uint16_t addr, uint8_t bank, uint8_t width, uint16_t value) {
+    uint8_t raw[2];
+    _reg_encode(raw, value, width);
+    _write_spi(wiznet, addr, bank, raw, width);
+}
+
+static inline void _batch_reg(reg_batch_t *batch, uint16_t addr, uint8_t width, uint16_t value) {
+    uint8_t raw[2];
+    _reg_encode(raw, value, width);
+    _batch_write(batch, addr, raw, width);
+}
+
+static inline void _prepare_reg(wiznet_xfer_t *xfer, uint16_t addr, uint8_t bank, uint8_t width, uint8_t *raw,
+                                uint16_t value, wiznet_xfer_cb_t callback, void *arg) {
+    _reg_encode(raw, value, width);
+    wiznet_xfer_prepare(xfer, addr, bank, true, raw, width, callback, arg);
+}
+
+#define REG_READER_common(name, offset, width) \
+    static inline REG_TYPE(width) _read_##name(wiznet_t *wiznet) { \
+        return _read_reg(wiznet, offset, COMMON_REGISTERS, width); \
+    }
+#define REG_READER_sock(name, offset, width) \
+    static inline REG_TYPE(width) _read_sock_##name(wiznet_t *wiznet, uint8_t sock_n) { \
+        return _read_reg(wiznet, offset, SOCK_N_REGISTERS(sock_n), width); \
+    }
+#define REG_WRITER_common(name, offset, width) \
+    static inline void _write_##name(wiznet_t *wiznet, REG_TYPE(width) value) { \
+        _write_reg(wiznet, offset, COMMON_REGISTERS, width, value); \
+    }
+#define REG_WRITER_sock(name, offset, width) \
+    static inline void _write_sock_##name(wiznet_t *wiznet, uint8_t sock_n, REG_TYPE(width) value) { \
+        _write_reg(wiznet, offset, SOCK_N_REGISTERS(sock_n), width, value); \
+    } \
+    static inline void _prepare_sock_##name(wiznet_xfer_t *xfer, uint8_t sock_n, uint8_t *raw, \
+                                            REG_TYPE(width) value, wiznet_xfer_cb_t callback, void *arg) { \
+        _prepare_reg(xfer, offset, SOCK_N_REGISTERS(sock_n), width, raw, value, callback, arg); \
+    }
+#define REG_BATCH_common(name, offset, width) \
+    static inline void _batch_##name(reg_batch_t *batch, REG_TYPE(width) value) { \
+        _batch_reg(batch, offset, width, value); \
+    }
+#define REG_BATCH_sock(name, offset, width) \
+    static inline void _batch_sock_##name(reg_batch_t *batch, REG_TYPE(width) value) { \
+        _batch_reg(batch, offset, width, value); \
+    }
+
+#define REG_ACCESSORS_RO(block, name, offset, width) \
+    REG_READER_##block(name, offset, width)
+#define REG_ACCESSORS_RW(block, name, offset, width) \
+    REG_READER_##block(name, offset, width) \
+    REG_WRITER_##block(name, offset, width) \
+    REG_BATCH_##block(name, offset, width)
+#define REG_ACCESSORS_W1C(block, name, offset, width) \
+    REG_READER_##block(name, offset, width) \
+    REG_WRITER_##block(name, offset, width)
+#define REG_ACCESSORS_CMD REG_ACCESSORS_W1C
+#define REG_ACCESSORS(name, block, offset, width, access, reset) \
+    REG_ACCESSORS_##access(block, name, offset, width)
+
+WIZNET_REGS(REG_ACCESSORS)
+
+
+/*
+ *  Socket buffer registers (Sn_TX_FSR ... Sn_RX_WR, 0x0020-0x002B) in natural byte-ordering
+ */
+typedef struct SockBufRegs {
+#define SOCK_BUF_REG_FIELD(name, block, offset, width, access, reset) REG_TYPE(width) name;
+    WIZNET_SOCK_BUF_REGS(SOCK_BUF_REG_FIELD)
+#undef SOCK_BUF_REG_FIELD
+} sock_buf_regs_t;
+
+
+/*
+ *  Fetch registers from 'first' to 'last' (inclusive) of the socket buffer registers window of
+ *  socket 'sock' in a single burst and decode them into 'regs'. Fields outside the range are
+ *  left untouched
+ */
+static void _read_sock_buf_regs(socket_t *sock, uint16_t first, uint16_t last, sock_buf_regs_t *regs) {
+
+    uint8_t window[Sn_RX_WR+2-Sn_TX_FSR];
+
+    _read_spi(sock->_host_wiznet, first, SOCK_N_REGISTERS(sock->_id), &window[first-Sn_TX_FSR], last+2-first);
+
+#define SOCK_BUF_REG_DECODE(name, block, offset, width, access, reset) \
+    if (((offset) >= first) && ((offset) <= last)) regs->name = _reg_decode(&window[(offset)-Sn_TX_FSR], width);
+    WIZNET_SOCK_BUF_REGS(SOCK_BUF_REG_DECODE)
+#undef SOCK_BUF_REG_DECODE
+}
+
+
+
+/*
+ *  Initialize 'Wiznet' structure with default values. Always call this function before
+ *  any other operations with Wiznet to prevent undefined behavior
+ *
+ *    ex.: wiznet_t my_wiznet = wiznet_t_init()
+ *
+ */
+wiznet_t wiznet_t_init(void) {
+
+    wiznet_t wiznet = {
+        // fill private members
+        ._id = -1,
+        ._sockets_cnt = 0,
+        ._sockets_taken = 0b00000000,
+        ._sockets = {NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL},
+        ._simr = 0,
+
+        // STM32 HAL by default, replace it before wiznet_init() to use another platform
+#if WIZNET_USE_HAL
+        .transport = &wiznet_hal_transport,
+#else
+        .transport = NULL,
+#endif
+        .transport_ctx = NULL,
+        .bus = NULL,
+        ._xfer_head = NULL,
+        ._xfer_tail = NULL,
+        ._int_pending = false,
+#if WIZNET_THREAD_SAFE
+        .os = NULL,
+        ._mutex = NULL,
+#endif
+
+        // fill in public members in case user will forget to define them
+        .mac_addr = {0,0,0,0,0,0},
+        .ip_addr = {0,0,0,0},
+        .ip_gateway_addr = {0,0,0,0},
+        .subnet_mask = {0,0,0,0},
+#if WIZNET_USE_FDM
+        .fdm = false,
+#endif
+        .retry_time = RTR_DEFAULT,
+        .retry_count = RCR_DEFAULT
+    };
+
+    return wiznet;
+}
+
+
+/*
+ *  Initialize new Wiznet. Before calling this function, fill in all necessary fields of
+ *  the 'wiznet' structure. Returns '0' at success and non-zero value otherwise
+ */
+int32_t wiznet_init(wiznet_t *wiznet) {
+
+#if WIZNET_USE_FDM
+    // frames are delimited only by their length so nothing else can be on the bus
+    if (wiznet->fdm && ((wiznet->transport->start != NULL) || (wiznet->bus != NULL))) {
+        printf("FDM requires a blocking transport and a dedicated SPI bus\n");
+        return -1;
+    }
+#endif
+
+    // add this Wiznet to the first free slot of the array of Wiznets (unless it's already there,
+    // i.e. re-initialized)
+    _wiznets_acquire();
+    if ((wiznet->_id < 0) || (wiznets[wiznet->_id] != wiznet)) {
+        if (wiznets_cnt >= NUM_OF_WIZNETS) {
+            _wiznets_release();
+            printf("TOO MANY WIZNETS\n");
+            return -1;
+        }
+        for (uint32_t i=0; i<NUM_OF_WIZNETS; i++) {
+            if (wiznets[i] == NULL) {
+                wiznets[i] = wiznet;
+                wiznet->_id = i;
+                wiznets_cnt++;
+                break;
+            }
+        }
+    }
+    _wiznets_release();
+
+#if WIZNET_THREAD_SAFE
+    if ((wiznet->os != NULL) && (wiznet->_mutex == NULL)) wiznet->_mutex = wiznet->os->mutex_create();
+#endif
+
+#if WIZNET_USE_POOL
+    _pool_init(wiznet);
+#endif
+
+    wiznet_hw_reset(wiznet);
+    // reset values
+    wiznet->_simr = 0;
+    memset(wiznet->_sock_cbs, 0, sizeof(wiznet->_sock_cbs));
+    memset(wiznet->_sock_cb_args, 0, sizeof(wiznet->_sock_cb_args));
+    wiznet->_events_head = 0;
+    wiznet->_events_tail = 0;
+    wiznet->_events_overflows = 0;
+    memset((uint8_t *)wiznet->_sock_events, 0, sizeof(wiznet->_sock_events));
+    wiznet->_event = NULL;
+    wiznet->_int_pending = false;
+    wiznet->_rtr = RTR_DEFAULT;
+    wiznet->_rcr = RCR_DEFAULT;
+    for (uint8_t i=0; i<NUM_OF_SOCKETS; i++) {
+        wiznet->_rx_buf_size[i] = SOCK_DEFAULT_BUF_SIZE;
+        wiznet->_sock_imr[i] = 0xFF;
+        wiznet->_tx_buf_size[i] = SOCK_DEFAULT_BUF_SIZE;
+    }
+
+    // all these registers are adjacent (0x0001-0x0014) so they go as a single frame
+    reg_batch_t batch;
+    _batch_init(&batch, COMMON_REGISTERS);
+
+    // set Interrupt Assert Waiting Time
+    _batch_intlevel(&batch, IAWT);
+
+    // set MAC address
+    _batch_write(&batch, SHAR, wiznet->mac_addr, 6);
+    // set this Wiznet' IP address
+    _batch_write(&batch, SIPR, wiznet->ip_addr, 4);
+    // set gateway' IP address
+    _batch_write(&batch, GAR, wiznet->ip_gateway_addr, 4);
+    // set subnet mask
+    _batch_write(&batch, SUBR, wiznet->subnet_mask, 4);
+
+    _batch_flush(wiznet, &batch);
+
+    // retransmission settings (written only if they differ from the defaults)
+    wiznet_set_retry(wiznet, wiznet->retry_time, wiznet->retry_count);
+
+    uint8_t version = wiznet_get_version(wiznet);
+    return (version == 4) ? 0 : -1;
+}
+
+
+/*
+ *  Unregister Wiznet 'wiznet'
+ */
+void wiznet_deinit(wiznet_t *wiznet) {
+    wiznet_hw_reset(wiznet);
+
+    _wiznets_acquire();
+    if ((wiznet->_id >= 0) && (wiznets[wiznet->_id] == wiznet)) {
+        wiznets[wiznet->_id] = NULL;
+        wiznets_cnt--;
+    }
+    _wiznets_release();
+    wiznet->_id = -1;  // mark the structure as invalid from now
+}
+
+
+/*
+ *  Initialize shared SPI bus (see wiznet_bus_t). Assign it to 'bus' of all Wiznets on that bus
+ *  before wiznet_init()
+ */
+wiznet_bus_t wiznet_bus_t_init(void) {
+
+    wiznet_bus_t bus = {
+        ._next_ticket = 0,
+        ._now_serving = 0
+    };
+
+    return bus;
+}
+
+
+/*
+ *  Reset Wiznet using hardware pin
+ */
+void wiznet_hw_reset(wiznet_t *wiznet) {
+
+    // toggle RST pin from '1' to '0' and then back to '1'
+    wiznet->transport->hw_reset(wiznet);
+
+    // wait for reset completing and PHY link up
+    uint8_t byte;
+    uint32_t timeout_start = _millis(wiznet);
+    while (1) {
+        // read status
+        byte = _read_phycfgr(wiznet);
+        // OK
+        if ((byte & (1<<PHYCFGR_RST)) && (byte & (1<<LNK))) {
+            printf("WIZNET RESET OK\n");
+            break;
+        }
+        // handle timeout
+        if ((_millis(wiznet)-timeout_start) >= WIZNET_TIMEOUT_RESET) {
+            printf("WIZNET RESET ERROR\n");
+            break;
+        }
+    }
+}
+
+
+/*
+ *  Get HW version of Wiznet chip from VERSIONR register. According to the datasheet, version
+ *  is always should be read as 0x04
+ */
+uint8_t wiznet_get_version(wiznet_t *wiznet) {
+    return _read_versionr(wiznet);
+}
+
+
+/*
+ *  Write 'retry_time' and 'retry_count' into RTR and RCR of 'wiznet' if they differ from their
+ *  shadow copies (registers are adjacent so they go as a single frame)
+ */
+static void _write_retry(wiznet_t *wiznet, uint16_t retry_time, uint8_t retry_count) {
+    if ((retry_time == wiznet->_rtr) && (retry_count == wiznet->_rcr)) return;
+    wiznet->_rtr = retry_time;
+    wiznet->_rcr = retry_count;
+    reg_batch_t batch;
+    _batch_init(&batch, COMMON_REGISTERS);
+    _batch_rtr(&batch, retry_time);
+    _batch_rcr(&batch, retry_count);
+    _batch_flush(wiznet, &batch);
+}
+
+
+/*
+ *  Set retransmission period 'retry_time' (in 100 us units) and number of retries 'retry_count'
+ *  of 'wiznet' (RTR and RCR registers). They are used by all sockets which don't have their own
+ *  settings (see sock_set_retry()). Smaller values give faster detection of a lost peer (TIMEOUT
+ *  interrupt) at the cost of more false alarms on a lossy network
+ */
+void wiznet_set_retry(wiznet_t *wiznet, uint16_t retry_time, uint8_t retry_count) {
+    _chip_lock(wiznet);
+    wiznet->retry_time = retry_time;
+    wiznet->retry_count = retry_count;
+    _write_retry(wiznet, retry_time, retry_count);
+    _chip_unlock(wiznet);
+}
+
+
+/*
+ *  Time (in milliseconds) after which the chip gives up with the given RTR and RCR values. ARP
+ *  requests are repeated with a constant period while TCP doubles it on every retry (up to the
+ *  maximum value of RTR), see "Retransmission" in the datasheet
+ */
+uint32_t wiznet_retry_timeout(uint16_t retry_time, uint8_t retry_count, bool is_tcp) {
+    uint32_t timeout = 0;
+    uint32_t period = retry_time;
+    for (uint16_t i=0; i<=retry_count; i++) {
+        timeout += period;
+        if (is_tcp) period = ((period*2) > 0xFFFF) ? 0xFFFF : period*2;
+    }
+    return timeout / 10;
+}
+
+
+/*
+ *  Retransmission settings in effect for socket 'sock'
+ */
+static void _sock_retry(socket_t *sock, uint16_t *retry_time, uint8_t *retry_count) {
+    *retry_time = sock->retry_time ? sock->retry_time : sock->_host_wiznet->retry_time;
+    *retry_count = sock->retry_time ? sock->retry_count : sock->_host_wiznet->retry_count;
+}
+
+
+/*
+ *  W5500 has only common RTR and RCR so settings of socket 'sock' are put there right before
+ *  its command
+ */
+static void _sock_apply_retry(socket_t *sock) {
+    uint16_t retry_time;
+    uint8_t retry_count;
+    _sock_retry(sock, &retry_time, &retry_count);
+    _write_retry(sock->_host_wiznet, retry_time, retry_count);
+}
+
+
+/*
+ *  Time (in milliseconds) after which the chip reports TIMEOUT for the CONNECT (DISCON) command
+ *  of socket 'sock': ARP resolving followed by TCP retransmissions
+ */
+static uint32_t _sock_retry_timeout(socket_t *sock) {
+    uint16_t retry_time;
+    uint8_t retry_count;
+    _sock_retry(sock, &retry_time, &retry_count);
+    return wiznet_retry_timeout(retry_time, retry_count, false) +
+           wiznet_retry_timeout(retry_time, retry_count, true);
+}
+
+
+/*
+ *  Put opened TCP socket 'sock' into LISTEN state (server role)
+ */
+static void _sock_listen_cmd(socket_t *sock) {
+    if (sock->status != SOCK_STATUS_INIT) return;
+    _write_sock_cr(sock->_host_wiznet, sock->_id, SOCK_CMD_LISTEN);
+    // the chip switches the state immediately
+    sock->status = SOCK_STATUS_LISTEN;
+}
+
+
+/*
+ *  Return socket 'sock' of a listener pool into LISTEN state after its connection has ended
+ */
+static void _listener_rearm(socket_t *sock) {
+    // masks of the pool are shared by its sockets so they are changed under the chip lock
+    _chip_lock(sock->_host_wiznet);
+    sock->_listener->_ready &= ~(1<<sock->_id);
+    sock->_listener->_accepted &= ~(1<<sock->_id);
+    _chip_unlock(sock->_host_wiznet);
+    sock_open(sock);
+    _sock_listen_cmd(sock);
+}
+
+
+/*
+ *  Track status 'status' of socket 'sock' of a listener pool: new connections become ready to
+ *  be accepted and closed sockets listen again
+ */
+static void _listener_update(socket_t *sock, uint8_t status) {
+    sock->status = status;
+    switch (status) {
+    case SOCK_STATUS_ESTABLISHED:
+    case SOCK_STATUS_CLOSE_WAIT:  // the peer may have sent the data and gone before accepting
+        _chip_lock(sock->_host_wiznet);
+        if (!(sock->_listener->_accepted & (1<<sock->_id))) sock->_listener->_ready |= 1<<sock->_id;
+        _chip_unlock(sock->_host_wiznet);
+        break;
+    case SOCK_STATUS_CLOSED:
+        _listener_rearm(sock);
+        break;
+    }
+}
+
+
+/*
+ *  Hand out the next ready connection of 'listener' (NULL if there are none). Address of the
+ *  peer is put into 'ip' of the socket
+ */
+static socket_t *_listener_take(sock_listener_t *listener) {
+    _chip_lock(listener->_host_wiznet);
+    uint8_t ready = listener->_ready;
+    uint8_t sock_n = 0;
+    if (ready) {
+        sock_n = __builtin_ctz(ready);
+        listener->_ready &= ~(1<<sock_n);
+        listener->_accepted |= 1<<sock_n;
+    }
+    _chip_unlock(listener->_host_wiznet);
+    if (!ready) return NULL;
+
+    socket_t *sock = listener->_host_wiznet->_sockets[sock_n];
+    // Sn_DIPR and Sn_DPORT are adjacent so they go as a single frame
+    uint8_t regs[6];
+    sock_lock(sock);
+    _read_spi(sock->_host_wiznet, Sn_DIPR, SOCK_N_REGISTERS(sock_n), regs, sizeof(regs));
+    memcpy(sock->ip, regs, 4);
+    memcpy(sock->_shadow.dipr, regs, 4);
+    sock->_shadow.dport = (regs[4]<<8) | regs[5];
+    sock_unlock(sock);
+    return sock;
+}
+
+
+/*
+ *  Give all ready connections of 'listener' to its handler
+ */
+static void _listener_dispatch(sock_listener_t *listener) {
+    if (listener->on_accept == NULL) return;
+    socket_t *sock;
+    while ((sock = _listener_take(listener)) != NULL) listener->on_accept(listener, sock, listener->arg);
+}
+
+
+/*
+ *  Finish the operation of socket 'sock' with 'status' and notify its owner. Socket of a
+ *  listener pool starts listening again right after it is closed
+ */
+static void _sock_op_finish(socket_t *sock, sock_status_t status) {
+    sock_op_cb_t callback = sock->_op_cb;
+    sock->status = status;
+    sock->_op = SOCK_OP_NONE;
+    sock->_op_cb = NULL;
+    if (callback != NULL) callback(sock, status, sock->_op_arg);
+    if ((sock->_listener != NULL) && (sock->status == SOCK_STATUS_CLOSED)) _listener_rearm(sock);
+}
+
+
+/*
+ *  Advance the operation of socket 'sock' given the current status 'status' of the socket
+ */
+static void _sock_op_step(socket_t *sock, uint8_t status) {
+
+    bool timed_out = (_millis(sock->_host_wiznet)-sock->_op_start) >= sock->_op_timeout;
+
+    switch (sock->_op) {
+    case SOCK_OP_NONE:
+        break;
+
+    case SOCK_OP_OPEN:
+        // different cases
+        if ( ((sock->type==SOCK_TYPE_UDP) && (status==SOCK_STATUS_UDP)) ||
+             ((sock->type==SOCK_TYPE_TCP) && (status==SOCK_STATUS_INIT)) ||
+             ((sock->type==SOCK_TYPE_MACRAW) && (status==SOCK_STATUS_MACRAW)) ) {
+            // the chip has initialized buffer pointers, take them once as a starting point
+            // for the shadow copies
+            sock_buf_regs_t buf_regs;
+            _read_sock_buf_regs(sock, Sn_TX_FSR, Sn_RX_WR, &buf_regs);
+            sock->_shadow.tx_wr = buf_regs.tx_wr;
+            sock->_shadow.rx_rd = buf_regs.rx_rd;
+            sock->_shadow.tx_free = buf_regs.tx_fsr;
+            sock->_send_busy = false;
+            sock->_send_timeout = false;
+#if WIZNET_USE_STATS
+            sock->_rx_full = false;
+#endif
+            _sock_op_finish(sock, status);
+        }
+        else if (timed_out) _sock_op_finish(sock, SOCK_STATUS_CANT_OPEN);
+        break;
+
+    case SOCK_OP_CONNECT:
+        // socket successfully connected to the remote server or the chip has given up
+        if ((status == SOCK_STATUS_ESTABLISHED) || (status == SOCK_STATUS_CLOSED) || timed_out)
+            _sock_op_finish(sock, status);
+        break;
+
+    case SOCK_OP_DISCON:
+    case SOCK_OP_CLOSE:
+        // socket finally goes to the close state after successful disconnection
+        if (status == SOCK_STATUS_CLOSED) _sock_op_finish(sock, SOCK_STATUS_CLOSED);
+        else if (timed_out) _sock_op_finish(sock, SOCK_STATUS_CANT_CLOSE);
+        break;
+    }
+}
+
+
+#if (WIZNET_EVENT_QUEUE_SIZE & (WIZNET_EVENT_QUEUE_SIZE-1)) != 0
+#error "WIZNET_EVENT_QUEUE_SIZE should be a power of 2"
+#endif
+
+
+/*
+ *  Put 'event' into the queue of 'wiznet' (producer side, i.e. the interrupt context). Head is
+ *  published only after the record is written so the consumer never sees a partial one
+ */
+static void _events_push(wiznet_t *wiznet, const wiznet_event_t *event) {
+    uint32_t head = wiznet->_events_head;
+    uint32_t tail = __atomic_load_n(&wiznet->_events_tail, __ATOMIC_ACQUIRE);
+    if ((head - tail) >= WIZNET_EVENT_QUEUE_SIZE) {
+        wiznet->_events_overflows++;
+        return;
+    }
+    wiznet->_events[head & (WIZNET_EVENT_QUEUE_SIZE-1)] = *event;
+    __atomic_store_n(&wiznet->_events_head, head+1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ *  Single universal handler to manage all types of interrupts of given 'wiznet'. Connect
+ *  INTn pin and call this function every falling edge of INTn signal. It does only the minimum:
+ *  walks all sockets flagged in SIR, reads their Sn_IR (along with Sn_SR), clears the flags
+ *  and puts them into the events queue. Handlers registered by sock_set_callback() are called
+ *  later by wiznet_process_events(). Flags without handlers are masked by Sn_IMR and left for
+ *  the polling code (e.g. SEND_OK for sendto())
+ *
+ *  In the thread-safe mode (or if the SPI bus is used by the main loop too) call
+ *  wiznet_isr_notify() from the interrupt instead: the handler is run by the task then.
+ *
+ *  NOTE: currently only Sockets 0-7 interrupts are supported
+ */
+void wiznet_isr_handler(wiznet_t *wiznet) {
+
+    // the only producer of the events queue at a time
+    _chip_lock(wiznet);
+
+    // read SIR register to find out what Sockets trigger an interrupt
+    uint8_t sock_int_reg = _read_sir(wiznet);
+#if WIZNET_USE_STATS
+    wiznet->_stats.interrupts++;
+#endif
+
+    wiznet_event_t event;
+    event.timestamp = _millis(wiznet);
+
+    while (sock_int_reg) {
+        uint8_t sock_n = __builtin_ctz(sock_int_reg);
+        sock_int_reg &= sock_int_reg-1;
+
+        // identify interrupt types: Sn_IR and Sn_SR are adjacent so they go as a single frame
+        uint8_t regs[2];
+        _read_spi(wiznet, Sn_IR, SOCK_N_REGISTERS(sock_n), regs, sizeof(regs));
+        uint8_t ir = regs[0] & wiznet->_sock_imr[sock_n];
+        if (!ir) continue;
+
+        // clear handled flags first so new events aren't lost (SIR is cleared by the chip)
+        _write_sock_ir(wiznet, sock_n, ir);
+        wiznet->_sock_events[sock_n]++;
+
+        // SEND_OK is taken here so the sending functions shouldn't wait for it
+        socket_t *sock = wiznet->_sockets[sock_n];
+#if WIZNET_USE_STATS
+        for (uint8_t flags=ir; flags; flags&=flags-1) {
+            uint8_t type = __builtin_ctz(flags);
+            if (type >= NUM_OF_SOCK_IRS) continue;
+            wiznet->_stats.sock_irs[type]++;
+            if (sock != NULL) sock->_stats.sock_irs[type]++;
+        }
+#endif
+        if ((sock != NULL) && (ir & ((1<<SOCK_IR_SEND_OK) | (1<<SOCK_IR_TIMEOUT)))) {
+            if (sock->_send_busy && (ir & (1<<SOCK_IR_TIMEOUT))) sock->_send_timeout = true;
+            sock->_send_busy = false;
+        }
+
+        event.sock_n = sock_n;
+        event.ir = ir;
+        event.sr = regs[1];
+        _events_push(wiznet, &event);
+    }
+
+    _chip_unlock(wiznet);
+}
+
+
+/*
+ *  ISR-safe alternative of wiznet_isr_handler(): call it every falling edge of INTn signal. It
+ *  doesn't touch SPI, only marks the interrupt as pending (and calls 'notify' hook of the OS, if
+ *  any) so the flags are read later by wiznet_process_events() (wiznet_poll(), wiznet_tick())
+ */
+void wiznet_isr_notify(wiznet_t *wiznet) {
+    __atomic_store_n(&wiznet->_int_pending, true, __ATOMIC_RELEASE);
+#if WIZNET_THREAD_SAFE
+    if ((wiznet->os != NULL) && (wiznet->os->notify != NULL)) wiznet->os->notify(wiznet);
+#endif
+}
+
+
+/*
+ *  Run wiznet_isr_handler() deferred by wiznet_isr_notify() (if any)
+ */
+static void _isr_service(wiznet_t *wiznet) {
+    if (__atomic_exchange_n(&wiznet->_int_pending, false, __ATOMIC_ACQ_REL)) wiznet_isr_handler(wiznet);
+}
+
+
+/*
+ *  Take the oldest event from the queue of 'wiznet' (consumer side) to 'event'. Returns 'false'
+ *  if the queue is empty
+ */
+static bool _events_pop(wiznet_t *wiznet, wiznet_event_t *event) {
+
+    // several tasks can drain the queue in the thread-safe mode
+    _chip_lock(wiznet);
+    uint32_t tail = wiznet->_events_tail;
+    bool is_empty = (tail == __atomic_load_n(&wiznet->_events_head, __ATOMIC_ACQUIRE));
+    if (!is_empty) {
+        *event = wiznet->_events[tail & (WIZNET_EVENT_QUEUE_SIZE-1)];
+        // the slot can be reused by the producer from now
+        __atomic_store_n(&wiznet->_events_tail, tail+1, __ATOMIC_RELEASE);
+    }
+    _chip_unlock(wiznet);
+
+    return !is_empty;
+}
+
+
+/*
+ *  Drain the events queue of 'wiznet' filled by wiznet_isr_handler() (running it first if it has
+ *  been deferred by wiznet_isr_notify()): update socket statuses and call registered handlers.
+ *  Call it from the main loop (or a task). Returns the number of processed events
+ */
+uint32_t wiznet_process_events(wiznet_t *wiznet) {
+
+    _isr_service(wiznet);
+
+    uint32_t cnt = 0;
+    wiznet_event_t event;
+    while (_events_pop(wiznet, &event)) {
+        cnt++;
+
+        socket_t *sock = wiznet->_sockets[event.sock_n];
+        if (sock == NULL) continue;
+        sock_lock(sock);
+        sock->status = event.sr;
+        // CON, DISCON or TIMEOUT can finish the non-blocking operation
+        if (sock->_op != SOCK_OP_NONE) _sock_op_step(sock, event.sr);
+        // connections of a listener pool (the event may be outdated by a re-arm so the
+        // actual status is taken)
+        else if (sock->_listener != NULL) {
+            _listener_update(sock, _read_sock_sr(wiznet, event.sock_n));
+        }
+        sock_unlock(sock);
+        if (sock->_listener != NULL) _listener_dispatch(sock->_listener);
+
+        wiznet->_event = &event;
+        uint8_t ir = event.ir;
+        while (ir) {
+            uint8_t type = __builtin_ctz(ir);
+            ir &= ir-1;
+            if (type >= NUM_OF_SOCK_IRS) continue;
+            sock_isr_cb_t callback = wiznet->_sock_cbs[event.sock_n][type];
+            if (callback != NULL) callback(sock, type, wiznet->_sock_cb_args[event.sock_n][type]);
+        }
+        wiznet->_event = NULL;
+    }
+
+    return cnt;
+}
+
+
+/*
+ *  Event whose handlers are being called by wiznet_process_events() (e.g. to get the time of the
+ *  interrupt), NULL outside of the handlers
+ */
+const wiznet_event_t *wiznet_current_event(wiznet_t *wiznet) {
+    return wiznet->_event;
+}
+
+
+/*
+ *  Number of interrupt events lost so far because wiznet_process_events() hasn't been called
+ *  in time (increase WIZNET_EVENT_QUEUE_SIZE or call it more often)
+ */
+uint32_t wiznet_events_overflows(wiznet_t *wiznet) {
+    return wiznet->_events_overflows;
+}
+
+
+/*
+ *  Write Sn_IMR of socket 'sock_n' and SIMR of 'wiznet' according to the registered handlers
+ *  (only if they have been changed)
+ */
+static void _sock_update_imr(wiznet_t *wiznet, uint8_t sock_n) {
+
+    // SIMR is shared by all sockets
+    _chip_lock(wiznet);
+
+    uint8_t imr = 0;
+    for (uint8_t type=0; type<NUM_OF_SOCK_IRS; type++)
+        if (wiznet->_sock_cbs[sock_n][type] != NULL) imr |= 1<<type;
+
+    if (imr != wiznet->_sock_imr[sock_n]) {
+        wiznet->_sock_imr[sock_n] = imr;
+        _write_sock_imr(wiznet, sock_n, imr);
+    }
+
+    uint8_t simr = imr ? (wiznet->_simr | (1<<sock_n)) : (wiznet->_simr & ~(1<<sock_n));
+    if (simr != wiznet->_simr) {
+        wiznet->_simr = simr;
+        _write_simr(wiznet, wiznet->_simr);
+    }
+
+    _chip_unlock(wiznet);
+}
+
+
+/*
+ *  Register 'callback' (with 'arg') for the interrupt 'type' of opened socket 'sock', NULL removes
+ *  it. The interrupt is enabled in the chip while it has a handler
+ */
+void sock_set_callback(socket_t *sock, sock_isr_type_t type, sock_isr_cb_t callback, void *arg) {
+    wiznet_t *wiznet = sock->_host_wiznet;
+    if ((wiznet == NULL) || (type >= NUM_OF_SOCK_IRS)) return;
+
+    _chip_lock(wiznet);
+    wiznet->_sock_cbs[sock->_id][type] = callback;
+    wiznet->_sock_cb_args[sock->_id][type] = arg;
+    _sock_update_imr(wiznet, sock->_id);
+    _chip_unlock(wiznet);
+}
+
+
+/*
+ *  Mask of 'sockets' whose every state of 'interest_set' can be signalled by an interrupt, i.e.
+ *  they have handlers (so SIMR and Sn_IMR bits) for the corresponding events
+ */
+static uint8_t _poll_by_events(wiznet_t *wiznet, const sock_poll_set_t *interest_set, uint8_t sockets) {
+    uint8_t by_events = 0;
+    while (sockets) {
+        uint8_t sock_n = __builtin_ctz(sockets);
+        sockets &= sockets-1;
+
+        uint8_t need = 0;
+        if (interest_set->readable & (1<<sock_n)) need |= 1<<SOCK_IR_RECV;
+        if (interest_set->writable & (1<<sock_n)) need |= 1<<SOCK_IR_SEND_OK;
+        if (interest_set->connected & (1<<sock_n)) need |= 1<<SOCK_IR_CON;
+        if (interest_set->closed & (1<<sock_n)) need |= (1<<SOCK_IR_DISCON) | (1<<SOCK_IR_TIMEOUT);
+        if ((wiznet->_simr & (1<<sock_n)) && ((wiznet->_sock_imr[sock_n] & need) == need)) by_events |= 1<<sock_n;
+    }
+    return by_events;
+}
+
+
+/*
+ *  Wait until any socket of 'interest_set' of 'wiznet' gets into one of the requested states
+ *  (but no longer than 'timeout_ms', '0' - check once) and put all such sockets into
+ *  'ready_out'. Returns the number of ready sockets.
+ *
+ *  Every check of a socket costs at most 2 bursts: Sn_IR-Sn_SR (for writable, connected and
+ *  closed states) and Sn_TX_FSR-Sn_RX_RSR (readable and writable). The first pass checks all the
+ *  sockets. Then a socket whose requested states are all covered by interrupt handlers (see
+ *  sock_set_callback()) is checked again only after wiznet_isr_handler() has found it in SIR,
+ *  so idle sockets cost no SPI traffic. The others are polled every pass, the CPU is given to
+ *  other tasks between the passes
+ */
+uint8_t wiznet_poll(wiznet_t *wiznet, const sock_poll_set_t *interest_set, sock_poll_set_t *ready_out,
+                    uint32_t timeout_ms) {
+
+    uint8_t sockets = (interest_set->readable | interest_set->writable | interest_set->connected |
+                       interest_set->closed) & wiznet->_sockets_taken;
+    uint8_t by_events = _poll_by_events(wiznet, interest_set, sockets);
+    uint32_t timeout_start = _millis(wiznet);
+    uint8_t events_seen[NUM_OF_SOCKETS];
+    uint8_t pending = sockets;
+
+    while (1) {
+        // taken before the check so an event coming during it isn't missed
+        for (uint8_t i=0; i<NUM_OF_SOCKETS; i++) events_seen[i] = wiznet->_sock_events[i];
+        sock_poll_set_t ready = {0};
+
+        while (pending) {
+            uint8_t sock_n = __builtin_ctz(pending);
+            pending &= pending-1;
+            uint8_t mask = 1<<sock_n;
+            socket_t *sock = wiznet->_sockets[sock_n];
+            if (sock == NULL) continue;  // being created by another task
+            sock_lock(sock);
+
+            // Sn_IR and Sn_SR are adjacent so they go as a single frame
+            uint8_t regs[2] = {0, 0};
+            if ((interest_set->writable | interest_set->connected | interest_set->closed) & mask) {
+                _read_spi(wiznet, Sn_IR, SOCK_N_REGISTERS(sock_n), regs, sizeof(regs));
+                sock->status = regs[1];
+                if ((interest_set->connected & mask) && (regs[1] == SOCK_STATUS_ESTABLISHED))
+                    ready.connected |= mask;
+                if ((interest_set->closed & mask) &&
+                    ((regs[1] == SOCK_STATUS_CLOSED) || (regs[1] == SOCK_STATUS_CLOSE_WAIT)))
+                    ready.closed |= mask;
+            }
+
+            // free and received sizes are 2 words apart so both go as a single burst if needed
+            if ((interest_set->readable | interest_set->writable) & mask) {
+                uint16_t first = (interest_set->writable & mask) ? Sn_TX_FSR : Sn_RX_RSR;
+                uint16_t last = (interest_set->readable & mask) ? Sn_RX_RSR : Sn_TX_FSR;
+                sock_buf_regs_t buf_regs;
+                _read_sock_buf_regs(sock, first, last, &buf_regs);
+                if ((interest_set->readable & mask) && buf_regs.rx_rsr) ready.readable |= mask;
+                if (interest_set->writable & mask) {
+                    sock->_shadow.tx_free = buf_regs.tx_fsr;
+                    bool send_done = !sock->_send_busy || (regs[0] & (1<<SOCK_IR_SEND_OK));
+                    if (buf_regs.tx_fsr && send_done) ready.writable |= mask;
+                }
+            }
+            sock_unlock(sock);
+        }
+
+        *ready_out = ready;
+        uint8_t ready_sockets = ready.readable | ready.writable | ready.connected | ready.closed;
+        if (ready_sockets) return __builtin_popcount(ready_sockets);
+
+        // wait for the next try: polled sockets are due at once, the others after their events
+        do {
+            if ((_millis(wiznet)-timeout_start) >= timeout_ms) return 0;
+            _isr_service(wiznet);
+            _yield(wiznet);
+            pending = sockets & ~by_events;
+            for (uint8_t i=0; i<NUM_OF_SOCKETS; i++)
+                if ((by_events & (1<<i)) && (wiznet->_sock_events[i] != events_seen[i])) pending |= 1<<i;
+        } while (!pending);
+    }
+}
+
+
+
+/*
+ *  Initialize 'Socket' structure with default values. Always call this function before
+ *  any other operations with Socket to prevent undefined behavior
+ *
+ *    ex.: socket_t my_sock = socket_t_init();
+ *
+ */
+socket_t socket_t_init(void) {
+
+    socket_t sock = {
+        // private members will be initialized in case of successful socket creation
+        ._id = -1,
+        ._host_wiznet = NULL,
+
+        ._shadow = {0},
+        ._send_busy = false,
+        ._send_timeout = false,
+        ._op = SOCK_OP_NONE,
+        ._op_cb = NULL,
+#if WIZNET_THREAD_SAFE
+        ._mutex = NULL,
+#endif
+
+        // fill in public members in case user will forget to define them
+        .type = SOCK_TYPE_CLOSED,
+        .status = SOCK_STATUS_CLOSED,
+        .ip = {0,0,0,0},
+        .port = 0,
+        .macraw_dst = {0,0,0,0,0,0},
+        .rx_buf_size = SOCK_DEFAULT_BUF_SIZE,
+        .tx_buf_size = SOCK_DEFAULT_BUF_SIZE,
+        .retry_time = 0,
+        .retry_count = 0,
+
+        ._listener = NULL
+    };
+
+    return sock;
+}
+
+
+/*
+ *  Give 'size' KB of the shared HW memory (whose per-socket sizes are 'sizes') to socket 'n'.
+ *  Memory is laid out in order of the sockets so the size of a socket can't be changed while
+ *  there are opened sockets after it. If the budget is exceeded, the trailing free sockets
+ *  (i.e. not followed by opened ones) give their memory away. Changed sizes are marked in
+ *  'changed' mask. Returns 'false' if the request can't be satisfied
+ */
+static bool _sock_alloc_buf(wiznet_t *wiznet, uint8_t *sizes, uint8_t n, uint8_t size, uint8_t *changed) {
+
+    // only powers of 2 up to the whole memory are allowed
+    if ((size > WIZNET_BUF_MEM_SIZE) || (size & (size-1))) return false;
+    if (sizes[n] == size) return true;
+
+    // opened sockets after this one would be moved
+    if (wiznet->_sockets_taken >> (n+1)) return false;
+
+    uint8_t new_sizes[NUM_OF_SOCKETS];
+    memcpy(new_sizes, sizes, sizeof(new_sizes));
+    new_sizes[n] = size;
+
+    uint32_t total = 0;
+    for (uint8_t i=0; i<NUM_OF_SOCKETS; i++) total += new_sizes[i];
+    for (uint8_t i=NUM_OF_SOCKETS-1; (total > WIZNET_BUF_MEM_SIZE) && (i > n); i--) {
+        total -= new_sizes[i];
+        new_sizes[i] = 0;
+    }
+    if (total > WIZNET_BUF_MEM_SIZE) return false;
+
+    for (uint8_t i=0; i<NUM_OF_SOCKETS; i++) {
+        if (new_sizes[i] != sizes[i]) *changed |= 1<<i;
+        sizes[i] = new_sizes[i];
+    }
+    return true;
+}
+
+
+/*
+ *  Apply HW buffer sizes requested by socket 'sock' (see _sock_alloc_buf()). Sizes of other
+ *  (free) sockets taken away are written right away, the ones of 'sock' go to 'batch'
+ */
+static bool _sock_alloc_bufs(wiznet_t *wiznet, socket_t *sock, reg_batch_t *batch) {
+
+    uint8_t rx_sizes[NUM_OF_SOCKETS], tx_sizes[NUM_OF_SOCKETS];
+    memcpy(rx_sizes, wiznet->_rx_buf_size, sizeof(rx_sizes));
+    memcpy(tx_sizes, wiznet->_tx_buf_size, sizeof(tx_sizes));
+
+    uint8_t changed = 0;
+    if (!_sock_alloc_buf(wiznet, rx_sizes, sock->_id, sock->rx_buf_size, &changed) ||
+        !_sock_alloc_buf(wiznet, tx_sizes, sock->_id, sock->tx_buf_size, &changed)) return false;
+
+    for (uint8_t i=0; i<NUM_OF_SOCKETS; i++) {
+        if ((changed & (1<<i)) == 0) continue;
+        wiznet->_rx_buf_size[i] = rx_sizes[i];
+        wiznet->_tx_buf_size[i] = tx_sizes[i];
+        // Sn_RXBUF_SIZE and Sn_TXBUF_SIZE are adjacent so they go as a single frame
+        reg_batch_t other;
+        reg_batch_t *regs = batch;
+        if (i != sock->_id) {
+            _batch_init(&other, SOCK_N_REGISTERS(i));
+            regs = &other;
+        }
+        _batch_sock_rxbuf_size(regs, rx_sizes[i]);
+        _batch_sock_txbuf_size(regs, tx_sizes[i]);
+        if (regs == &other) _batch_flush(wiznet, &other);
+    }
+    return true;
+}
+
+
+/*
+ *  Common part of socket() and socket_async(): the latter ('is_async') connects TCP socket in
+ *  the background reporting to 'callback'
+ */
+static sock_status_t _socket(wiznet_t *wiznet, socket_t *sock, bool is_async, sock_op_cb_t callback, void *arg) {
+
+    if ((sock->type != SOCK_TYPE_UDP) && (sock->type != SOCK_TYPE_TCP) && (sock->type != SOCK_TYPE_MACRAW)) {
+        printf("Unknown socket type %d\n", sock->type);
+        sock->status = SOCK_STATUS_CANT_OPEN;
+        return sock->status;
+    }
+
+#if WIZNET_USE_POOL
+    // recv_alloc() takes all the received data at once so it must fit the largest block of the pool
+    if (sock->rx_buf_size*1024UL > WIZNET_POOL_LARGE_BLOCK) {
+        printf("RX buffer of %d KB doesn't fit the pool blocks of %d bytes\n", sock->rx_buf_size,
+               WIZNET_POOL_LARGE_BLOCK);
+        sock->status = SOCK_STATUS_NO_BUF_MEM;
+        return sock->status;
+    }
+#endif
+
+    // choice of the HW socket and its memory is done under the chip lock, the socket is reserved
+    // till the end of the opening
+    _chip_lock(wiznet);
+
+    // if there are no more free sockets, exit immediately
+    if (wiznet->_sockets_cnt >= NUM_OF_SOCKETS) {
+        _chip_unlock(wiznet);
+        printf("Number of sockets for this WIZNET has been exceeded\n");
+        sock->status = SOCK_STATUS_NUM_EXCEEDED;
+        return sock->status;
+    }
+
+    // for MACRAW socket, only Socket0 is suitable
+    if (sock->type == SOCK_TYPE_MACRAW) {
         if (((1<<0) & wiznet->_sockets_taken) == 0) {
             sock->_id = 0;
         }
         else {
+            _chip_unlock(wiznet);
             printf("Socket0 for MACRAW already occupied\n");
             sock->status = SOCK_STATUS_MACRAW_TAKEN;
             return sock->status;
@@ -433,259 +1934,971 @@ sock_status_t socket(wiznet_t *wiznet, socket_t *sock) {
     // printf("id: %d, type: %d\n", sock->_id, sock->type);
 
     // choose appropriate register
-    uint8_t sock_n_register = sock_n_registers[sock->_id];
+    uint8_t sock_n_register = SOCK_N_REGISTERS(sock->_id);
     // assign host Wiznet for opening (and connection) socket. We deassign it back in case of error
     sock->_host_wiznet = wiznet;
 
-    // set mode
-    uint8_t byte;
+    // collect all settings and write them at once (adjacent registers are merged into single
+    // frames, e.g. Sn_DIPR, Sn_DPORT and Sn_MSSR)
+    reg_batch_t batch;
+    _batch_init(&batch, sock_n_register);
+
+    // size HW buffers as requested
+    if (!_sock_alloc_bufs(wiznet, sock, &batch)) {
+        _chip_unlock(wiznet);
+        printf("Can't allocate HW buffers of %d/%d KB (RX/TX) for socket #%d\n",
+               sock->rx_buf_size, sock->tx_buf_size, sock->_id);
+        sock->_id = -1;
+        sock->_host_wiznet = NULL;
+        sock->status = SOCK_STATUS_NO_BUF_MEM;
+        return sock->status;
+    }
+    wiznet->_sockets_cnt++;
+    wiznet->_sockets_taken |= (1 << sock->_id);
+    _chip_unlock(wiznet);
+
+#if WIZNET_THREAD_SAFE
+    if ((wiznet->os != NULL) && (sock->_mutex == NULL)) sock->_mutex = wiznet->os->mutex_create();
+#endif
+
+    // set mode (protocol bits of Sn_MR are the socket type) and the settings of the type
+    uint8_t byte = sock->type;
     switch (sock->type) {
     case SOCK_TYPE_UDP:
-        byte = SOCK_TYPE_UDP;
         break;
     case SOCK_TYPE_TCP:
-        byte = SOCK_TYPE_TCP;
         // set maximum segment size
-         uint16_t max_sgmnt_size = MAX_TCP_SEGMENT_SIZE;
-         max_sgmnt_size = SWAP_TWO_BYTES(max_sgmnt_size);
-         _write_spi(wiznet, Sn_MSSR, sock_n_register, (uint8_t *)&max_sgmnt_size, sizeof(uint16_t));
+        _batch_sock_mssr(&batch, MAX_TCP_SEGMENT_SIZE);
+        sock->_shadow.mssr = MAX_TCP_SEGMENT_SIZE;
         break;
     case SOCK_TYPE_MACRAW:
-        byte = SOCK_TYPE_MACRAW;
         // set MAC address of destination
-        _write_spi(wiznet, Sn_DHAR, sock_n_register, sock->macraw_dst, 6);
+        _batch_write(&batch, Sn_DHAR, sock->macraw_dst, 6);
         break;
     }
     // byte |= 1<<MULTI_MFEN;  // enable multicasting in UDP mode
-    _write_spi(wiznet, Sn_MR, sock_n_register, &byte, sizeof(uint8_t));
+    _batch_sock_mr(&batch, byte);
+    sock->_shadow.mr = byte;
+
+
+    if (sock->type != SOCK_TYPE_MACRAW) {
+        // set the same port for Source and Destination
+        _batch_sock_port(&batch, sock->port);
+        _batch_sock_dport(&batch, sock->port);
+        // set destination IP
+        _batch_write(&batch, Sn_DIPR, sock->ip, 4);
+
+        sock->_shadow.port = sock->port;
+        sock->_shadow.dport = sock->port;
+        memcpy(sock->_shadow.dipr, sock->ip, 4);
+    }
+
+    _batch_flush(wiznet, &batch);
+
+
+    // open[ and connect (listen, for a socket of a listener pool)] socket
+    sock_open(sock);
+    if (sock->type == SOCK_TYPE_TCP) {
+        if (sock->_listener != NULL) _sock_listen_cmd(sock);
+        else if (!is_async) sock_connect(sock);
+    }
+
+
+    // successful opening[ and connection]
+    if (sock->status > 0) {
+        // add socket to Wiznet
+        wiznet->_sockets[sock->_id] = sock;
+
+        // enable interrupts of this socket which have handlers (none for a new one)
+        _sock_update_imr(wiznet, sock->_id);
+
+        // connection goes on in the background
+        if (is_async) {
+            if ((sock->type == SOCK_TYPE_TCP) && (sock->_listener == NULL)) sock_connect_async(sock, callback, arg);
+            else if (callback != NULL) callback(sock, sock->status, arg);
+        }
+    }
+    // error during opening[ or connection] - undo all changes
+    else {
+        _chip_lock(wiznet);
+        wiznet->_sockets_cnt--;
+        wiznet->_sockets_taken &= ~(1 << sock->_id);
+        _chip_unlock(wiznet);
+        sock->_id = -1;
+        sock->_host_wiznet = NULL;
+    }
+
+    return sock->status;
+}
+
+
+/*
+ *  Initialize the new socket 'sock' of the 'wiznet' chip. Function automatically finds free
+ *  Socket in Wiznet and assigns ID number depends on requested type of socket. It also
+ *  trying to open (and connect, in case of TCP) socket. Before calling this function, fill in
+ *  all necessary fields of the 'sock' structure
+ *
+ *  NOTE: this is the client role of TCP, see sock_listen() for the server one
+ */
+sock_status_t socket(wiznet_t *wiznet, socket_t *sock) {
+    return _socket(wiznet, sock, false, NULL, NULL);
+}
+
+
+/*
+ *  Same as socket() but TCP connection is only started: function returns right after opening
+ *  (SOCK_STATUS_INIT) and 'callback' is called with the final status from wiznet_tick() or
+ *  wiznet_process_events(). So connections of many sockets can be established in parallel.
+ *  Socket stays registered even if the connection fails, call sock_deinit() then. For other
+ *  types 'callback' is called right away
+ */
+sock_status_t socket_async(wiznet_t *wiznet, socket_t *sock, sock_op_cb_t callback, void *arg) {
+    return _socket(wiznet, sock, true, callback, arg);
+}
+
+
+/*
+ *  Amount of free HW sockets and memory (in KB) of 'wiznet'. Only memory of the trailing free
+ *  sockets can be given away (see _sock_alloc_buf()), free sockets before opened ones keep theirs
+ */
+static void _wiznet_free_resources(wiznet_t *wiznet, uint8_t *free_socks, uint8_t *free_rx, uint8_t *free_tx) {
+    uint8_t used_rx = 0;
+    uint8_t used_tx = 0;
+    uint8_t last = wiznet->_sockets_taken ? 31-__builtin_clz(wiznet->_sockets_taken) : 0;
+    for (uint8_t i=0; (i<=last) && wiznet->_sockets_taken; i++) {
+        used_rx += wiznet->_rx_buf_size[i];
+        used_tx += wiznet->_tx_buf_size[i];
+    }
+    *free_socks = NUM_OF_SOCKETS - wiznet->_sockets_cnt;
+    *free_rx = WIZNET_BUF_MEM_SIZE - used_rx;
+    *free_tx = WIZNET_BUF_MEM_SIZE - used_tx;
+}
+
+
+/*
+ *  Choose the registered Wiznet (skipping ones in 'excluded' mask of IDs) best suited for the
+ *  new socket 'sock': the one with the most free HW sockets and then the most free HW memory.
+ *  Chips which can't fit requested buffers (or Socket0 for MACRAW) are not considered
+ */
+static wiznet_t *_wiznet_pick(const socket_t *sock, uint32_t excluded) {
+
+    wiznet_t *best = NULL;
+    uint8_t best_socks = 0;
+    uint8_t best_mem = 0;
+
+    _wiznets_acquire();
+    for (uint32_t i=0; i<NUM_OF_WIZNETS; i++) {
+        wiznet_t *wiznet = wiznets[i];
+        if ((wiznet == NULL) || (excluded & (1<<i))) continue;
+
+        uint8_t free_socks, free_rx, free_tx;
+        _wiznet_free_resources(wiznet, &free_socks, &free_rx, &free_tx);
+        if ((free_socks == 0) || (free_rx < sock->rx_buf_size) || (free_tx < sock->tx_buf_size)) continue;
+        if ((sock->type == SOCK_TYPE_MACRAW) && (wiznet->_sockets_taken & (1<<0))) continue;
+
+        uint8_t free_mem = (free_rx < free_tx) ? free_rx : free_tx;  // the scarcer one
+        if ((best == NULL) || (free_socks > best_socks) ||
+            ((free_socks == best_socks) && (free_mem > best_mem))) {
+            best = wiznet;
+            best_socks = free_socks;
+            best_mem = free_mem;
+        }
+    }
+    _wiznets_release();
+
+    return best;
+}
+
+
+/*
+ *  Choose the Wiznet for the new socket 'sock' (see socket_any()). Returns NULL if no chip has
+ *  enough resources
+ */
+wiznet_t *wiznet_pick(const socket_t *sock) {
+    return _wiznet_pick(sock, 0);
+}
+
+
+/*
+ *  Same as socket() but the chip is chosen among all registered Wiznets so the sockets are spread
+ *  evenly by the number of free HW sockets and the HW memory budget. If the chosen chip still
+ *  can't take the socket (e.g. layout of its memory doesn't allow the requested sizes) the next
+ *  one is tried. The chip can be found in '_host_wiznet' of the socket afterwards
+ */
+sock_status_t socket_any(socket_t *sock) {
+
+    uint32_t tried = 0;
+    sock->status = SOCK_STATUS_NUM_EXCEEDED;
+
+    wiznet_t *wiznet;
+    while ((wiznet = _wiznet_pick(sock, tried)) != NULL) {
+        tried |= 1<<wiznet->_id;
+        // only resources errors give a chance to another chip
+        sock_status_t status = socket(wiznet, sock);
+        if ((status != SOCK_STATUS_NO_BUF_MEM) && (status != SOCK_STATUS_NUM_EXCEEDED) &&
+            (status != SOCK_STATUS_MACRAW_TAKEN)) break;
+    }
+
+    return sock->status;
+}
+
+
+/*
+ *  Reset (almost) all meaningful registers of socket 'sock'. Other registers either aren't
+ *  important or will be overwritten at next initialization. You should call this function only
+ *  after closing the socket
+ */
+void sock_reset(socket_t *sock) {
+
+    uint8_t four_bytes[4] = {0,0,0,0};
+    uint8_t six_bytes[6] = {0,0,0,0,0,0};
+
+    // registers from Sn_PORT to Sn_MSSR are adjacent so they go as a single frame
+    reg_batch_t batch;
+    _batch_init(&batch, SOCK_N_REGISTERS(sock->_id));
+
+    // Mode Register
+    _batch_sock_mr(&batch, 0);
+    // Source Port
+    _batch_sock_port(&batch, 0);
+    // Destination Port
+    _batch_sock_dport(&batch, 0);
+    // Maximum Segment Size
+    _batch_sock_mssr(&batch, 0);
+    // MAC address of destination
+    _batch_write(&batch, Sn_DHAR, six_bytes, sizeof(six_bytes));
+    // IP address of destination
+    _batch_write(&batch, Sn_DIPR, four_bytes, sizeof(four_bytes));
+
+    _batch_flush(sock->_host_wiznet, &batch);
+
+    sock->_shadow = (sock_shadow_t){0};
+}
+
+
+/*
+ *  Function resets socket 'sock' and remove its registration in the host Wiznet. It frees
+ *  corresponding HW SocketN for reusing later
+ */
+void sock_deinit(socket_t *sock) {
+
+    sock_lock(sock);
+    _chip_lock(sock->_host_wiznet);
+
+    // leave the listener pool so the socket isn't re-armed anymore
+    if (sock->_listener != NULL) {
+        sock->_listener->_ready &= ~(1<<sock->_id);
+        sock->_listener->_accepted &= ~(1<<sock->_id);
+        sock->_listener = NULL;
+    }
+
+    sock_reset(sock);
+
+    // remove handlers and disable interrupts of this socket (SIMR and Sn_IMR are known from
+    // their shadow copies)
+    memset(sock->_host_wiznet->_sock_cbs[sock->_id], 0, sizeof(sock->_host_wiznet->_sock_cbs[0]));
+    _sock_update_imr(sock->_host_wiznet, sock->_id);
+
+    if (sock->_host_wiznet->_sockets_cnt) sock->_host_wiznet->_sockets_cnt--;
+    sock->_host_wiznet->_sockets_taken &= ~(1<<sock->_id);
+    sock->_host_wiznet->_sockets[sock->_id] = NULL;
+
+    _chip_unlock(sock->_host_wiznet);
+    sock_unlock(sock);
+}
+
+
+
+/*
+ *  Check whether all interrupts 'irqs' (mask of Sn_IR bits) of socket 'sock' are enabled, i.e.
+ *  they are taken by wiznet_isr_handler(). Sn_IMR is all '1's after the reset so SIMR is checked
+ *  too (it's set only for the sockets with handlers)
+ */
+static bool _sock_irqs_enabled(socket_t *sock, uint8_t irqs) {
+    wiznet_t *wiznet = sock->_host_wiznet;
+    return (wiznet->_simr & (1<<sock->_id)) && ((wiznet->_sock_imr[sock->_id] & irqs) == irqs);
+}
+
+
+/*
+ *  Issue command 'cmd' of the operation 'op' to socket 'sock' and return immediately. Completion
+ *  is detected by _sock_op_step()
+ */
+static void _sock_op_start(socket_t *sock, sock_op_t op, uint8_t cmd, uint32_t timeout,
+                           sock_op_cb_t callback, void *arg) {
+
+    sock_lock(sock);
+    sock->_op = op;
+    sock->_op_start = _millis(sock->_host_wiznet);
+    sock->_op_timeout = timeout;
+    sock->_op_cb = callback;
+    sock->_op_arg = arg;
+
+    // these commands involve retransmissions (RTR and RCR are shared by all sockets so they are
+    // kept till the command)
+    _chip_lock(sock->_host_wiznet);
+    if ((op == SOCK_OP_CONNECT) || (op == SOCK_OP_DISCON)) _sock_apply_retry(sock);
+    _write_sock_cr(sock->_host_wiznet, sock->_id, cmd);
+    _chip_unlock(sock->_host_wiznet);
+    sock_unlock(sock);
+}
+
+
+/*
+ *  Check whether the operation of socket 'sock' can be finished by interrupts (its flags have
+ *  handlers so Sn_IMR bits are set and wiznet_process_events() gets them)
+ */
+static bool _sock_op_by_events(socket_t *sock) {
+    switch (sock->_op) {
+    case SOCK_OP_CONNECT: return _sock_irqs_enabled(sock, (1<<SOCK_IR_CON) | (1<<SOCK_IR_TIMEOUT));
+    case SOCK_OP_DISCON: return _sock_irqs_enabled(sock, (1<<SOCK_IR_DISCON) | (1<<SOCK_IR_TIMEOUT));
+    default: return false;  // OPEN and CLOSE have no interrupts
+    }
+}
+
+
+/*
+ *  Check the operation of socket 'sock': read its status (if it can't come from interrupts)
+ *  and advance the operation
+ */
+static void _sock_op_poll(socket_t *sock) {
+    uint8_t status = sock->status;
+    if (!_sock_op_by_events(sock)) status = _read_sock_sr(sock->_host_wiznet, sock->_id);
+    _sock_op_step(sock, status);
+}
+
+
+/*
+ *  Wait for the operation of socket 'sock' to complete. Its status is read over SPI regardless
+ *  of the events queue (blocking functions may be called while events aren't processed), but if
+ *  the operation is signalled by interrupts it's read again only after an interrupt of the
+ *  socket or at the deadline. The CPU is given to other tasks while waiting
+ */
+static void _sock_op_wait(socket_t *sock) {
+    wiznet_t *wiznet = sock->_host_wiznet;
+    while (1) {
+        // taken before the status so an interrupt coming after it isn't missed
+        uint8_t events_seen = wiznet->_sock_events[sock->_id];
+        _sock_op_step(sock, _read_sock_sr(wiznet, sock->_id));
+        if (sock->_op == SOCK_OP_NONE) return;
+
+        bool by_events = _sock_op_by_events(sock);
+        do {
+            _isr_service(wiznet);
+            _yield(wiznet);
+        } while (by_events && (wiznet->_sock_events[sock->_id] == events_seen) &&
+                 ((_millis(wiznet)-sock->_op_start) < sock->_op_timeout));
+    }
+}
+
+
+/*
+ *  Advance non-blocking operations (see sock_*_async() functions) of all sockets of 'wiznet'.
+ *  Call it periodically from the main loop. Sockets whose operations are signalled by
+ *  interrupts aren't read over SPI, only their timeouts are checked (the interrupt handler
+ *  deferred by wiznet_isr_notify() is run first)
+ */
+void wiznet_tick(wiznet_t *wiznet) {
+    _isr_service(wiznet);
+
+    uint8_t sockets = wiznet->_sockets_taken;
+    while (sockets) {
+        uint8_t sock_n = __builtin_ctz(sockets);
+        sockets &= sockets-1;
+        socket_t *sock = wiznet->_sockets[sock_n];
+        if ((sock == NULL) || (sock->_op == SOCK_OP_NONE)) continue;
+        sock_lock(sock);
+        if (sock->_op != SOCK_OP_NONE) _sock_op_poll(sock);
+        sock_unlock(sock);
+    }
+}
+
+
+/*
+ *  Set own retransmission settings of socket 'sock' (see wiznet_set_retry()), they take effect
+ *  from its next CONNECT, DISCON or SEND command. 0 'retry_time' returns to the chip's settings
+ */
+void sock_set_retry(socket_t *sock, uint16_t retry_time, uint8_t retry_count) {
+    sock->retry_time = retry_time;
+    sock->retry_count = retry_count;
+}
+
+
+/*
+ *  Whether socket 'sock' has a non-blocking operation in progress
+ */
+bool sock_op_pending(socket_t *sock) {
+    return sock->_op != SOCK_OP_NONE;
+}
+
+
+/*
+ *  Send 'OPEN' command to socket 'sock' and return immediately. 'callback' is called with the
+ *  resulting status on completion
+ */
+void sock_open_async(socket_t *sock, sock_op_cb_t callback, void *arg) {
+    _sock_op_start(sock, SOCK_OP_OPEN, SOCK_CMD_OPEN, SOCK_TIMEOUT_OPEN, callback, arg);
+}
+
+
+/*
+ *  Send 'CONNECT' command to TCP socket 'sock' and return immediately (client mode). 'callback'
+ *  is called with the resulting status on completion
+ */
+void sock_connect_async(socket_t *sock, sock_op_cb_t callback, void *arg) {
+    _sock_op_start(sock, SOCK_OP_CONNECT, SOCK_CMD_CONNECT, _sock_retry_timeout(sock)+SOCK_TIMEOUT_HW_GUARD,
+                   callback, arg);
+}
+
+
+/*
+ *  Initiate disconnection process for TCP socket 'sock' and return immediately. 'callback' is
+ *  called with the resulting status on completion
+ */
+void sock_discon_async(socket_t *sock, sock_op_cb_t callback, void *arg) {
+    _sock_op_start(sock, SOCK_OP_DISCON, SOCK_CMD_DISCON, _sock_retry_timeout(sock)+SOCK_TIMEOUT_HW_GUARD,
+                   callback, arg);
+}
+
+
+/*
+ *  Close socket 'sock' of any type and return immediately. 'callback' is called with the
+ *  resulting status on completion
+ */
+void sock_close_async(socket_t *sock, sock_op_cb_t callback, void *arg) {
+    _sock_op_start(sock, SOCK_OP_CLOSE, SOCK_CMD_CLOSE, SOCK_TIMEOUT_CLOSE, callback, arg);
+}
+
+
+/*
+ *  Send 'OPEN' command to socket 'sock' and wait for its completion
+ */
+void sock_open(socket_t *sock) {
+    sock_lock(sock);
+    sock_open_async(sock, NULL, NULL);
+    _sock_op_wait(sock);
+    sock_unlock(sock);
+}
+
+
+/*
+ *  Send 'CONNECT' command to TCP socket 'sock' and wait for its completion (client mode)
+ */
+void sock_connect(socket_t *sock) {
+    uint32_t start = _stats_clock(sock->_host_wiznet);
+    sock_lock(sock);
+    sock_connect_async(sock, NULL, NULL);
+    _sock_op_wait(sock);
+    sock_unlock(sock);
+    _stats_latency(sock, WIZNET_STATS_CONNECT, start);
+}
+
+
+
+/*
+ *  Size of HW TX buffer of socket 'sock' in bytes
+ */
+static uint16_t _sock_tx_buf_size(socket_t *sock) {
+    return sock->_host_wiznet->_tx_buf_size[sock->_id] * 1024;
+}
+
+
+/*
+ *  Check (and wait until 'timeout_start'+'timeout' for) the completion of the previous SEND
+ *  command of socket 'sock': the chip mustn't get the next one until SEND_OK. Returns 'false' if
+ *  the command is still in progress or has failed (TIMEOUT flag, socket status is updated then)
+ */
+static bool _sock_send_done(socket_t *sock, uint32_t timeout_start, uint32_t timeout) {
+
+    // SEND_OK and TIMEOUT are taken by wiznet_isr_handler() so the flag is just watched
+    bool by_events = _sock_irqs_enabled(sock, (1<<SOCK_IR_SEND_OK) | (1<<SOCK_IR_TIMEOUT));
+
+    while (1) {
+        // SEND_OK can also be taken by wiznet_isr_handler()
+        if (!sock->_send_busy) {
+            if (!sock->_send_timeout) return true;
+            // socket status comes with the event
+            sock->_send_timeout = false;
+            printf("Socket #%d: SEND has timed out\n", sock->_id);
+            return false;
+        }
+
+        if (by_events) {
+            if ((_millis(sock->_host_wiznet)-timeout_start) >= timeout) return false;
+            _isr_service(sock->_host_wiznet);
+            _yield(sock->_host_wiznet);
+            continue;
+        }
+
+        // Sn_IR and Sn_SR are adjacent so they go as a single frame
+        uint8_t regs[2];
+        _read_spi(sock->_host_wiznet, Sn_IR, SOCK_N_REGISTERS(sock->_id), regs, sizeof(regs));
+
+        uint8_t flags = regs[0] & ((1<<SOCK_IR_SEND_OK) | (1<<SOCK_IR_TIMEOUT));
+        if (flags) {
+            // clear the flags by writing '1's
+            _write_sock_ir(sock->_host_wiznet, sock->_id, flags);
+            sock->_send_busy = false;
+            if (flags & (1<<SOCK_IR_SEND_OK)) return true;
+            // ARP or TCP retransmission timeout
+            sock->status = regs[1];
+            printf("Socket #%d: SEND has timed out\n", sock->_id);
+            return false;
+        }
+
+        // handle timeout
+        if ((_millis(sock->_host_wiznet)-timeout_start) >= timeout) return false;
+    }
+}
+
+
+/*
+ *  Set destination of UDP socket 'sock' to 'ip':'port'. Registers are written only if they differ
+ *  from their shadow copies (Sn_DIPR and Sn_DPORT are adjacent so both go as a single frame).
+ *  Must not be called while SEND is in progress: the datagram would go to the new destination
+ */
+static void _sock_set_dst(socket_t *sock, const uint8_t ip[4], uint16_t port) {
+
+    reg_batch_t batch;
+    _batch_init(&batch, SOCK_N_REGISTERS(sock->_id));
+
+    if (memcmp(sock->_shadow.dipr, ip, 4) != 0) {
+        memcpy(sock->_shadow.dipr, ip, 4);
+        _batch_write(&batch, Sn_DIPR, sock->_shadow.dipr, 4);
+    }
+    if (sock->_shadow.dport != port) {
+        sock->_shadow.dport = port;
+        _batch_sock_dport(&batch, port);
+    }
+
+    _batch_flush(sock->_host_wiznet, &batch);
+}
+
 
+/*
+ *  send_stream() with an optional destination 'ip':'port' (NULL 'ip' keeps the current one)
+ */
+static uint32_t _send_stream(socket_t *sock, uint8_t *data, uint32_t len, uint32_t timeout,
+                             const uint8_t *ip, uint16_t port);
 
-    if (sock->type != SOCK_TYPE_MACRAW) {
-        // set the same port for Source and Destination
-        uint16_t port = SWAP_TWO_BYTES(sock->port);
-        _write_spi(wiznet, Sn_PORT, sock_n_register, (uint8_t *)&port, sizeof(uint16_t));
-        _write_spi(wiznet, Sn_DPORT, sock_n_register, (uint8_t *)&port, sizeof(uint16_t));
-        // set destination IP
-        _write_spi(wiznet, Sn_DIPR, sock_n_register, sock->ip, 4);
-    }
 
+/*
+ *  Stream 'len' bytes of 'data' through socket 'sock'. The data is copied into HW TX buffer in
+ *  chunks of whole segments (MSS of TCP socket, whole HW TX buffer for others) and every chunk
+ *  is flushed by its own SEND command. The next chunk is copied while the previous one is still
+ *  transmitted by the chip.
+ *
+ *  With zero 'timeout' function doesn't block: it takes only as much data as fits right now
+ *  (after the previous SEND is done). Otherwise it waits for free space and SEND_OK until
+ *  'timeout' milliseconds are passed. Returns the number of bytes have been taken, the rest
+ *  should be sent by the next call. All the state is kept in 'sock' so different sockets can be
+ *  served in turns
+ */
+uint32_t send_stream(socket_t *sock, uint8_t *data, uint32_t len, uint32_t timeout) {
+    sock_lock(sock);
+    uint32_t sent = _send_stream(sock, data, len, timeout, NULL, 0);
+    sock_unlock(sock);
+    return sent;
+}
 
-    // open[ and connect] socket
-    sock_open(sock);
-    if (sock->type == SOCK_TYPE_TCP) sock_connect(sock);
 
+static uint32_t _send_stream(socket_t *sock, uint8_t *data, uint32_t len, uint32_t timeout,
+                             const uint8_t *ip, uint16_t port) {
 
-    // successful opening[ and connection]
-    if (sock->status > 0) {
-        // add socket to Wiznet
-        wiznet->_sockets_cnt++;
-        wiznet->_sockets_taken |= (1 << sock->_id);
-        wiznet->_sockets[sock->_id] = sock;
+    // choose appropriate TX buffer
+    uint8_t sock_n_tx_buffer = SOCK_N_TX_BUFFER(sock->_id);
 
-        // enable interrupt for this socket
-//      _read_spi(wiznet, SIMR, COMMON_REGISTERS, &byte, sizeof(uint8_t));
-//      byte |= 1<<sock->_id;
-//      _write_spi(wiznet, SIMR, COMMON_REGISTERS, &byte, sizeof(uint8_t));
+    uint16_t tx_buf_size = _sock_tx_buf_size(sock);
+    if (tx_buf_size == 0) {
+        printf("Socket #%d has no TX buffer\n", sock->_id);
+        return 0;
     }
-    // error during opening[ or connection] - undo all changes
-    else {
-        sock->_id = -1;
-        sock->_host_wiznet = NULL;
+    uint16_t segment_size = tx_buf_size;
+    if ((sock->type == SOCK_TYPE_TCP) && sock->_shadow.mssr && (sock->_shadow.mssr < tx_buf_size))
+        segment_size = sock->_shadow.mssr;
+    // keep the buffer double-buffered if it holds 2 segments or more: the next chunk is copied
+    // while the chip transmits the previous one
+    uint16_t max_chunk = tx_buf_size;
+    if ((tx_buf_size/2) >= segment_size) max_chunk = (tx_buf_size/2) - ((tx_buf_size/2) % segment_size);
+
+    uint32_t timeout_start = _millis(sock->_host_wiznet);
+    uint32_t sent = 0;
+    bool is_stalled = false;
+    while (sent < len) {
+        // the chip will refuse the data anyway if the previous SEND is still in progress
+        if ((timeout == 0) && !_sock_send_done(sock, timeout_start, 0)) break;
+
+        // 0. check free size. The chip only increases it while sending so SPI read is needed
+        // only if the known lower bound is not enough
+        uint16_t chunk = ((len-sent) > max_chunk) ? max_chunk : (len-sent);
+        if (sock->_shadow.tx_free < chunk) {
+            sock_buf_regs_t buf_regs;
+            _read_sock_buf_regs(sock, Sn_TX_FSR, Sn_TX_FSR, &buf_regs);
+            sock->_shadow.tx_free = buf_regs.tx_fsr;
+        }
+        if (sock->_shadow.tx_free < chunk) chunk = sock->_shadow.tx_free;
+        // take only whole segments (except the tail of the data), wait for more space if even
+        // one doesn't fit
+        if (chunk < (len-sent)) chunk -= chunk % segment_size;
+        if (chunk == 0) {
+            if (!is_stalled) STATS_ADD(sock, tx_stalls, 1);
+            is_stalled = true;
+            if ((_millis(sock->_host_wiznet)-timeout_start) >= timeout) break;
+            continue;
+        }
+        is_stalled = false;
+
+        // frames of the chunk which don't have to wait are submitted together
+        wiznet_xfer_t xfers[3];
+        wiznet_xfer_t *queue[3];
+        uint8_t num = 0;
+
+        // 1. write a data in HW TX buffer right after the data given to the chip (the pointer
+        // is moved only by us so it's known from the shadow copy). It's copied right away if the
+        // chip is still transmitting the previous chunk, otherwise it goes along with steps 3-4
+        uint16_t tx_start_ptr = sock->_shadow.tx_wr;
+        wiznet_xfer_prepare(&xfers[0], tx_start_ptr, sock_n_tx_buffer, true, data+sent, chunk, NULL, NULL);
+        if (sock->_send_busy) _xfer_sync(sock->_host_wiznet, &xfers[0]);
+        else queue[num++] = &xfers[0];
+
+        // 2. wait for the previous SEND, the copied data is dropped if it can't be flushed. Only
+        // then the destination can be changed
+        if (!_sock_send_done(sock, timeout_start, timeout)) break;
+        if (ip != NULL) _sock_set_dst(sock, ip, port);
+
+        // 3. set the pointer to the end of a data to be transmitted
+        sock->_shadow.tx_wr = chunk+tx_start_ptr;
+        sock->_shadow.tx_free -= chunk;
+        uint8_t tx_wr[2];
+        _prepare_sock_tx_wr(&xfers[1], sock->_id, tx_wr, sock->_shadow.tx_wr, NULL, NULL);
+        queue[num++] = &xfers[1];
+
+        // 4. flush (RTR and RCR are shared by all sockets so they are kept till the command)
+        _chip_lock(sock->_host_wiznet);
+        _sock_apply_retry(sock);
+        uint8_t cmd;
+        _prepare_sock_cr(&xfers[2], sock->_id, &cmd,
+                         (sock->type == SOCK_TYPE_MACRAW) ? SOCK_CMD_SEND_MAC : SOCK_CMD_SEND, NULL, NULL);
+        queue[num++] = &xfers[2];
+        _xfer_sync_many(sock->_host_wiznet, queue, num);
+        sock->_send_busy = true;
+        STATS_ADD(sock, tx_bytes, chunk);
+        _chip_unlock(sock->_host_wiznet);
+
+        sent += chunk;
     }
 
+    return sent;
+}
+
+
+/*
+ *  Send data 'data' length of 'len' to socket 'sock' (blocking). Function automatically manages
+ *  of start and end pointers. If the data is bigger than amount of space in HW TX buffer, it's
+ *  transmitted in parts as soon as the chip frees the space (see send_stream())
+ */
+void sendto(socket_t *sock, uint8_t *data, uint16_t len) {
+
     // DEBUG START
-    uint8_t ip_b[4];
-    uint16_t port_b;
-    _read_spi(wiznet, Sn_DIPR, sock_n_register, ip_b, 4);
-    _read_spi(wiznet, Sn_DPORT, sock_n_register, (uint8_t *)&port_b, sizeof(uint16_t));
-    port_b = SWAP_TWO_BYTES(port_b);
-    printf("socket status: 0x%X\n", sock->status);
-    printf("ip: %d.%d.%d.%d\n", ip_b[0], ip_b[1], ip_b[2], ip_b[3]);
-    printf("port: %d\n", port_b);
+//  printf("send from socket #%d\n", sock->_id);
     // DEBUG END
 
-    return sock->status;
+    uint32_t start = _stats_clock(sock->_host_wiznet);
+    uint32_t sent = send_stream(sock, data, len, SOCK_TIMEOUT_SEND);
+    _stats_latency(sock, WIZNET_STATS_SENDTO, start);
+    if (sent < len) printf("Socket #%d: only %lu of %u bytes have been sent\n", sock->_id,
+                           (unsigned long)sent, len);
 }
 
 
 /*
- *  Reset (almost) all meaningful registers of socket 'sock'. Other registers either aren't
- *  important or will be overwritten at next initialization. You should call this function only
- *  after closing the socket
+ *  Send datagram 'data' length of 'len' from UDP socket 'sock' to 'ip':'port' (blocking). The
+ *  destination registers are written only if it differs from the previous one (so subsequent
+ *  sendto() calls go there too). Datagram must fit into HW TX buffer. Returns number of bytes
+ *  have been sent ('0' on error)
  */
-void sock_reset(socket_t *sock) {
-
-    // choose appropriate register
-    uint8_t sock_n_register = sock_n_registers[sock->_id];
+uint16_t sendto_addr(socket_t *sock, const uint8_t ip[4], uint16_t port, uint8_t *data, uint16_t len) {
 
-    uint8_t byte = 0;
-    uint8_t two_bytes[2] = {0,0};
-    uint8_t four_bytes[4] = {0,0,0,0};
-    uint8_t six_bytes[6] = {0,0,0,0,0,0};
+    if (sock->type != SOCK_TYPE_UDP) {
+        printf("Socket #%d is not UDP\n", sock->_id);
+        return 0;
+    }
+    if (len > _sock_tx_buf_size(sock)) {
+        printf("Datagram is bigger than TX buffer of socket #%d\n", sock->_id);
+        return 0;
+    }
 
-    // Mode Register
-    _write_spi(sock->_host_wiznet, Sn_MR, sock_n_register, &byte, sizeof(uint8_t));
-    // Source Port
-    _write_spi(sock->_host_wiznet, Sn_PORT, sock_n_register, two_bytes, sizeof(two_bytes));
-    // Destination Port
-    _write_spi(sock->_host_wiznet, Sn_DPORT, sock_n_register, two_bytes, sizeof(two_bytes));
-    // Maximum Segment Size
-    _write_spi(sock->_host_wiznet, Sn_MSSR, sock_n_register, two_bytes, sizeof(two_bytes));
-    // MAC address of destination
-    _write_spi(sock->_host_wiznet, Sn_DHAR, sock_n_register, six_bytes, sizeof(six_bytes));
-    // IP address of destination
-    _write_spi(sock->_host_wiznet, Sn_DIPR, sock_n_register, four_bytes, sizeof(four_bytes));
+    uint32_t start = _stats_clock(sock->_host_wiznet);
+    sock_lock(sock);
+    uint16_t sent = _send_stream(sock, data, len, SOCK_TIMEOUT_SEND, ip, port);
+    sock_unlock(sock);
+    _stats_latency(sock, WIZNET_STATS_SENDTO, start);
+    return sent;
 }
 
 
 /*
- *  Function resets socket 'sock' and remove its registration in the host Wiznet. It frees
- *  corresponding HW SocketN for reusing later
+ *  Send 'num' datagrams described by 'msgs' (see sock_msg_t) from UDP socket 'sock'. Datagrams
+ *  for the same destination are grouped together (within each window of 32 messages, keeping
+ *  the order of their first appearance) so the destination registers are written once per
+ *  group. Copying of every datagram into HW TX buffer overlaps the transmission of the previous
+ *  one. Returns the number of sent datagrams, 'sent' flags of 'msgs' tell which ones
  */
-void sock_deinit(socket_t *sock) {
-
-    sock_reset(sock);
-
-    // disable interrupt for this socket
-    uint8_t byte;
-    _read_spi(sock->_host_wiznet, SIMR, COMMON_REGISTERS, &byte, sizeof(uint8_t));
-    byte &= ~(1<<sock->_id);
-    _write_spi(sock->_host_wiznet, SIMR, COMMON_REGISTERS, &byte, sizeof(uint8_t));
+uint16_t sendmmsg(socket_t *sock, sock_msg_t *msgs, uint16_t num) {
+
+    uint16_t cnt = 0;
+    for (uint16_t window=0; window<num; window+=32) {
+        uint16_t window_len = ((num-window) > 32) ? 32 : (num-window);
+        uint32_t pending = (window_len == 32) ? 0xFFFFFFFF : ((1UL<<window_len)-1);
+
+        while (pending) {
+            // start a group from the first pending message
+            uint8_t first = __builtin_ctz(pending);
+            sock_msg_t *dst = &msgs[window+first];
+            for (uint8_t i=first; i<window_len; i++) {
+                sock_msg_t *msg = &msgs[window+i];
+                if (((pending & (1UL<<i)) == 0) || (msg->port != dst->port) ||
+                    (memcmp(msg->ip, dst->ip, 4) != 0)) continue;
+                pending &= ~(1UL<<i);
+                msg->sent = (sendto_addr(sock, msg->ip, msg->port, msg->data, msg->len) == msg->len);
+                if (msg->sent) cnt++;
+            }
+        }
+    }
 
-    if (sock->_host_wiznet->_sockets_cnt) sock->_host_wiznet->_sockets_cnt--;
-    sock->_host_wiznet->_sockets_taken &= ~(1<<sock->_id);
-    sock->_host_wiznet->_sockets[sock->_id] = NULL;
+    return cnt;
 }
 
 
-
 /*
- *  Send 'OPEN' command to socket 'sock' and wait for its completion
+ *  sendto_async() of the locked socket
  */
-void sock_open(socket_t *sock) {
+static uint16_t _sendto_async(socket_t *sock, uint8_t *data, uint16_t len, wiznet_xfer_cb_t callback, void *arg) {
 
-    // choose appropriate register
-    uint8_t sock_n_register = sock_n_registers[sock->_id];
+    // choose appropriate TX buffer
+    uint8_t sock_n_tx_buffer = SOCK_N_TX_BUFFER(sock->_id);
 
-    // send command
-    uint8_t byte = SOCK_CMD_OPEN;
-    _write_spi(sock->_host_wiznet, Sn_CR, sock_n_register, &byte, sizeof(uint8_t));
+    if (_sock_tx_buf_size(sock) == 0) return 0;
 
-    // wait for socket opening
-    uint8_t status;
-    uint32_t timeout_start = _millis();
-    while (1) {
-        // read status
-        _read_spi(sock->_host_wiznet, Sn_SR, sock_n_register, &status, sizeof(uint8_t));
-        // different cases
-        if ( ((sock->type==SOCK_TYPE_UDP) && (status==SOCK_STATUS_UDP)) ||
-             ((sock->type==SOCK_TYPE_TCP) && (status==SOCK_STATUS_INIT)) ||
-             ((sock->type==SOCK_TYPE_MACRAW) && (status==SOCK_STATUS_MACRAW)) ) {
-            sock->status = status;
-            break;
-        }
-        // handle timeout
-        if ((_millis()-timeout_start) == SOCK_TIMEOUT_OPEN) {
-            sock->status = SOCK_STATUS_CANT_OPEN;
-            break;
-        }
+    // 0. wait for the previous transfers of the socket so its descriptors can be reused
+    while (!sock->_async_xfers[2]._done && (sock->_async_xfers[2].frame.data != NULL)) _yield(sock->_host_wiznet);
+    // the previous SEND should be completed
+    if (!_sock_send_done(sock, _millis(sock->_host_wiznet), 0)) return 0;
+
+    // check free size (read it only if the known lower bound is not enough)
+    if (sock->_shadow.tx_free < len) {
+        sock_buf_regs_t buf_regs;
+        _read_sock_buf_regs(sock, Sn_TX_FSR, Sn_TX_FSR, &buf_regs);
+        sock->_shadow.tx_free = buf_regs.tx_fsr;
+    }
+    if (len > sock->_shadow.tx_free) len = sock->_shadow.tx_free;
+    if (len == 0) {
+        STATS_ADD(sock, tx_stalls, 1);
+        return 0;
     }
+
+    // 1. the pointer of TX buffer where we need to put a data for transmitting
+    uint16_t tx_start_ptr = sock->_shadow.tx_wr;
+
+    // 2-4. queue the data, the pointer to the end of it and the flush command (RTR and RCR are
+    // shared by all sockets so they are kept till the command is queued)
+    _chip_lock(sock->_host_wiznet);
+    _sock_apply_retry(sock);
+    sock->_shadow.tx_wr = len+tx_start_ptr;
+    sock->_shadow.tx_free -= len;
+
+    wiznet_xfer_prepare(&sock->_async_xfers[0], tx_start_ptr, sock_n_tx_buffer, true, data, len, NULL, NULL);
+    _prepare_sock_tx_wr(&sock->_async_xfers[1], sock->_id, sock->_async_tx_wr, sock->_shadow.tx_wr, NULL, NULL);
+    _prepare_sock_cr(&sock->_async_xfers[2], sock->_id, &sock->_async_cmd,
+                     (sock->type == SOCK_TYPE_MACRAW) ? SOCK_CMD_SEND_MAC : SOCK_CMD_SEND, callback, arg);
+    sock->_send_busy = true;
+    wiznet_xfer_t *queue[3] = {&sock->_async_xfers[0], &sock->_async_xfers[1], &sock->_async_xfers[2]};
+    wiznet_xfer_submit_many(sock->_host_wiznet, queue, 3);
+    STATS_ADD(sock, tx_bytes, len);
+    _chip_unlock(sock->_host_wiznet);
+
+    return len;
 }
 
 
 /*
- *  Send 'CONNECT' command to TCP socket 'sock' and wait for its completion (client mode)
+ *  Non-blocking version of sendto(). Pointers are read synchronously, then the copying of the
+ *  data into HW TX buffer, the end pointer update and the flush command are queued as SPI
+ *  transfers so the function returns while the data is still clocked out (e.g. by DMA).
+ *  'callback' is called after the flush command has been transmitted, 'data' must stay valid
+ *  until then. Unlike sendto(), the data is not fragmented: function queues only as much as
+ *  fits in HW TX buffer and returns this number of bytes
  */
-void sock_connect(socket_t *sock) {
+uint16_t sendto_async(socket_t *sock, uint8_t *data, uint16_t len, wiznet_xfer_cb_t callback, void *arg) {
+    sock_lock(sock);
+    uint16_t queued = _sendto_async(sock, data, len, callback, arg);
+    sock_unlock(sock);
+    return queued;
+}
 
-    // choose appropriate register
-    uint8_t sock_n_register = sock_n_registers[sock->_id];
 
-    // send command
-    uint8_t byte = SOCK_CMD_CONNECT;
-    _write_spi(sock->_host_wiznet, Sn_CR, sock_n_register, &byte, sizeof(uint8_t));
+/*
+ *  Size of HW RX buffer of socket 'sock' in bytes
+ */
+static uint16_t _sock_rx_buf_size(socket_t *sock) {
+    return sock->_host_wiznet->_rx_buf_size[sock->_id] * 1024;
+}
+
 
-    // wait for socket connection
-    uint8_t status;
-    uint32_t timeout_start = _millis();
-    while (1) {
-        // read status
-        _read_spi(sock->_host_wiznet, Sn_SR, sock_n_register, &status, sizeof(uint8_t));
-        // socket successfully connected to the remote server
-        if (status == SOCK_STATUS_ESTABLISHED) {
-            sock->status = SOCK_STATUS_ESTABLISHED;
-            break;
-        }
-        // handle timeout
-        if ((_millis()-timeout_start) == SOCK_TIMEOUT_CONNECT) {
-            sock->status = status;
-            break;
-        }
+/*
+ *  recv_peek() of the locked socket
+ */
+static uint16_t _recv_peek(socket_t *sock, sock_rx_sink_t sink, void *arg) {
+
+    // choose appropriate RX buffer
+    uint8_t sock_n_rx_buffer = SOCK_N_RX_BUFFER(sock->_id);
+
+    // 1. read end pointer of RX buffer with our data (start pointer is moved only by us so it's
+    // known from the shadow copy)
+    sock_buf_regs_t buf_regs;
+    _read_sock_buf_regs(sock, Sn_RX_WR, Sn_RX_WR, &buf_regs);
+    uint16_t rx_start_ptr = sock->_shadow.rx_rd;
+
+    // pointers are 16-bit counters which wrap at 0xFFFF, so the difference is always right
+    uint16_t len_of_received_data = buf_regs.rx_wr - rx_start_ptr;
+#if WIZNET_USE_STATS
+    // the chip drops the input which doesn't fit with its header (TCP closes the window)
+    uint16_t min_input = (sock->type == SOCK_TYPE_UDP) ? UDP_HEADER_SIZE+1 :
+                         (sock->type == SOCK_TYPE_MACRAW) ? MACRAW_HEADER_SIZE+60 : 1;
+    uint16_t rx_buf_size = _sock_rx_buf_size(sock);
+    bool is_full = rx_buf_size && ((rx_buf_size-len_of_received_data) < min_input);
+    if (is_full && !sock->_rx_full) STATS_ADD(sock, rx_overflows, 1);
+    sock->_rx_full = is_full;
+#endif
+    if ((len_of_received_data == 0) || (sink == NULL)) return len_of_received_data;
+
+    // 2. split the data at the end of HW RX ring
+    uint16_t ring_size = _sock_rx_buf_size(sock);
+    uint16_t span_len[2];
+    span_len[0] = ring_size - (rx_start_ptr & (ring_size-1));
+    if (span_len[0] > len_of_received_data) span_len[0] = len_of_received_data;
+    span_len[1] = len_of_received_data - span_len[0];
+
+    // 3. ask for the memory and read the data (the chip wraps the addresses by itself so
+    // contiguous destination means a single burst)
+    uint8_t *span_buf[2] = {NULL, NULL};
+    span_buf[0] = sink(sock, 0, span_len[0], len_of_received_data, arg);
+    if (span_len[1]) span_buf[1] = sink(sock, span_len[0], span_len[1], len_of_received_data, arg);
+
+    if (span_buf[0] && span_len[1] && (span_buf[1] == span_buf[0]+span_len[0])) {
+        _read_spi(sock->_host_wiznet, rx_start_ptr, sock_n_rx_buffer, span_buf[0], len_of_received_data);
+    }
+    else {
+        if (span_buf[0])
+            _read_spi(sock->_host_wiznet, rx_start_ptr, sock_n_rx_buffer, span_buf[0], span_len[0]);
+        if (span_buf[1])
+            _read_spi(sock->_host_wiznet, rx_start_ptr+span_len[0], sock_n_rx_buffer, span_buf[1], span_len[1]);
     }
+
+    return len_of_received_data;
 }
 
 
+/*
+ *  Zero-copy receive. Determine the amount of unread data in HW RX buffer of socket 'sock' and
+ *  stream it right from the SPI into buffers provided by 'sink'. The data is given as at most 2
+ *  spans: from the start pointer to the end of HW RX ring and the remainder from the beginning
+ *  of the ring. For every span 'sink' is called with its offset in the unread data, its length,
+ *  total length of unread data and 'arg' and returns the memory to read the span into (or NULL
+ *  to skip it). Spans put by 'sink' one right after another are read as a single burst.
+ *
+ *  Pass NULL as 'sink' to just get the amount of unread data. Function returns this amount and
+ *  doesn't free anything in HW RX buffer: call recv_consume() when you're done with the data.
+ *  Calling recv_peek() again without consuming gives the same data
+ */
+uint16_t recv_peek(socket_t *sock, sock_rx_sink_t sink, void *arg) {
+    sock_lock(sock);
+    uint16_t len = _recv_peek(sock, sink, arg);
+    sock_unlock(sock);
+    return len;
+}
+
 
 /*
- *  Send data 'data' length of 'len' to socket 'sock'. Function automatically manages of start
- *  and end pointers. If the data is bigger than amount of space in HW TX buffer, function
- *  divides it into 2 parts and transmit them sequentionally (using recursive call)
+ *  Free first 'len' bytes of unread data in HW RX buffer of socket 'sock' (commit of the data
+ *  got by recv_peek())
  */
-void sendto(socket_t *sock, uint8_t *data, uint16_t len) {
+void recv_consume(socket_t *sock, uint16_t len) {
 
-    // DEBUG START
-//  printf("send from socket #%d\n", sock->_id);
-    // DEBUG END
+    if (len == 0) return;
 
-    // choose appropriate socket register and TX buffer
-    uint8_t sock_n_register = sock_n_registers[sock->_id];
-    uint16_t sock_n_tx_buffer = sock_n_tx_buffers[sock->_id];
+    sock_lock(sock);
 
-    // 0. check free size
-    static bool need_to_fragment = false;
-    uint8_t *ptr_to_next_fragment;
-    uint16_t len_of_next_fragment;
+    // both frames are submitted together
+    wiznet_xfer_t xfers[2];
+    wiznet_xfer_t *queue[2] = {&xfers[0], &xfers[1]};
 
-    uint16_t tx_buf_free_size;
-    _read_spi(sock->_host_wiznet, Sn_TX_FSR, sock_n_register, (uint8_t *)&tx_buf_free_size, sizeof(uint16_t));
-    tx_buf_free_size = SWAP_TWO_BYTES(tx_buf_free_size);
+    // 1. update the pointer to the end of data in RX buffer
+    sock->_shadow.rx_rd += len;
+    uint8_t rx_rd[2];
+    _prepare_sock_rx_rd(&xfers[0], sock->_id, rx_rd, sock->_shadow.rx_rd, NULL, NULL);
 
-    // fragment the data
-    if (tx_buf_free_size < len) {
-        need_to_fragment = true;
-        ptr_to_next_fragment = data+tx_buf_free_size;
-        len_of_next_fragment = len-tx_buf_free_size;
-        len = tx_buf_free_size;
-    }
-    else need_to_fragment = false;
+    // 2. send RECV command to notify Wiznet chip
+    uint8_t cmd;
+    _prepare_sock_cr(&xfers[1], sock->_id, &cmd, SOCK_CMD_RECV, NULL, NULL);
 
-    // 1. read the pointer of TX buffer where we need to put a data for transmitting
-    uint16_t tx_start_ptr;
-    _read_spi(sock->_host_wiznet, Sn_TX_RD, sock_n_register, (uint8_t *)&tx_start_ptr, sizeof(uint16_t));
-    tx_start_ptr = SWAP_TWO_BYTES(tx_start_ptr);
+    _xfer_sync_many(sock->_host_wiznet, queue, 2);
+    STATS_ADD(sock, rx_bytes, len);
+#if WIZNET_USE_STATS
+    sock->_rx_full = false;
+#endif
 
-    // 2. write a data in TX buffer
-    _write_spi(sock->_host_wiznet, tx_start_ptr, sock_n_tx_buffer, data, len);
+    sock_unlock(sock);
+}
 
-    // 3. set the pointer to the end of a data to be transmitted
-    uint16_t tx_end_ptr = len+tx_start_ptr;
-    tx_end_ptr = SWAP_TWO_BYTES(tx_end_ptr);
-    _write_spi(sock->_host_wiznet, Sn_TX_WR, sock_n_register, (uint8_t *)&tx_end_ptr, sizeof(uint16_t));
 
-    // 4. flush
-    uint8_t byte;
-    switch (sock->type) {
-    case SOCK_TYPE_TCP:
-    case SOCK_TYPE_UDP:
-        byte = SOCK_CMD_SEND;
-        break;
-    case SOCK_TYPE_MACRAW:
-        byte = SOCK_CMD_SEND_MAC;
-        break;
+/*
+ *  Sinks of recv() and recv_alloc(): put all spans into a single contiguous buffer
+ */
+typedef struct RecvBuf {
+    uint8_t *buf;
+    uint16_t buf_size;
+} recv_buf_t;
+
+static uint8_t *_recv_sink(socket_t *sock, uint16_t offset, uint16_t len, uint16_t total, void *arg) {
+    recv_buf_t *recv_buf = arg;
+    if (total > recv_buf->buf_size) return NULL;
+    return recv_buf->buf + offset;
+}
+
+static uint8_t *_recv_alloc_sink(socket_t *sock, uint16_t offset, uint16_t len, uint16_t total, void *arg) {
+    uint8_t **buf = arg;
+    if (offset == 0) {
+#if WIZNET_USE_POOL
+        // keep the block if it's big enough, otherwise exchange it for a bigger one
+        wiznet_pool_class_t *class = *buf ? _pool_class_of(sock->_host_wiznet, *buf) : NULL;
+        if ((class == NULL) || (class->stats.block_size < total)) {
+            wiznet_pool_free(sock->_host_wiznet, *buf);
+            *buf = wiznet_pool_alloc(sock->_host_wiznet, total);
+        }
+#else
+        *buf = realloc(*buf, total*sizeof(uint8_t));
+#endif
+    }
+    return *buf ? *buf+offset : NULL;
+}
+
+
+/*
+ *  recv() of the locked socket
+ */
+static uint16_t _recv(socket_t *sock, uint8_t *buf, uint16_t buf_size) {
+    // TODO: case when we do not read incoming data for a long time
+
+    recv_buf_t recv_buf = {.buf = buf, .buf_size = buf_size};
+    uint16_t len_of_received_data = _recv_peek(sock, _recv_sink, &recv_buf);
+    if (len_of_received_data > buf_size) {
+        printf("Received data is bigger than buffer\n");
+        return 0;
     }
-    _write_spi(sock->_host_wiznet, Sn_CR, sock_n_register, &byte, sizeof(uint8_t));
 
-    if (need_to_fragment) sendto(sock, ptr_to_next_fragment, len_of_next_fragment);
+    recv_consume(sock, len_of_received_data);
+    return len_of_received_data;
 }
 
 
@@ -694,54 +2907,28 @@ void sendto(socket_t *sock, uint8_t *data, uint16_t len) {
  *  determines and returns number of bytes have been read
  */
 uint16_t recv(socket_t *sock, uint8_t *buf, uint16_t buf_size) {
-    // TODO: case when we do not read incoming data for a long time
+    uint32_t start = _stats_clock(sock->_host_wiznet);
+    sock_lock(sock);
+    uint16_t len = _recv(sock, buf, buf_size);
+    sock_unlock(sock);
+    _stats_latency(sock, WIZNET_STATS_RECV, start);
+    return len;
+}
 
-    // choose appropriate socket register and RX buffer
-    uint8_t sock_n_register = sock_n_registers[sock->_id];
-    uint16_t sock_n_rx_buffer = sock_n_rx_buffers[sock->_id];
 
-    // 1. read start and end pointers of RX buffer with our data
-    uint16_t rx_start_ptr, rx_end_ptr;
-    _read_spi(sock->_host_wiznet, Sn_RX_RD, sock_n_register, (uint8_t *)&rx_start_ptr, sizeof(uint16_t));
-    _read_spi(sock->_host_wiznet, Sn_RX_WR, sock_n_register, (uint8_t *)&rx_end_ptr, sizeof(uint16_t));
-    rx_start_ptr = SWAP_TWO_BYTES(rx_start_ptr); rx_end_ptr = SWAP_TWO_BYTES(rx_end_ptr);
+/*
+ *  recv_alloc() of the locked socket
+ */
+static uint16_t _recv_alloc(socket_t *sock, uint8_t **buf) {
+    // TODO: case when we do not read incoming data for a long time
 
-    // 2. read the data (and handle different cases)
-    uint16_t len_of_received_data;
-    // no data
-    if (rx_end_ptr == rx_start_ptr) {
+    uint16_t len_of_received_data = _recv_peek(sock, _recv_alloc_sink, buf);
+    if ((len_of_received_data > 0) && (*buf == NULL)) {
+        printf("Can't allocate buffer for received data\n");
         return 0;
     }
-    // incoming data have reached the end of HW RX buffer and a remaining data were written
-    // at the start of HW RX buffer
-    else if (rx_end_ptr < rx_start_ptr) {
-        len_of_received_data = (0xFFFF-rx_start_ptr) + (rx_end_ptr-0x0000);
-        if (len_of_received_data > buf_size) {
-            printf("Received data is bigger than buffer\n");
-            return 0;
-        }
-        // we need to read the data in 2 steps: [from start to 0xFFFF] and [from 0x0000 to end]
-        _read_spi(sock->_host_wiznet, rx_start_ptr, sock_n_rx_buffer, buf, 0xFFFF-rx_start_ptr);
-        _read_spi(sock->_host_wiznet, 0x0000, sock_n_rx_buffer, buf+0xFFFF-rx_start_ptr, rx_end_ptr-0x0000);
-    }
-    // standard case
-    else {
-        len_of_received_data = rx_end_ptr-rx_start_ptr;
-        if (len_of_received_data > buf_size) {
-            printf("Received data is bigger than buffer\n");
-            return 0;
-        }
-        _read_spi(sock->_host_wiznet, rx_start_ptr, sock_n_rx_buffer, buf, len_of_received_data);
-    }
-
-    // 3. update the pointer to the end of data in RX buffer
-    rx_end_ptr = SWAP_TWO_BYTES(rx_end_ptr);
-    _write_spi(sock->_host_wiznet, Sn_RX_RD, sock_n_register, (uint8_t *)&rx_end_ptr, sizeof(uint16_t));
-
-    // 4. send RECV command to notify Wiznet chip
-    uint8_t byte = SOCK_CMD_RECV;
-    _write_spi(sock->_host_wiznet, Sn_CR, sock_n_register, &byte, sizeof(uint8_t));
 
+    recv_consume(sock, len_of_received_data);
     return len_of_received_data;
 }
 
@@ -749,115 +2936,377 @@ uint16_t recv(socket_t *sock, uint8_t *buf, uint16_t buf_size) {
 /*
  *  Read data from HW RX buffer of socket 'sock' into automatically allocated buffer associated with
  *  pointer 'buf'. Length of data is determining and returning as uint16_t value. You can reuse the
- *  same pointer but should free() it after last time
+ *  same pointer but should release it with recv_free() after last time. Buffer comes from the heap
+ *  or from the pool of the host Wiznet if WIZNET_USE_POOL is set
  */
 uint16_t recv_alloc(socket_t *sock, uint8_t **buf) {
-    // TODO: case when we do not read incoming data for a long time
+    sock_lock(sock);
+    uint16_t len = _recv_alloc(sock, buf);
+    sock_unlock(sock);
+    return len;
+}
+
+
+/*
+ *  Release the buffer of recv_alloc() and set the pointer to NULL
+ */
+void recv_free(socket_t *sock, uint8_t **buf) {
+#if WIZNET_USE_POOL
+    wiznet_pool_free(sock->_host_wiznet, *buf);
+#else
+    free(*buf);
+#endif
+    *buf = NULL;
+}
 
-    // choose appropriate socket register and RX buffer
-    uint8_t sock_n_register = sock_n_registers[sock->_id];
-    uint16_t sock_n_rx_buffer = sock_n_rx_buffers[sock->_id];
 
-    // 1. read start and end pointers of RX buffer with our data
-    uint16_t rx_start_ptr, rx_end_ptr;
-    _read_spi(sock->_host_wiznet, Sn_RX_RD, sock_n_register, (uint8_t *)&rx_start_ptr, sizeof(uint16_t));
-    _read_spi(sock->_host_wiznet, Sn_RX_WR, sock_n_register, (uint8_t *)&rx_end_ptr, sizeof(uint16_t));
-    rx_start_ptr = SWAP_TWO_BYTES(rx_start_ptr); rx_end_ptr = SWAP_TWO_BYTES(rx_end_ptr);
+/*
+ *  recvmmsg() of the locked socket
+ */
+static uint16_t _recvmmsg(socket_t *sock, sock_datagram_t *msgs, uint16_t num) {
+
+    // choose appropriate RX buffer
+    uint8_t sock_n_rx_buffer = SOCK_N_RX_BUFFER(sock->_id);
 
-    // 2. read the data (and handle different cases)
-    uint16_t len_of_received_data;
-    // no data
-    if (rx_end_ptr == rx_start_ptr) {
+    if (sock->type != SOCK_TYPE_UDP) {
+        printf("Socket #%d is not UDP\n", sock->_id);
         return 0;
     }
-    // incoming data have reached the end of HW RX buffer and a remaining data were written
-    // at the start of HW RX buffer
-    else if (rx_end_ptr < rx_start_ptr) {
-        len_of_received_data = (0xFFFF-rx_start_ptr) + (rx_end_ptr-0x0000);
-        *buf = realloc(*buf, len_of_received_data*sizeof(uint8_t));
-        // we need to read the data in 2 steps: [from start to 0xFFFF] and [from 0x0000 to end]
-        _read_spi(sock->_host_wiznet, rx_start_ptr, sock_n_rx_buffer, *buf, 0xFFFF-rx_start_ptr);
-        _read_spi(sock->_host_wiznet, 0x0000, sock_n_rx_buffer, *buf+0xFFFF-rx_start_ptr, rx_end_ptr-0x0000);
+
+    // 1. get the amount of unread data
+    uint16_t len_of_received_data = _recv_peek(sock, NULL, NULL);
+
+    // 2. walk the datagrams (the chip wraps the addresses at the end of HW RX ring by itself)
+    uint16_t rx_ptr = sock->_shadow.rx_rd;
+    uint16_t offset = 0;
+    uint8_t header[UDP_HEADER_SIZE];
+    bool header_read = false;
+    uint16_t cnt = 0;
+    while ((cnt < num) && ((len_of_received_data-offset) >= UDP_HEADER_SIZE)) {
+        if (!header_read)
+            _read_spi(sock->_host_wiznet, rx_ptr+offset, sock_n_rx_buffer, header, UDP_HEADER_SIZE);
+        header_read = false;
+
+        sock_datagram_t *msg = &msgs[cnt];
+        memcpy(msg->ip, header, 4);
+        msg->port = (header[4]<<8) | header[5];
+        msg->len = (header[6]<<8) | header[7];
+        if ((len_of_received_data-offset-UDP_HEADER_SIZE) < msg->len) break;  // incomplete datagram
+        offset += UDP_HEADER_SIZE;
+
+        uint16_t copy_len = (msg->len > msg->buf_size) ? msg->buf_size : msg->len;
+        uint16_t next_offset = offset+msg->len;
+        bool more = ((len_of_received_data-next_offset) >= UDP_HEADER_SIZE) && ((cnt+1) < num);
+        if (more && (copy_len == msg->len) && ((msg->buf_size-copy_len) >= UDP_HEADER_SIZE)) {
+            // look ahead: take the next header in the same burst
+            _read_spi(sock->_host_wiznet, rx_ptr+offset, sock_n_rx_buffer, msg->buf, copy_len+UDP_HEADER_SIZE);
+            memcpy(header, msg->buf+copy_len, UDP_HEADER_SIZE);
+            header_read = true;
+        }
+        else if (copy_len) {
+            _read_spi(sock->_host_wiznet, rx_ptr+offset, sock_n_rx_buffer, msg->buf, copy_len);
+        }
+
+        offset = next_offset;
+        cnt++;
     }
-    // normal case
-    else {
-        len_of_received_data = rx_end_ptr-rx_start_ptr;
-        *buf = realloc(*buf, len_of_received_data*sizeof(uint8_t));
-        _read_spi(sock->_host_wiznet, rx_start_ptr, sock_n_rx_buffer, *buf, len_of_received_data);
+
+    // 3. release all the datagrams at once
+    recv_consume(sock, offset);
+    return cnt;
+}
+
+
+/*
+ *  Receive up to 'num' datagrams from HW RX buffer of UDP socket 'sock' into 'msgs' (see
+ *  sock_datagram_t). The chip puts an 8-byte header before every datagram: source IP, port and
+ *  length of the datagram. All of them are released at once (single Sn_RX_RD update and RECV
+ *  command). Payload of the datagram and the header of the next one are read as a single burst
+ *  if the buffer has 8 spare bytes for it. Returns the number of received datagrams
+ */
+uint16_t recvmmsg(socket_t *sock, sock_datagram_t *msgs, uint16_t num) {
+    sock_lock(sock);
+    uint16_t cnt = _recvmmsg(sock, msgs, num);
+    sock_unlock(sock);
+    return cnt;
+}
+
+
+/*
+ *  Receive single datagram from UDP socket 'sock' into 'buf' with size of 'buf_size'. Source
+ *  address is put into 'ip' and 'port' (pass NULLs if not needed). Returns the number of bytes
+ *  have been written into 'buf' (datagrams bigger than it are truncated), '0' if there is nothing
+ */
+uint16_t recvfrom(socket_t *sock, uint8_t *buf, uint16_t buf_size, uint8_t ip[4], uint16_t *port) {
+
+    uint32_t start = _stats_clock(sock->_host_wiznet);
+    sock_datagram_t msg = {.buf = buf, .buf_size = buf_size};
+    uint16_t cnt = recvmmsg(sock, &msg, 1);
+    _stats_latency(sock, WIZNET_STATS_RECV, start);
+    if (cnt == 0) return 0;
+
+    if (msg.len > buf_size) {
+        printf("Received datagram is bigger than buffer\n");
+        msg.len = buf_size;
     }
+    if (ip != NULL) memcpy(ip, msg.ip, 4);
+    if (port != NULL) *port = msg.port;
+    return msg.len;
+}
 
-    // 3. update the pointer to the end of data in RX buffer
-    rx_end_ptr = SWAP_TWO_BYTES(rx_end_ptr);
-    _write_spi(sock->_host_wiznet, Sn_RX_RD, sock_n_register, (uint8_t *)&rx_end_ptr, sizeof(uint16_t));
 
-    // 4. send RECV command to notify Wiznet chip
-    uint8_t byte = SOCK_CMD_RECV;
-    _write_spi(sock->_host_wiznet, Sn_CR, sock_n_register, &byte, sizeof(uint8_t));
+/*
+ *  Prepare the ring 'ring' of 'num_slots' slots of 'slot_size' bytes each. 'slots' and 'lens'
+ *  arrays are provided by the user. Make slots 2 bytes bigger than the biggest expected frame
+ *  to read each frame along with the header of the next one in a single burst
+ */
+void sock_frame_ring_init(sock_frame_ring_t *ring, uint8_t *slots, uint16_t *lens, uint16_t slot_size,
+                          uint16_t num_slots) {
+    ring->slots = slots;
+    ring->lens = lens;
+    ring->slot_size = slot_size;
+    ring->num_slots = num_slots;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->frames = 0;
+    ring->drops = 0;
+}
 
-    return len_of_received_data;
+
+/*
+ *  Get the oldest frame of the ring 'ring' (and its length to 'len') without removing it.
+ *  Returns NULL if the ring is empty
+ */
+uint8_t *sock_frame_ring_peek(sock_frame_ring_t *ring, uint16_t *len) {
+    if (ring->head == ring->tail) return NULL;
+    uint16_t slot = ring->tail % ring->num_slots;
+    *len = ring->lens[slot];
+    return ring->slots + slot*ring->slot_size;
 }
 
 
+/*
+ *  Remove the oldest frame of the ring 'ring' giving its slot back to the receiver
+ */
+void sock_frame_ring_pop(sock_frame_ring_t *ring) {
+    if (ring->head != ring->tail) ring->tail++;
+}
+
 
 /*
- *  Initiate disconnection process for TCP socket 'sock'
+ *  recv_macraw() of the locked socket
  */
-void sock_discon(socket_t *sock) {
+static uint16_t _recv_macraw(socket_t *sock, sock_frame_ring_t *ring, sock_frame_batch_t *batch) {
 
-    // choose appropriate socket register
-    uint8_t sock_n_register = sock_n_registers[sock->_id];
+    // choose appropriate RX buffer
+    uint8_t sock_n_rx_buffer = SOCK_N_RX_BUFFER(sock->_id);
 
-    // disconnect TCP socket
-    uint8_t byte = SOCK_CMD_DISCON;
-    _write_spi(sock->_host_wiznet, Sn_CR, sock_n_register, &byte, sizeof(uint8_t));
+    sock_frame_batch_t result = {0};
 
-    // check status
-    uint8_t status;
-    uint32_t timeout_start = _millis();
-    while (1) {
-        // read status
-        _read_spi(sock->_host_wiznet, Sn_SR, sock_n_register, &status, sizeof(uint8_t));
-        // socket finally goes to the close state after successful disconnection
-        if (status == SOCK_STATUS_CLOSED) {
-            sock->status = SOCK_STATUS_CLOSED;
-            break;
+    if (sock->type != SOCK_TYPE_MACRAW) {
+        printf("Socket #%d is not MACRAW\n", sock->_id);
+        if (batch != NULL) *batch = result;
+        return 0;
+    }
+
+    // 1. get the amount of unread data
+    uint16_t len_of_received_data = _recv_peek(sock, NULL, NULL);
+
+    // 2. walk the frames (the chip wraps the addresses at the end of HW RX ring by itself)
+    uint16_t rx_ptr = sock->_shadow.rx_rd;
+    uint16_t offset = 0;
+    uint8_t header[MACRAW_HEADER_SIZE];
+    bool header_read = false;
+    while ((len_of_received_data-offset) >= MACRAW_HEADER_SIZE) {
+        uint16_t head = ring->head;
+        bool slot_free = (uint16_t)(head - ring->tail) < ring->num_slots;
+
+        if (!header_read)
+            _read_spi(sock->_host_wiznet, rx_ptr+offset, sock_n_rx_buffer, header, MACRAW_HEADER_SIZE);
+        header_read = false;
+
+        uint16_t frame_len = (header[0]<<8) | header[1];
+        if ((frame_len < MACRAW_HEADER_SIZE) || (frame_len > (len_of_received_data-offset))) break;
+        frame_len -= MACRAW_HEADER_SIZE;
+
+        // frame will be dropped anyway so it's fine to skip it even if the ring is full
+        if (frame_len > ring->slot_size) {
+            result.drops++;
+            offset += MACRAW_HEADER_SIZE+frame_len;
+            continue;
         }
-        // handle timeout
-        else if ((_millis()-timeout_start) == SOCK_TIMEOUT_DISCON) {
-            sock->status = SOCK_STATUS_CANT_CLOSE;
+        if (!slot_free) {
+            result.ring_full = true;
             break;
         }
+        offset += MACRAW_HEADER_SIZE;
+
+        uint16_t slot = head % ring->num_slots;
+        uint8_t *slot_buf = ring->slots + slot*ring->slot_size;
+        uint16_t next_offset = offset+frame_len;
+        bool more = ((len_of_received_data-next_offset) >= MACRAW_HEADER_SIZE);
+        if (more && ((ring->slot_size-frame_len) >= MACRAW_HEADER_SIZE)) {
+            // look ahead: take the next header in the same burst
+            _read_spi(sock->_host_wiznet, rx_ptr+offset, sock_n_rx_buffer, slot_buf, frame_len+MACRAW_HEADER_SIZE);
+            memcpy(header, slot_buf+frame_len, MACRAW_HEADER_SIZE);
+            header_read = true;
+        }
+        else if (frame_len) {
+            _read_spi(sock->_host_wiznet, rx_ptr+offset, sock_n_rx_buffer, slot_buf, frame_len);
+        }
+
+        ring->lens[slot] = frame_len;
+        ring->head = head+1;  // publish the frame
+        offset = next_offset;
+        result.frames++;
+        result.bytes += frame_len;
     }
+
+    // 3. release all the frames at once
+    recv_consume(sock, offset);
+
+    ring->frames += result.frames;
+    ring->drops += result.drops;
+    if (batch != NULL) *batch = result;
+    return result.frames;
+}
+
+
+/*
+ *  Drain MACRAW frames from HW RX buffer of socket 'sock' into free slots of the ring 'ring'.
+ *  Every frame in HW RX buffer has a 2-byte header with its length (including the header).
+ *  Frames bigger than a slot are dropped, frames that don't fit into the ring are left in HW RX
+ *  buffer till the next call. All taken frames are released at once (single Sn_RX_RD update and
+ *  RECV command). Results of the batch are put into 'batch' (can be NULL), the number of frames
+ *  put into the ring is returned
+ */
+uint16_t recv_macraw(socket_t *sock, sock_frame_ring_t *ring, sock_frame_batch_t *batch) {
+    sock_lock(sock);
+    uint16_t frames = _recv_macraw(sock, ring, batch);
+    sock_unlock(sock);
+    return frames;
+}
+
+
+
+/*
+ *  Initiate disconnection process for TCP socket 'sock' and wait for its completion
+ */
+void sock_discon(socket_t *sock) {
+    sock_lock(sock);
+    sock_discon_async(sock, NULL, NULL);
+    _sock_op_wait(sock);
+    sock_unlock(sock);
 }
 
 
 /*
- *  Close socket 'sock' of any type
+ *  Close socket 'sock' of any type and wait for its completion
  */
 void sock_close(socket_t *sock) {
+    sock_lock(sock);
+    sock_close_async(sock, NULL, NULL);
+    _sock_op_wait(sock);
+    sock_unlock(sock);
+}
 
-    // choose appropriate socket register
-    uint8_t sock_n_register = sock_n_registers[sock->_id];
 
-    // close socket regardless of its type and current status
-    uint8_t byte = SOCK_CMD_CLOSE;
-    _write_spi(sock->_host_wiznet, Sn_CR, sock_n_register, &byte, sizeof(uint8_t));
 
-    // check status
-    uint8_t status;
-    uint32_t timeout_start = _millis();
-    while (1) {
-        // read status
-        _read_spi(sock->_host_wiznet, Sn_SR, sock_n_register, &status, sizeof(uint8_t));
-        // operation is OK
-        if (status == SOCK_STATUS_CLOSED) {
-            sock->status = SOCK_STATUS_CLOSED;
-            break;
-        }
-        // handle timeout
-        else if ((_millis()-timeout_start) == SOCK_TIMEOUT_CLOSE) {
-            sock->status = SOCK_STATUS_CANT_CLOSE;
-            break;
-        }
+/*
+ *  Initialize listener (pool of TCP server sockets) with default values. Set 'port' and
+ *  optionally 'on_accept' handler before calling sock_listen()
+ */
+sock_listener_t sock_listener_t_init(void) {
+
+    sock_listener_t listener = {
+        ._host_wiznet = NULL,
+        ._socks = NULL,
+        ._num = 0,
+        ._ready = 0,
+        ._accepted = 0,
+
+        .port = 0,
+        .on_accept = NULL,
+        .arg = NULL
+    };
+
+    return listener;
+}
+
+
+/*
+ *  Open 'num' TCP sockets 'socks' (initialized by socket_t_init(), sizes of HW buffers can be
+ *  set) of the 'wiznet' chip in LISTEN state on the 'port' of 'listener'. Every socket takes one
+ *  connection so they act as an accept backlog: while some of them are busy with the clients
+ *  the others still listen, and a socket listens again as soon as its connection is closed (by
+ *  either side). Returns the number of listening sockets
+ */
+uint8_t sock_listen(wiznet_t *wiznet, sock_listener_t *listener, socket_t socks[], uint8_t num) {
+
+    listener->_host_wiznet = wiznet;
+    listener->_socks = socks;
+    listener->_num = num;
+    listener->_ready = 0;
+    listener->_accepted = 0;
+
+    uint8_t listening = 0;
+    for (uint8_t i=0; i<num; i++) {
+        socks[i].type = SOCK_TYPE_TCP;
+        socks[i].port = listener->port;
+        socks[i]._listener = listener;
+        if (_socket(wiznet, &socks[i], false, NULL, NULL) == SOCK_STATUS_LISTEN) listening++;
+        else socks[i]._listener = NULL;
+    }
+
+    return listening;
+}
+
+
+/*
+ *  Check sockets of 'listener' (single Sn_SR read for each one): re-arm closed sockets and give
+ *  new connections to 'on_accept' handler (if any). Call it periodically from the main loop
+ *  unless CON and DISCON interrupts of the sockets have handlers (wiznet_process_events() does
+ *  the same then). Returns the number of sockets waiting for new connections
+ */
+uint8_t sock_listener_poll(sock_listener_t *listener) {
+
+    uint8_t listening = 0;
+    for (uint8_t i=0; i<listener->_num; i++) {
+        socket_t *sock = &listener->_socks[i];
+        if ((sock->_listener != listener) || (sock->_op != SOCK_OP_NONE)) continue;
+
+        sock_lock(sock);
+        _listener_update(sock, _read_sock_sr(sock->_host_wiznet, sock->_id));
+        if (sock->status == SOCK_STATUS_LISTEN) listening++;
+        sock_unlock(sock);
+    }
+
+    _listener_dispatch(listener);
+    return listening;
+}
+
+
+/*
+ *  Get the next established connection of 'listener' (NULL if there are none). The socket is
+ *  used as usual (recv(), sendto(), ...) and returns into the pool when it is closed
+ */
+socket_t *sock_accept(sock_listener_t *listener) {
+    if (!listener->_ready) sock_listener_poll(listener);
+    return _listener_take(listener);
+}
+
+
+/*
+ *  Close and unregister all sockets of 'listener' including accepted ones
+ */
+void sock_listener_close(sock_listener_t *listener) {
+    for (uint8_t i=0; i<listener->_num; i++) {
+        socket_t *sock = &listener->_socks[i];
+        if (sock->_listener != listener) continue;
+        sock->_listener = NULL;
+        sock_close(sock);
+        sock_deinit(sock);
     }
+    listener->_ready = 0;
+    listener->_accepted = 0;
 }
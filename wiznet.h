@@ -3,11 +3,96 @@
 
 
 
+/*
+ *  Set this to '0' (e.g. -DWIZNET_USE_HAL=0) to build the library without STM32 HAL,
+ *  for example on a host machine against the simulated chip (see wiznet_sim.h). In this
+ *  case you should provide your own transport (see wiznet_transport_t below)
+ */
+#ifndef WIZNET_USE_HAL
+#define WIZNET_USE_HAL 1
+#endif
+
+#if WIZNET_USE_HAL
 #include <printf_redirection.h>
 
 #include "spi.h"
 #include "gpio.h"
+#else
+#include <stdio.h>
+#endif
+
+/*
+ *  Set WIZNET_USE_POOL to '1' to make recv_alloc() draw its buffers from the fixed-block pool
+ *  of the Wiznet instead of the heap. There are 3 classes of blocks, sizes should be multiples
+ *  of 4 and the large one should be equal to the biggest HW RX buffer of your sockets (so any
+ *  received data fits, socket() refuses bigger RX buffers). WIZNET_NO_HEAP removes every heap
+ *  usage from the library (and implies the pool)
+ */
+#ifndef WIZNET_NO_HEAP
+#define WIZNET_NO_HEAP 0
+#endif
+#ifndef WIZNET_USE_POOL
+#define WIZNET_USE_POOL WIZNET_NO_HEAP
+#endif
+#if WIZNET_NO_HEAP && !WIZNET_USE_POOL
+#error "WIZNET_NO_HEAP requires WIZNET_USE_POOL"
+#endif
+
+#ifndef WIZNET_POOL_SMALL_BLOCK
+#define WIZNET_POOL_SMALL_BLOCK 128
+#endif
+#ifndef WIZNET_POOL_SMALL_COUNT
+#define WIZNET_POOL_SMALL_COUNT 8
+#endif
+#ifndef WIZNET_POOL_MEDIUM_BLOCK
+#define WIZNET_POOL_MEDIUM_BLOCK 512
+#endif
+#ifndef WIZNET_POOL_MEDIUM_COUNT
+#define WIZNET_POOL_MEDIUM_COUNT 4
+#endif
+#ifndef WIZNET_POOL_LARGE_BLOCK
+#define WIZNET_POOL_LARGE_BLOCK 2048
+#endif
+#ifndef WIZNET_POOL_LARGE_COUNT
+#define WIZNET_POOL_LARGE_COUNT 2
+#endif
+#define WIZNET_POOL_NUM_CLASSES 3
+
+/*
+ *  Set WIZNET_THREAD_SAFE to '1' to use the library from several tasks (threads) of an RTOS.
+ *  Every Wiznet then has a lock serializing its SPI frames and chip-wide settings, and every
+ *  socket has its own one, so different sockets of the same chip progress in parallel (their
+ *  frames are interleaved). Locks come from the 'os' hooks of the Wiznet (see wiznet_os_t),
+ *  without them the library behaves as a single-threaded one
+ */
+#ifndef WIZNET_THREAD_SAFE
+#define WIZNET_THREAD_SAFE 0
+#endif
+
+/*
+ *  Statistics of every Wiznet and socket: SPI traffic by block, payload, stalls, interrupts and
+ *  latency histograms of the main calls (see wiznet_stats_t). They cost a few increments per SPI
+ *  frame and API call so are enabled by default, set WIZNET_USE_STATS to '0' to drop them
+ */
+#ifndef WIZNET_USE_STATS
+#define WIZNET_USE_STATS 1
+#endif
+
+/*
+ *  Set WIZNET_USE_FDM to '1' to support chips with CS tied low (see 'fdm' field of the Wiznet).
+ *  Such a chip works in the fixed length data mode: every access is split into frames of 4, 2
+ *  and 1 bytes of data, each with its own header, and CS is never toggled. Register accesses
+ *  get cheaper (no GPIO writes and CS setup/hold time), bulk data costs 7 SPI bytes per 4 ones
+ */
+#ifndef WIZNET_USE_FDM
+#define WIZNET_USE_FDM 0
+#endif
+#ifndef WIZNET_STATS_LATENCY_BINS
+#define WIZNET_STATS_LATENCY_BINS 12
+#endif
+
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
 
@@ -33,16 +118,23 @@
 #define SWAP_TWO_BYTES(X) ((((X)&(0xFF00))>>8)|(((X)&(0x00FF))<<8))
 
 
-// Number of Wiznets
+// Maximum number of Wiznets working at the same time (see socket_any() for several chips)
+#ifndef NUM_OF_WIZNETS
 #define NUM_OF_WIZNETS 1
+#endif
 
-// Number of sockets available. You should also adjust sock_n_* arrays if you
-// change this
+// Number of sockets available
 #define NUM_OF_SOCKETS 8
 
 
 // Read/Write Bit of Control Phase
 #define RWB 2
+// Operation Mode bits OM[1:0] of Control Phase: variable length data mode (CS frames the
+// data) or fixed length one with 1, 2 or 4 bytes of Data Phase (CS can be tied low)
+#define OM_VDM 0b00
+#define OM_FDM_1 0b01
+#define OM_FDM_2 0b10
+#define OM_FDM_4 0b11
 
 
 /*
@@ -52,7 +144,7 @@
 
 // Mode Register and its bits
 #define MR 0x0000  // 1 byte
-// #define MR_RST 7  // SW reset ('1' for reset, wait until '0')
+#define MR_RST 7  // SW reset ('1' for reset, wait until '0')
 // #define WOL 5  // Wake on LAN
 // #define PB 4  // Ping Block ('0' - disable ping block)
 // #define PPPoE 3  // set this to '1' for ADSL
@@ -75,6 +167,15 @@
 #define SIR 0x0017  // Socket Interrupt Register (1 byte)
 #define SIMR 0x0018  // Socket Interrupt Mask Register (1 byte)
 
+/*
+ *  Retransmission of ARP requests and TCP segments: period (in 100 us units) and number of
+ *  retries after which the chip gives up and sets TIMEOUT interrupt of the socket
+ */
+#define RTR 0x0019  // Retry Time Register (2 bytes)
+#define RCR 0x001B  // Retry Count Register (1 byte)
+#define RTR_DEFAULT 2000  // 200 ms
+#define RCR_DEFAULT 8
+
 // PHY Configuration Register and its bits
 #define PHYCFGR 0x002E  // 1 byte
 #define PHYCFGR_RST 7  // check this bit to know when reset is completed
@@ -118,6 +219,11 @@
 #define SOCKET_7_TX_BUFFER 0b11110
 #define SOCKET_7_RX_BUFFER 0b11111
 
+// the same for socket 'n' (folds into a constant when 'n' is known at compile time)
+#define SOCK_N_REGISTERS(n) (((n)<<2) | SOCKET_0_REGISTERS)
+#define SOCK_N_TX_BUFFER(n) (((n)<<2) | SOCKET_0_TX_BUFFER)
+#define SOCK_N_RX_BUFFER(n) (((n)<<2) | SOCKET_0_RX_BUFFER)
+
 // Mode Register and its bits
 #define Sn_MR 0x0000  // 1 byte
 // #define MULTI_MFEN 7
@@ -159,7 +265,7 @@ typedef enum SockISRType {
 } sock_isr_type_t;
 
 // Socket Interrupt Mask Register (1 byte)
-// #define Sn_IMR 0x002C  // default to 0xFF - i.e all interrupts enabled
+#define Sn_IMR 0x002C  // default to 0xFF - i.e all interrupts enabled
 
 // Socket Status Register
 #define Sn_SR 0x0003  // 1 byte
@@ -176,7 +282,8 @@ typedef enum SockStatus {
     SOCK_STATUS_NUM_EXCEEDED=-2,
     SOCK_STATUS_MACRAW_TAKEN=-3,
     SOCK_STATUS_CANT_OPEN=-4,
-    SOCK_STATUS_CANT_CLOSE=-5
+    SOCK_STATUS_CANT_CLOSE=-5,
+    SOCK_STATUS_NO_BUF_MEM=-6
 } sock_status_t;
 
 #define Sn_PORT 0x0004  // incoming port (2 bytes)
@@ -186,6 +293,18 @@ typedef enum SockStatus {
 
 #define Sn_MSSR 0x0012  // Maximum Segment Size (2 bytes)
 
+// IP header fields of outgoing packets (the library keeps the defaults)
+#define Sn_TTL 0x0016  // Time To Live (1 byte)
+#define Sn_FRAG 0x002D  // Fragment Offset (2 bytes)
+
+/*
+ *  Sizes of HW RX and TX buffers of the socket in KB (0, 1, 2, 4, 8 or 16). All sockets share
+ *  16 KB of RX and 16 KB of TX memory which is given out in order from Socket0 to Socket7 so
+ *  changing the size of one socket moves the buffers of all sockets after it
+ */
+#define Sn_RXBUF_SIZE 0x001E  // 1 byte
+#define Sn_TXBUF_SIZE 0x001F  // 1 byte
+
 #define Sn_TX_FSR 0x0020  // TX buffer Free Size Register (2 bytes)
 #define Sn_TX_RD 0x0022  // TX buffer start pointer (2 bytes)
 #define Sn_TX_WR 0x0024  // TX buffer end pointer (2 bytes)
@@ -195,9 +314,357 @@ typedef enum SockStatus {
 #define Sn_RX_WR 0x002A  // RX buffer end pointer (2 bytes)
 
 
+/*
+ *  Access semantics of the registers (see WIZNET_REGS)
+ */
+typedef enum WiznetRegAccess {
+    WIZNET_REG_RW,
+    WIZNET_REG_RO,  // changed by the chip only, writes are ignored
+    WIZNET_REG_W1C,  // write '1' to clear a flag
+    WIZNET_REG_CMD  // the chip executes the written value and clears the register
+} wiznet_reg_access_t;
+
+// blocks of the table: common registers or registers of any socket (the bank of socket 'n' is
+// SOCK_N_REGISTERS(n))
+#define WIZNET_REG_BLOCK_common COMMON_REGISTERS
+#define WIZNET_REG_BLOCK_sock SOCKET_0_REGISTERS
+
+/*
+ *  Description of the scalar registers: X(name, block, offset, width, access, reset). 'width' is
+ *  1 or 2 bytes (2-byte values go in Wiznet byte-ordering, i.e. big-endian), 'access' is one of
+ *  wiznet_reg_access_t without the prefix and 'reset' is the value after the reset. Addresses
+ *  (GAR, SHAR, Sn_DIPR, ...) are plain byte arrays and aren't listed.
+ *
+ *  The library generates typed accessors from the table so call sites deal neither with banks
+ *  nor with byte-ordering, and the simulated chip takes the reset values and write semantics
+ *  from it. Socket buffer registers are a separate table as they are also decoded from a single
+ *  burst (see sock_buf_regs_t)
+ */
+#define WIZNET_REGS(X) \
+    X(mr,         common, MR,            1, RW,  0x00)        \
+    X(intlevel,   common, INTLEVEL,      2, RW,  0x0000)      \
+    X(sir,        common, SIR,           1, RO,  0x00)        \
+    X(simr,       common, SIMR,          1, RW,  0x00)        \
+    X(rtr,        common, RTR,           2, RW,  RTR_DEFAULT) \
+    X(rcr,        common, RCR,           1, RW,  RCR_DEFAULT) \
+    X(phycfgr,    common, PHYCFGR,       1, RO,  0xB8)        \
+    X(versionr,   common, VERSIONR,      1, RO,  0x04)        \
+    X(mr,         sock,   Sn_MR,         1, RW,  0x00)        \
+    X(cr,         sock,   Sn_CR,         1, CMD, 0x00)        \
+    X(ir,         sock,   Sn_IR,         1, W1C, 0x00)        \
+    X(sr,         sock,   Sn_SR,         1, RO,  0x00)        \
+    X(port,       sock,   Sn_PORT,       2, RW,  0x0000)      \
+    X(dport,      sock,   Sn_DPORT,      2, RW,  0x0000)      \
+    X(mssr,       sock,   Sn_MSSR,       2, RW,  0xFFFF)      \
+    X(ttl,        sock,   Sn_TTL,        1, RW,  0x80)        \
+    X(rxbuf_size, sock,   Sn_RXBUF_SIZE, 1, RW,  0x02)        \
+    X(txbuf_size, sock,   Sn_TXBUF_SIZE, 1, RW,  0x02)        \
+    X(imr,        sock,   Sn_IMR,        1, RW,  0xFF)        \
+    X(frag,       sock,   Sn_FRAG,       2, RW,  0x4000)      \
+    WIZNET_SOCK_BUF_REGS(X)
+
+#define WIZNET_SOCK_BUF_REGS(X) \
+    X(tx_fsr,     sock,   Sn_TX_FSR,     2, RO,  0x0800)      \
+    X(tx_rd,      sock,   Sn_TX_RD,      2, RO,  0x0000)      \
+    X(tx_wr,      sock,   Sn_TX_WR,      2, RW,  0x0000)      \
+    X(rx_rsr,     sock,   Sn_RX_RSR,     2, RO,  0x0000)      \
+    X(rx_rd,      sock,   Sn_RX_RD,      2, RW,  0x0000)      \
+    X(rx_wr,      sock,   Sn_RX_WR,      2, RO,  0x0000)
+
+
 
 typedef struct Socket socket_t;
 typedef struct Wiznet wiznet_t;
+typedef struct WiznetFrame wiznet_frame_t;
+typedef struct WiznetXfer wiznet_xfer_t;
+typedef struct WiznetTransport wiznet_transport_t;
+
+/*
+ *  Data Phases up to this length are transmitted in the same bus transfer as the header (the
+ *  frame is assembled in a temporary buffer). Longer ones go as 2 transfers - header and data -
+ *  within the same CS assertion
+ */
+#ifndef WIZNET_SPI_FRAME_BUF_SIZE
+#define WIZNET_SPI_FRAME_BUF_SIZE 64
+#endif
+
+/*
+ *  Maximum number of frames given to 'transfer_batch' of the transport at once
+ */
+#ifndef WIZNET_XFER_BATCH_SIZE
+#define WIZNET_XFER_BATCH_SIZE 8
+#endif
+
+/*
+ *  Single SPI frame (variable length data mode): 3-byte header consisting of Address Phase
+ *  (in Wiznet byte-ordering) and Control Phase, and Data Phase of 'len' bytes. Direction is
+ *  defined by RWB bit of the Control Phase: 'data' is transmitted for write frames and filled
+ *  in for read ones
+ */
+struct WiznetFrame {
+    uint8_t header[3];
+    uint8_t *data;
+    uint16_t len;
+};
+
+/*
+ *  Descriptor of a queued SPI transfer (see wiznet_xfer_submit()). 'callback' is called
+ *  (possibly from the interrupt context of the transfer completion) right after the frame
+ *  is over. Descriptor and its data buffer must stay valid until then
+ */
+typedef void (*wiznet_xfer_cb_t)(wiznet_t *wiznet, wiznet_xfer_t *xfer);
+struct WiznetXfer {
+    wiznet_frame_t frame;
+    wiznet_xfer_cb_t callback;  // can be NULL
+    void *arg;  // user data for the callback
+
+    // private members
+    wiznet_xfer_t *_next;
+    volatile bool _done;
+};
+
+/*
+ *  Low-level platform interface of the Wiznet. Every SPI access, timing and RST pin
+ *  manipulation of the library goes through this table so you can port the library by
+ *  implementing first 3 functions (see README). Built-in implementations:
+ *    - wiznet_hal_transport - STM32 HAL, blocking (default, if WIZNET_USE_HAL is set);
+ *    - wiznet_hal_dma_transport - STM32 HAL, DMA-driven;
+ *    - wiznet_sim_transport - in-process W5500 model (see wiznet_sim.h);
+ *    - wiznet_sim_async_transport - the model served by a worker thread
+ */
+struct WiznetTransport {
+    // transfer a whole 'frame' as a single CS assertion (blocking, manages CS by itself). For
+    // Wiznets in the fixed length data mode ('fdm') frames are 1-4 bytes long and CS isn't touched
+    void (*transfer)(wiznet_t *wiznet, wiznet_frame_t *frame);
+    // milliseconds counter for timeouts
+    uint32_t (*millis)(wiznet_t *wiznet);
+    // toggle RST pin and wait for the datasheet delays
+    void (*hw_reset)(wiznet_t *wiznet);
+    // optional: free-running high resolution counter (e.g. CPU cycles) for the statistics
+    uint32_t (*cycles)(wiznet_t *wiznet);
+    // optional, for blocking transports: transfer 'num' frames in order, each one as a separate CS
+    // assertion, at once (e.g. by a single system call, see wiznet_xfer_submit_many())
+    void (*transfer_batch)(wiznet_t *wiznet, wiznet_frame_t *frames[], uint8_t num);
+
+    // optional, for asynchronous transports: start the transfer of a whole 'frame' (e.g. using
+    // DMA) and return immediately. When the frame is over and CS is released the transport
+    // should call wiznet_xfer_complete()
+    void (*start)(wiznet_t *wiznet, wiznet_frame_t *frame);
+    // mandatory for asynchronous transports: protect the transfers queue from the completion
+    // handler (e.g. mask interrupts and return previous mask) and restore it back
+    uint32_t (*lock)(wiznet_t *wiznet);
+    void (*unlock)(wiznet_t *wiznet, uint32_t state);
+};
+
+/*
+ *  SPI bus shared by several Wiznets (each one has its own CS pin). Chips on the same bus take
+ *  it in turns frame by frame (first come - first served ticket lock) so none of them can starve
+ *  the others. Chips with NULL 'bus' have dedicated buses and work in parallel. Only blocking
+ *  transports are supported on a shared bus
+ */
+typedef struct WiznetBus {
+    volatile uint32_t _next_ticket;
+    volatile uint32_t _now_serving;
+} wiznet_bus_t;
+
+/*
+ *  OS abstraction of the thread-safe mode (see WIZNET_THREAD_SAFE). Mutexes must be recursive
+ *  (e.g. xSemaphoreCreateRecursiveMutex() of FreeRTOS or PTHREAD_MUTEX_RECURSIVE) as blocking
+ *  functions of the library call each other. They are created once per Wiznet (wiznet_init())
+ *  and per socket structure (socket()) and never deleted
+ */
+typedef struct WiznetOs {
+    void *(*mutex_create)(void);
+    void (*mutex_lock)(void *mutex);
+    void (*mutex_unlock)(void *mutex);
+    // optional: give the CPU to other tasks while waiting for the bus or an event
+    void (*yield)(void);
+    // optional: wake up the task serving 'wiznet' after wiznet_isr_notify() (called from the ISR,
+    // e.g. give a semaphore)
+    void (*notify)(wiznet_t *wiznet);
+} wiznet_os_t;
+
+/*
+ *  Shadow copies of socket registers which are changed only by the host so they never need
+ *  to be read back over SPI. Values are in natural byte-ordering
+ */
+typedef struct SockShadow {
+    uint8_t mr;  // Sn_MR
+    uint16_t port;  // Sn_PORT
+    uint8_t dipr[4];  // Sn_DIPR
+    uint16_t dport;  // Sn_DPORT
+    uint16_t mssr;  // Sn_MSSR
+    uint16_t tx_wr;  // Sn_TX_WR - end of the data written to HW TX buffer
+    uint16_t rx_rd;  // Sn_RX_RD - start of the unread data in HW RX buffer
+    uint16_t tx_free;  // lower bound of Sn_TX_FSR: the chip only increases it while sending
+} sock_shadow_t;
+
+/*
+ *  Handler of the socket interrupt 'type' (see sock_set_callback()). Called from
+ *  wiznet_process_events(), i.e. from the main loop (task) context
+ */
+typedef void (*sock_isr_cb_t)(socket_t *sock, sock_isr_type_t type, void *arg);
+
+/*
+ *  Capacity of the queue of interrupt events of a Wiznet (power of 2)
+ */
+#ifndef WIZNET_EVENT_QUEUE_SIZE
+#define WIZNET_EVENT_QUEUE_SIZE 16
+#endif
+
+/*
+ *  Socket interrupt captured by wiznet_isr_handler(): Sn_IR flags and Sn_SR at that moment
+ */
+typedef struct WiznetEvent {
+    uint32_t timestamp;  // milliseconds
+    uint8_t sock_n;
+    uint8_t ir;
+    uint8_t sr;
+} wiznet_event_t;
+
+/*
+ *  Sets of sockets for wiznet_poll(): bit n of each mask is Socket n (see SOCK_POLL_MASK())
+ */
+typedef struct SockPollSet {
+    uint8_t readable;  // there is unread data in HW RX buffer
+    uint8_t writable;  // there is free space in HW TX buffer and no SEND in progress
+    uint8_t connected;  // TCP connection is established
+    uint8_t closed;  // socket is closed or the peer has closed the connection
+} sock_poll_set_t;
+
+#define SOCK_POLL_MASK(sock) (1<<(sock)->_id)
+
+/*
+ *  Non-blocking operations of the socket (see sock_*_async()) and their completion handler
+ */
+typedef enum SockOp {
+    SOCK_OP_NONE,
+    SOCK_OP_OPEN,
+    SOCK_OP_CONNECT,
+    SOCK_OP_DISCON,
+    SOCK_OP_CLOSE
+} sock_op_t;
+
+typedef void (*sock_op_cb_t)(socket_t *sock, sock_status_t status, void *arg);
+
+/*
+ *  Pool of TCP sockets listening on the same port (see sock_listen()) and a handler of the
+ *  established connections
+ */
+typedef struct SockListener sock_listener_t;
+typedef void (*sock_accept_cb_t)(sock_listener_t *listener, socket_t *sock, void *arg);
+
+/*
+ *  Provider of memory for the zero-copy receive (see recv_peek())
+ */
+typedef uint8_t *(*sock_rx_sink_t)(socket_t *sock, uint16_t offset, uint16_t len, uint16_t total, void *arg);
+
+/*
+ *  Single UDP datagram for recvmmsg(): 'buf' of 'buf_size' bytes is provided by the user, the
+ *  rest is filled in. 'len' is the full size of the datagram, only 'buf_size' bytes of it are
+ *  copied if it's bigger
+ */
+typedef struct SockDatagram {
+    uint8_t *buf;
+    uint16_t buf_size;
+    uint16_t len;
+    uint8_t ip[4];  // source
+    uint16_t port;
+} sock_datagram_t;
+
+/*
+ *  Single UDP datagram for sendmmsg(): destination and the data. 'sent' is filled in
+ */
+typedef struct SockMsg {
+    uint8_t ip[4];
+    uint16_t port;
+    uint8_t *data;
+    uint16_t len;
+    bool sent;
+} sock_msg_t;
+
+/*
+ *  Ring of fixed-size slots for MACRAW frames (see recv_macraw()). Memory is provided by the
+ *  user: 'slots' of 'num_slots'*'slot_size' bytes and 'lens' of 'num_slots' lengths. Frames are
+ *  put at 'head' by the receiver and taken from 'tail' by the application so they can live in
+ *  different contexts (e.g. interrupt and main loop)
+ */
+typedef struct SockFrameRing {
+    uint8_t *slots;
+    uint16_t *lens;
+    uint16_t slot_size;
+    uint16_t num_slots;
+    volatile uint16_t head;  // free-running counters, slot is 'counter % num_slots'
+    volatile uint16_t tail;
+
+    // totals of all batches
+    uint32_t frames;
+    uint32_t drops;
+} sock_frame_ring_t;
+
+/*
+ *  Result of a single recv_macraw() call
+ */
+typedef struct SockFrameBatch {
+    uint16_t frames;  // put into the ring
+    uint16_t drops;  // frames bigger than a slot (skipped)
+    uint32_t bytes;
+    bool ring_full;  // there are frames left in HW RX buffer because the ring is full
+} sock_frame_batch_t;
+
+/*
+ *  Calls whose latency is tracked by the statistics
+ */
+typedef enum WiznetStatsCall {
+    WIZNET_STATS_SENDTO,  // sendto(), sendto_addr()
+    WIZNET_STATS_RECV,  // recv(), recvfrom()
+    WIZNET_STATS_CONNECT,  // sock_connect()
+
+    NUM_OF_STATS_CALLS
+} wiznet_stats_call_t;
+
+/*
+ *  Blocks of SPI traffic (equal to BSB[1:0] bits of Control Phase)
+ */
+typedef enum WiznetStatsBlock {
+    WIZNET_STATS_COMMON,
+    WIZNET_STATS_SOCK_REGS,
+    WIZNET_STATS_TX_BUF,
+    WIZNET_STATS_RX_BUF,
+
+    NUM_OF_STATS_BLOCKS
+} wiznet_stats_block_t;
+
+/*
+ *  Latency histogram of a single call in units of 'cycles' transport function (only 'calls' are
+ *  counted without it). Bin i counts calls which took [4^i, 4^(i+1)) units, the last one takes
+ *  everything longer
+ */
+typedef struct WiznetLatency {
+    uint32_t calls;
+    uint32_t cycles_total;
+    uint32_t cycles_max;
+    uint32_t bins[WIZNET_STATS_LATENCY_BINS];
+} wiznet_latency_t;
+
+/*
+ *  Statistics of a Wiznet or a single socket (see wiznet_get_stats(), sock_get_stats()). The
+ *  socket counts SPI frames addressed to its blocks, the Wiznet counts all of them along with
+ *  the totals of its sockets. wiznet_stats_efficiency() gives payload bytes per SPI byte
+ */
+typedef struct WiznetStats {
+    uint32_t spi_frames;
+    uint32_t spi_bytes[NUM_OF_STATS_BLOCKS];  // Data Phase bytes (3-byte headers aren't included)
+    uint32_t spi_cycles;  // time of blocking frames (in units of 'cycles' transport function)
+    uint32_t tx_bytes;  // data given to the chip by sending functions
+    uint32_t rx_bytes;  // data freed in HW RX buffer (including UDP and MACRAW headers)
+    uint32_t tx_stalls;  // sending had to wait (or gave up) because HW TX buffer was full
+    uint32_t rx_overflows;  // HW RX buffer was found full, i.e. the chip was dropping the input
+                            // (once till the buffer is freed)
+    uint32_t interrupts;  // wiznet_isr_handler() runs
+    uint32_t sock_irs[NUM_OF_SOCK_IRS];  // events taken by wiznet_isr_handler(), by type
+    wiznet_latency_t latency[NUM_OF_STATS_CALLS];
+} wiznet_stats_t;
 
 /*
  *  Struct representing socket of any type - UDP, TCP or MACRAW (pure Ethernet)
@@ -208,6 +675,15 @@ struct Socket {
                  // ID is equal to Wiznet's HW sockets 0-7
     wiznet_t *_host_wiznet;  // pointer to the Wiznet structure that hosted
                              // this socket
+    sock_shadow_t _shadow;  // registers owned by the host (valid after opening)
+    volatile bool _send_busy;  // SEND command has been issued and its SEND_OK isn't got yet
+    volatile bool _send_timeout;  // SEND has ended with TIMEOUT taken by wiznet_isr_handler()
+    // non-blocking operation in progress
+    sock_op_t _op;
+    uint32_t _op_start;
+    uint32_t _op_timeout;
+    sock_op_cb_t _op_cb;
+    void *_op_arg;
 
     // public members
     uint8_t type;
@@ -215,8 +691,73 @@ struct Socket {
     uint8_t ip[4];
     uint16_t port;
     uint8_t macraw_dst[6];
+    uint8_t rx_buf_size;  // requested sizes of HW buffers in KB (see Sn_RXBUF_SIZE)
+    uint8_t tx_buf_size;
+    uint16_t retry_time;  // retransmission settings of this socket (see RTR and RCR), applied
+    uint8_t retry_count;  // before its CONNECT, DISCON and SEND commands. 0 time - use the chip's
+                          // settings (wiznet->retry_time/retry_count, see wiznet_set_retry())
+
+    // private members used by sendto_async()
+    wiznet_xfer_t _async_xfers[3];
+    uint8_t _async_tx_wr[2];  // Sn_TX_WR in Wiznet byte-ordering
+    uint8_t _async_cmd;
+
+#if WIZNET_THREAD_SAFE
+    void *_mutex;  // serializes operations on the socket (see sock_lock())
+#endif
+
+    sock_listener_t *_listener;  // pool the socket belongs to (server role), NULL - client
+
+#if WIZNET_USE_STATS
+    wiznet_stats_t _stats;
+    bool _rx_full;  // HW RX buffer has been found full (an overflow is counted once till it's freed)
+#endif
+};
+
+struct SockListener {
+    // private members
+    wiznet_t *_host_wiznet;
+    socket_t *_socks;
+    uint8_t _num;
+    uint8_t _ready;  // mask of HW sockets which have connections not handed out yet
+    uint8_t _accepted;  // mask of HW sockets handed out to the application
+
+    // public members
+    uint16_t port;
+    sock_accept_cb_t on_accept;  // NULL - use sock_accept()
+    void *arg;
 };
 
+/*
+ *  Statistics of a single class of the blocks pool (see WIZNET_USE_POOL). Difference between
+ *  'granted_bytes' and 'requested_bytes' is the internal fragmentation, 'fallbacks' are
+ *  allocations served by a bigger class because the best fitting one was exhausted
+ */
+typedef struct WiznetPoolStats {
+    uint16_t block_size;
+    uint16_t num_blocks;
+    uint16_t in_use;
+    uint16_t peak_in_use;
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t fallbacks;
+    uint32_t failures;  // requests of this class which no block was found for
+    uint32_t bad_frees;  // frees of blocks which aren't allocated (e.g. double ones), ignored
+    uint32_t requested_bytes;
+    uint32_t granted_bytes;
+    uint32_t alloc_cycles_total;  // allocation latency (in units of 'cycles' transport function)
+    uint32_t alloc_cycles_max;
+} wiznet_pool_stats_t;
+
+#if WIZNET_USE_POOL
+typedef struct WiznetPoolClass {
+    uint8_t *storage;
+    void *free_list;  // free blocks are linked through their first word
+    uint32_t *used;  // bit per block, set while the block is allocated
+    wiznet_pool_stats_t stats;
+} wiznet_pool_class_t;
+#endif
+
 /*
  *  Struct representing single Wiznet
  */
@@ -226,25 +767,84 @@ struct Wiznet {
     uint8_t _sockets_cnt;
     uint8_t _sockets_taken;  // mask like 0b01010101 where LSB is Socket0 and
                              // MSB is Socket7
+    uint8_t _simr;  // shadow copy of SIMR register (only the host changes it)
+    uint8_t _sock_imr[NUM_OF_SOCKETS];  // shadow copies of Sn_IMR registers
+    sock_isr_cb_t _sock_cbs[NUM_OF_SOCKETS][NUM_OF_SOCK_IRS];  // handlers of socket interrupts
+    void *_sock_cb_args[NUM_OF_SOCKETS][NUM_OF_SOCK_IRS];
+    // single-producer (ISR) single-consumer (wiznet_process_events()) queue of interrupt events
+    wiznet_event_t _events[WIZNET_EVENT_QUEUE_SIZE];
+    volatile uint32_t _events_head;  // free-running, moved only by the producer
+    volatile uint32_t _events_tail;  // free-running, moved only by the consumer
+    volatile uint32_t _events_overflows;  // events lost because the queue was full
+    const wiznet_event_t *_event;  // being dispatched by wiznet_process_events(), NULL - none
+    volatile uint8_t _sock_events[NUM_OF_SOCKETS];  // events taken per socket, free-running (even
+                                                   // the lost ones, see wiznet_poll())
+    uint8_t _rx_buf_size[NUM_OF_SOCKETS];  // shadow copies of Sn_RXBUF_SIZE (Sn_TXBUF_SIZE) of
+    uint8_t _tx_buf_size[NUM_OF_SOCKETS];  // all sockets, in KB
+    uint16_t _rtr;  // shadow copies of RTR and RCR registers
+    uint8_t _rcr;
+#if WIZNET_USE_POOL
+    wiznet_pool_class_t _pool[WIZNET_POOL_NUM_CLASSES];  // from the smallest class to the largest
+#endif
     socket_t *_sockets[NUM_OF_SOCKETS];  // array of pointers to Sockets 0-7
                                          // (corresponds with _sockets_taken, i.e.
                                          // _sockets[0] is Socket0 and so on)
 
+    // low-level interface and its private data (e.g. pointer to the simulated chip)
+    const wiznet_transport_t *transport;
+    void *transport_ctx;
+    wiznet_bus_t *bus;  // shared SPI bus, NULL - the chip has its own one
+    // queue of SPI transfers, head is the one currently on the bus
+    wiznet_xfer_t * volatile _xfer_head;
+    wiznet_xfer_t *_xfer_tail;
+    volatile bool _int_pending;  // wiznet_isr_notify() has been called, interrupts aren't read yet
+
+#if WIZNET_THREAD_SAFE
+    const wiznet_os_t *os;  // NULL - no locking
+    void *_mutex;  // serializes SPI frames and chip-wide state
+#endif
+
+#if WIZNET_USE_STATS
+    wiznet_stats_t _stats;
+#endif
+
+#if WIZNET_USE_HAL
     // platform-specific definitions
     SPI_HandleTypeDef *hspi;
     GPIO_TypeDef *RST_CS_Port;
     uint16_t RST_Pin;
     uint16_t CS_Pin;
 
+    // state of wiznet_hal_dma_transport
+    wiznet_frame_t *_dma_frame;
+    uint8_t _dma_stage;
+    uint8_t _dma_tx_buf[3+WIZNET_SPI_FRAME_BUF_SIZE];
+    uint8_t _dma_rx_buf[3+WIZNET_SPI_FRAME_BUF_SIZE];
+#endif
+
     // public members
+#if WIZNET_USE_FDM
+    bool fdm;  // CS is tied low: fixed length data mode (needs a blocking transport and own bus)
+#endif
     uint8_t mac_addr[6];
     uint8_t ip_addr[4];
     uint8_t ip_gateway_addr[4];
     uint8_t subnet_mask[4];
+    uint16_t retry_time;  // retransmission settings for all sockets (see RTR and RCR)
+    uint8_t retry_count;
 };
 
 
 
+#if WIZNET_USE_HAL
+extern const wiznet_transport_t wiznet_hal_transport;
+extern const wiznet_transport_t wiznet_hal_dma_transport;
+
+void wiznet_hal_dma_complete(wiznet_t *wiznet);
+#endif
+
+
+
 /*
  *  Public functions - Wiznet-related
  */
@@ -255,8 +855,41 @@ void wiznet_deinit(wiznet_t *wiznet);
 void wiznet_hw_reset(wiznet_t *wiznet);
 
 uint8_t wiznet_get_version(wiznet_t *wiznet);
+wiznet_bus_t wiznet_bus_t_init(void);
+wiznet_t *wiznet_pick(const socket_t *sock);
+void wiznet_set_retry(wiznet_t *wiznet, uint16_t retry_time, uint8_t retry_count);
+uint32_t wiznet_retry_timeout(uint16_t retry_time, uint8_t retry_count, bool is_tcp);
 
 void wiznet_isr_handler(wiznet_t *wiznet);
+void wiznet_isr_notify(wiznet_t *wiznet);
+uint32_t wiznet_process_events(wiznet_t *wiznet);
+uint32_t wiznet_events_overflows(wiznet_t *wiznet);
+const wiznet_event_t *wiznet_current_event(wiznet_t *wiznet);
+uint8_t wiznet_poll(wiznet_t *wiznet, const sock_poll_set_t *interest_set, sock_poll_set_t *ready_out,
+                    uint32_t timeout_ms);
+void sock_set_callback(socket_t *sock, sock_isr_type_t type, sock_isr_cb_t callback, void *arg);
+
+#if WIZNET_USE_POOL
+void *wiznet_pool_alloc(wiznet_t *wiznet, uint16_t size);
+void wiznet_pool_free(wiznet_t *wiznet, void *block);
+void wiznet_pool_get_stats(wiznet_t *wiznet, wiznet_pool_stats_t stats[WIZNET_POOL_NUM_CLASSES]);
+void wiznet_pool_reset_stats(wiznet_t *wiznet);
+#endif
+
+#if WIZNET_USE_STATS
+void wiznet_get_stats(wiznet_t *wiznet, wiznet_stats_t *stats);
+void wiznet_reset_stats(wiznet_t *wiznet);
+void sock_get_stats(socket_t *sock, wiznet_stats_t *stats);
+void sock_reset_stats(socket_t *sock);
+uint32_t wiznet_stats_efficiency(const wiznet_stats_t *stats);
+#endif
+
+void wiznet_xfer_prepare(wiznet_xfer_t *xfer, uint16_t addr, uint8_t bank, bool write, uint8_t *data,
+                         uint16_t len, wiznet_xfer_cb_t callback, void *arg);
+void wiznet_xfer_submit(wiznet_t *wiznet, wiznet_xfer_t *xfer);
+void wiznet_xfer_submit_many(wiznet_t *wiznet, wiznet_xfer_t *xfers[], uint8_t num);
+bool wiznet_xfer_done(wiznet_xfer_t *xfer);
+void wiznet_xfer_complete(wiznet_t *wiznet);
 
 
 /*
@@ -264,15 +897,46 @@ void wiznet_isr_handler(wiznet_t *wiznet);
  */
 socket_t socket_t_init(void);
 sock_status_t socket(wiznet_t *wiznet, socket_t *sock);
+sock_status_t socket_async(wiznet_t *wiznet, socket_t *sock, sock_op_cb_t callback, void *arg);
+sock_status_t socket_any(socket_t *sock);
 void sock_reset(socket_t *sock);
 void sock_deinit(socket_t *sock);
+void sock_lock(socket_t *sock);
+void sock_unlock(socket_t *sock);
 
 void sock_open(socket_t *sock);
 void sock_connect(socket_t *sock);
+void sock_open_async(socket_t *sock, sock_op_cb_t callback, void *arg);
+void sock_connect_async(socket_t *sock, sock_op_cb_t callback, void *arg);
+void sock_discon_async(socket_t *sock, sock_op_cb_t callback, void *arg);
+void sock_close_async(socket_t *sock, sock_op_cb_t callback, void *arg);
+bool sock_op_pending(socket_t *sock);
+void sock_set_retry(socket_t *sock, uint16_t retry_time, uint8_t retry_count);
+
+sock_listener_t sock_listener_t_init(void);
+uint8_t sock_listen(wiznet_t *wiznet, sock_listener_t *listener, socket_t socks[], uint8_t num);
+uint8_t sock_listener_poll(sock_listener_t *listener);
+socket_t *sock_accept(sock_listener_t *listener);
+void sock_listener_close(sock_listener_t *listener);
+void wiznet_tick(wiznet_t *wiznet);
 
 void sendto(socket_t *sock, uint8_t *data, uint16_t len);
+uint32_t send_stream(socket_t *sock, uint8_t *data, uint32_t len, uint32_t timeout);
+uint16_t sendto_addr(socket_t *sock, const uint8_t ip[4], uint16_t port, uint8_t *data, uint16_t len);
+uint16_t sendmmsg(socket_t *sock, sock_msg_t *msgs, uint16_t num);
+uint16_t sendto_async(socket_t *sock, uint8_t *data, uint16_t len, wiznet_xfer_cb_t callback, void *arg);
 uint16_t recv(socket_t *sock, uint8_t *buf, uint16_t buf_size);
 uint16_t recv_alloc(socket_t *sock, uint8_t **buf);
+void recv_free(socket_t *sock, uint8_t **buf);
+uint16_t recv_peek(socket_t *sock, sock_rx_sink_t sink, void *arg);
+void recv_consume(socket_t *sock, uint16_t len);
+uint16_t recvfrom(socket_t *sock, uint8_t *buf, uint16_t buf_size, uint8_t ip[4], uint16_t *port);
+uint16_t recvmmsg(socket_t *sock, sock_datagram_t *msgs, uint16_t num);
+void sock_frame_ring_init(sock_frame_ring_t *ring, uint8_t *slots, uint16_t *lens, uint16_t slot_size,
+                          uint16_t num_slots);
+uint8_t *sock_frame_ring_peek(sock_frame_ring_t *ring, uint16_t *len);
+void sock_frame_ring_pop(sock_frame_ring_t *ring);
+uint16_t recv_macraw(socket_t *sock, sock_frame_ring_t *ring, sock_frame_batch_t *batch);
 
 void sock_discon(socket_t *sock);
 void sock_close(socket_t *sock);
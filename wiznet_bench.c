@@ -0,0 +1,405 @@
+#include "wiznet_bench.h"
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define BENCH_ITERATIONS 100
+#define BENCH_SETUP_ITERATIONS 20  // socket() calls
+#define BENCH_MAX_PAYLOAD 2048
+
+static const uint8_t bench_peer_ip[4] = {192,168,1,214};
+static const uint16_t bench_peer_port = 1200;
+
+
+/*
+ *  Start the simulated chip and register it in the library
+ */
+static int32_t _bench_wiznet(wiznet_sim_t *sim, wiznet_t *wiznet) {
+    wiznet_sim_init(sim);
+    *wiznet = wiznet_t_init();
+    wiznet_sim_attach(sim, wiznet);
+    return wiznet_init(wiznet);
+}
+
+
+static sock_status_t _bench_socket(wiznet_t *wiznet, socket_t *sock, sock_type_t type) {
+    *sock = socket_t_init();
+    sock->type = type;
+    memcpy(sock->ip, bench_peer_ip, 4);
+    sock->port = bench_peer_port;
+    return socket(wiznet, sock);
+}
+
+
+/*
+ *  Accumulate the difference between 2 snapshots of model counters and time
+ */
+static void _bench_account(wiznet_bench_cost_t *cost, const wiznet_sim_counters_t *before,
+                           const wiznet_sim_counters_t *after, uint64_t elapsed_ns) {
+    cost->transactions += (after->transactions - before->transactions) / (float)BENCH_ITERATIONS;
+    cost->bus_calls += (after->bus_calls - before->bus_calls) / (float)BENCH_ITERATIONS;
+    cost->idle_gaps += (after->idle_gaps - before->idle_gaps) / (float)BENCH_ITERATIONS;
+    cost->bytes += (after->bytes - before->bytes) / (float)BENCH_ITERATIONS;
+    cost->time_us += elapsed_ns / 1000.0f / BENCH_ITERATIONS;
+}
+
+
+/*
+ *  Measure SPI transactions, transfers and bus idle gaps spent by a single sendto() (UDP) and
+ *  recv() (TCP) call with 'payload' bytes. 'legacy_phases' makes the model to use separate
+ *  transfers for the Address, Control and Data Phases as the library used to do
+ */
+void wiznet_bench_spi_frames(uint16_t payload, bool legacy_phases,
+                             wiznet_bench_cost_t *sendto_cost, wiznet_bench_cost_t *recv_cost) {
+
+    static wiznet_sim_t sim;
+    static uint8_t data[BENCH_MAX_PAYLOAD];
+    wiznet_t wiznet;
+    socket_t udp, tcp;
+
+    memset(sendto_cost, 0, sizeof(wiznet_bench_cost_t));
+    memset(recv_cost, 0, sizeof(wiznet_bench_cost_t));
+    if (payload > BENCH_MAX_PAYLOAD) payload = BENCH_MAX_PAYLOAD;
+    for (uint16_t i=0; i<payload; i++) data[i] = i;
+
+    _bench_wiznet(&sim, &wiznet);
+    _bench_socket(&wiznet, &udp, SOCK_TYPE_UDP);
+    _bench_socket(&wiznet, &tcp, SOCK_TYPE_TCP);
+    sim.legacy_phases = legacy_phases;
+
+    for (uint32_t i=0; i<BENCH_ITERATIONS; i++) {
+        wiznet_sim_counters_t before = sim.counters;
+        uint64_t start_ns = sim.now_ns;
+        sendto(&udp, data, payload);
+        _bench_account(sendto_cost, &before, &sim.counters, sim.now_ns-start_ns);
+
+        wiznet_sim_deliver(&sim, tcp._id, bench_peer_ip, bench_peer_port, data, payload);
+        before = sim.counters;
+        start_ns = sim.now_ns;
+        recv(&tcp, data, sizeof(data));
+        _bench_account(recv_cost, &before, &sim.counters, sim.now_ns-start_ns);
+    }
+
+    sock_close(&udp);
+    sock_close(&tcp);
+    wiznet_deinit(&wiznet);
+}
+
+
+
+/*
+ *  Snapshot of the model and host clock taken before a measured call
+ */
+typedef struct BenchProbe {
+    wiznet_sim_counters_t counters;
+    uint64_t now_ns;
+    uint64_t cpu_ns;
+} bench_probe_t;
+
+
+static uint64_t _bench_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+
+static void _probe_start(bench_probe_t *probe, wiznet_sim_t *sim) {
+    probe->counters = sim->counters;
+    probe->now_ns = sim->now_ns;
+    probe->cpu_ns = _bench_cpu_ns();
+}
+
+
+/*
+ *  Accumulate the call started at 'probe' which has moved 'payload' bytes (totals are kept in
+ *  'result' till _bench_finish())
+ */
+static void _probe_stop(bench_probe_t *probe, wiznet_sim_t *sim, uint16_t payload, wiznet_bench_result_t *result) {
+    float time_us = (sim->now_ns - probe->now_ns) / 1000.0f;
+    result->cpu_ns += _bench_cpu_ns() - probe->cpu_ns;
+    result->calls++;
+    result->payload_bytes += payload;
+    result->time_us += time_us;
+    if (time_us > result->time_max_us) result->time_max_us = time_us;
+    result->transactions += sim->counters.transactions - probe->counters.transactions;
+    result->spi_bytes += sim->counters.bytes - probe->counters.bytes;
+}
+
+
+/*
+ *  Turn the totals of 'result' into averages per call
+ */
+static void _bench_finish(wiznet_bench_result_t *result) {
+    if (result->calls == 0) return;
+    if (result->time_us > 0) result->mbit_s = result->payload_bytes * 8 / result->time_us;
+    if (result->payload_bytes) result->spi_per_payload = result->spi_bytes / result->payload_bytes;
+    result->time_us /= result->calls;
+    result->cpu_ns /= result->calls;
+    result->transactions /= result->calls;
+    result->spi_bytes /= result->calls;
+}
+
+
+/*
+ *  Sustained sending of 'payload' bytes per sendto() through the socket of 'type' (frames of
+ *  MACRAW socket are sent as is). The chip transmits immediately so the result is the limit
+ *  of the library and the bus
+ */
+void wiznet_bench_sendto(sock_type_t type, uint16_t payload, wiznet_bench_result_t *result) {
+
+    static wiznet_sim_t sim;
+    static uint8_t data[BENCH_MAX_PAYLOAD];
+    wiznet_t wiznet;
+    socket_t sock;
+
+    memset(result, 0, sizeof(wiznet_bench_result_t));
+    if (payload > BENCH_MAX_PAYLOAD) payload = BENCH_MAX_PAYLOAD;
+    for (uint16_t i=0; i<payload; i++) data[i] = i;
+
+    _bench_wiznet(&sim, &wiznet);
+    _bench_socket(&wiznet, &sock, type);
+
+    for (uint32_t i=0; i<BENCH_ITERATIONS; i++) {
+        bench_probe_t probe;
+        _probe_start(&probe, &sim);
+        sendto(&sock, data, payload);
+        _probe_stop(&probe, &sim, payload, result);
+    }
+    _bench_finish(result);
+
+    sock_close(&sock);
+    wiznet_deinit(&wiznet);
+}
+
+
+/*
+ *  Draining of HW RX buffer of TCP socket by recv() (or recv_alloc() if 'use_alloc' is set)
+ *  when 'payload' bytes arrive before every call. Sizes which don't divide the ring make reads
+ *  wrap around its end, such calls are counted in 'wraps'
+ */
+void wiznet_bench_drain(bool use_alloc, uint16_t payload, wiznet_bench_result_t *result) {
+
+    static wiznet_sim_t sim;
+    static uint8_t data[BENCH_MAX_PAYLOAD];
+    uint8_t *buf = NULL;
+    wiznet_t wiznet;
+    socket_t sock;
+
+    memset(result, 0, sizeof(wiznet_bench_result_t));
+    if (payload > BENCH_MAX_PAYLOAD) payload = BENCH_MAX_PAYLOAD;
+    for (uint16_t i=0; i<payload; i++) data[i] = i;
+
+    _bench_wiznet(&sim, &wiznet);
+    _bench_socket(&wiznet, &sock, SOCK_TYPE_TCP);
+    uint16_t ring_size = wiznet._rx_buf_size[sock._id] * 1024;
+
+    for (uint32_t i=0; i<BENCH_ITERATIONS; i++) {
+        uint16_t received = wiznet_sim_deliver(&sim, sock._id, bench_peer_ip, bench_peer_port, data, payload);
+        if (((sock._shadow.rx_rd & (ring_size-1)) + received) > ring_size) result->wraps++;
+
+        bench_probe_t probe;
+        _probe_start(&probe, &sim);
+        uint16_t len = use_alloc ? recv_alloc(&sock, &buf) : recv(&sock, data, sizeof(data));
+        _probe_stop(&probe, &sim, len, result);
+    }
+    _bench_finish(result);
+
+    recv_free(&sock, &buf);
+    sock_close(&sock);
+    wiznet_deinit(&wiznet);
+}
+
+
+/*
+ *  Round trip of a single register poll: VERSIONR (common register) or Sn_RX_WR (socket
+ *  register, as recv_peek() does to check for the incoming data)
+ */
+void wiznet_bench_reg_poll(bool sock_reg, wiznet_bench_result_t *result) {
+
+    static wiznet_sim_t sim;
+    wiznet_t wiznet;
+    socket_t sock;
+
+    memset(result, 0, sizeof(wiznet_bench_result_t));
+
+    _bench_wiznet(&sim, &wiznet);
+    _bench_socket(&wiznet, &sock, SOCK_TYPE_TCP);
+
+    for (uint32_t i=0; i<BENCH_ITERATIONS; i++) {
+        bench_probe_t probe;
+        _probe_start(&probe, &sim);
+        if (sock_reg) recv_peek(&sock, NULL, NULL);
+        else wiznet_get_version(&wiznet);
+        _probe_stop(&probe, &sim, 0, result);
+    }
+    _bench_finish(result);
+
+    sock_close(&sock);
+    wiznet_deinit(&wiznet);
+}
+
+
+/*
+ *  Time of socket() for the socket of 'type' (TCP includes the connection, the peer accepts it
+ *  immediately). Every socket is closed and released before the next call
+ */
+void wiznet_bench_socket_setup(sock_type_t type, wiznet_bench_result_t *result) {
+
+    static wiznet_sim_t sim;
+    wiznet_t wiznet;
+    socket_t sock;
+
+    memset(result, 0, sizeof(wiznet_bench_result_t));
+
+    _bench_wiznet(&sim, &wiznet);
+
+    for (uint32_t i=0; i<BENCH_SETUP_ITERATIONS; i++) {
+        bench_probe_t probe;
+        _probe_start(&probe, &sim);
+        sock_status_t status = _bench_socket(&wiznet, &sock, type);
+        _probe_stop(&probe, &sim, 0, result);
+        if (sock._id < 0) {
+            printf("Benchmark socket has failed with status 0x%02X\n", status);
+            break;
+        }
+        sock_close(&sock);
+        sock_deinit(&sock);
+    }
+    _bench_finish(result);
+
+    wiznet_deinit(&wiznet);
+}
+
+
+
+static const char *_type_name(sock_type_t type) {
+    switch (type) {
+    case SOCK_TYPE_TCP: return "tcp";
+    case SOCK_TYPE_UDP: return "udp";
+    case SOCK_TYPE_MACRAW: return "macraw";
+    }
+    return "unknown";
+}
+
+
+static void _json_cost(FILE *out, const char *call, uint16_t payload, const char *framing,
+                       const wiznet_bench_cost_t *cost, bool is_last) {
+    fprintf(out, "    {\"call\": \"%s\", \"payload\": %u, \"framing\": \"%s\", \"transactions\": %.2f, "
+            "\"bus_calls\": %.2f, \"idle_gaps\": %.2f, \"bytes\": %.2f, \"time_us\": %.3f}%s\n",
+            call, payload, framing, cost->transactions, cost->bus_calls, cost->idle_gaps, cost->bytes,
+            cost->time_us, is_last ? "" : ",");
+}
+
+
+/*
+ *  Single entry of a results array: 'name' is a JSON fragment which identifies the benchmark
+ */
+static void _json_result(FILE *out, const char *name, const wiznet_bench_result_t *result, bool is_last) {
+    fprintf(out, "    {%s, \"calls\": %lu, \"payload_bytes\": %lu, \"time_us\": %.3f, \"time_max_us\": %.3f, "
+            "\"cpu_ns\": %.0f, \"transactions\": %.2f, \"spi_bytes\": %.2f, \"spi_per_payload\": %.4f, "
+            "\"mbit_s\": %.3f, \"wraps\": %lu}%s\n",
+            name, (unsigned long)result->calls, (unsigned long)result->payload_bytes, result->time_us,
+            result->time_max_us, result->cpu_ns, result->transactions, result->spi_bytes,
+            result->spi_per_payload, result->mbit_s, (unsigned long)result->wraps, is_last ? "" : ",");
+}
+
+
+/*
+ *  Run the whole suite and write the results to 'out' as a single JSON object. The library
+ *  configuration and the bus timing are included so the results of different builds can be
+ *  compared
+ */
+void wiznet_bench_json(FILE *out) {
+
+    const uint16_t frame_payloads[] = {16, 64, 256, 1024};
+    const uint16_t send_payloads[] = {16, 64, 256, 1024, 1472};
+    const sock_type_t send_types[] = {SOCK_TYPE_UDP, SOCK_TYPE_TCP, SOCK_TYPE_MACRAW};
+    const uint16_t drain_payloads[] = {64, 700, 1460, 2048};
+    const uint8_t num_frame_payloads = sizeof(frame_payloads)/sizeof(frame_payloads[0]);
+    const uint8_t num_send_payloads = sizeof(send_payloads)/sizeof(send_payloads[0]);
+    const uint8_t num_send_types = sizeof(send_types)/sizeof(send_types[0]);
+    const uint8_t num_drain_payloads = sizeof(drain_payloads)/sizeof(drain_payloads[0]);
+    char name[64];
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\"spi_clock_hz\": %u, \"call_overhead_ns\": %u, \"cs_overhead_ns\": %u, "
+            "\"iterations\": %u, \"spi_frame_buf_size\": %u, \"xfer_batch_size\": %u, "
+            "\"thread_safe\": %u, \"use_stats\": %u},\n",
+            WIZNET_SIM_SPI_CLOCK_HZ, WIZNET_SIM_CALL_OVERHEAD_NS, WIZNET_SIM_CS_OVERHEAD_NS, BENCH_ITERATIONS,
+            WIZNET_SPI_FRAME_BUF_SIZE, WIZNET_XFER_BATCH_SIZE, WIZNET_THREAD_SAFE, WIZNET_USE_STATS);
+
+    fprintf(out, "  \"spi_frames\": [\n");
+    for (uint8_t i=0; i<num_frame_payloads; i++) {
+        wiznet_bench_cost_t cost[2][2];
+        wiznet_bench_spi_frames(frame_payloads[i], true, &cost[0][0], &cost[0][1]);
+        wiznet_bench_spi_frames(frame_payloads[i], false, &cost[1][0], &cost[1][1]);
+        _json_cost(out, "sendto", frame_payloads[i], "3-phase", &cost[0][0], false);
+        _json_cost(out, "sendto", frame_payloads[i], "frame", &cost[1][0], false);
+        _json_cost(out, "recv", frame_payloads[i], "3-phase", &cost[0][1], false);
+        _json_cost(out, "recv", frame_payloads[i], "frame", &cost[1][1], i == (num_frame_payloads-1));
+    }
+    fprintf(out, "  ],\n");
+
+    fprintf(out, "  \"sendto\": [\n");
+    for (uint8_t t=0; t<num_send_types; t++) {
+        for (uint8_t i=0; i<num_send_payloads; i++) {
+            wiznet_bench_result_t result;
+            wiznet_bench_sendto(send_types[t], send_payloads[i], &result);
+            snprintf(name, sizeof(name), "\"type\": \"%s\", \"payload\": %u", _type_name(send_types[t]),
+                     send_payloads[i]);
+            _json_result(out, name, &result, (t == (num_send_types-1)) && (i == (num_send_payloads-1)));
+        }
+    }
+    fprintf(out, "  ],\n");
+
+    fprintf(out, "  \"drain\": [\n");
+    for (uint8_t alloc=0; alloc<2; alloc++) {
+        for (uint8_t i=0; i<num_drain_payloads; i++) {
+            wiznet_bench_result_t result;
+            wiznet_bench_drain(alloc, drain_payloads[i], &result);
+            snprintf(name, sizeof(name), "\"call\": \"%s\", \"payload\": %u", alloc ? "recv_alloc" : "recv",
+                     drain_payloads[i]);
+            _json_result(out, name, &result, alloc && (i == (num_drain_payloads-1)));
+        }
+    }
+    fprintf(out, "  ],\n");
+
+    fprintf(out, "  \"reg_poll\": [\n");
+    for (uint8_t sock_reg=0; sock_reg<2; sock_reg++) {
+        wiznet_bench_result_t result;
+        wiznet_bench_reg_poll(sock_reg, &result);
+        snprintf(name, sizeof(name), "\"reg\": \"%s\"", sock_reg ? "Sn_RX_WR" : "VERSIONR");
+        _json_result(out, name, &result, sock_reg);
+    }
+    fprintf(out, "  ],\n");
+
+    fprintf(out, "  \"socket_setup\": [\n");
+    for (uint8_t t=0; t<num_send_types; t++) {
+        wiznet_bench_result_t result;
+        wiznet_bench_socket_setup(send_types[t], &result);
+        snprintf(name, sizeof(name), "\"type\": \"%s\"", _type_name(send_types[t]));
+        _json_result(out, name, &result, t == (num_send_types-1));
+    }
+    fprintf(out, "  ]\n");
+
+    fprintf(out, "}\n");
+}
+
+
+
+#ifdef WIZNET_BENCH_MAIN
+int main(void) {
+    // the library logs to the standard output: keep it for the results only
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL) return 1;
+    fflush(stdout);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    wiznet_bench_json(out);
+    fclose(out);
+    return 0;
+}
+#endif
@@ -0,0 +1,65 @@
+#ifndef WIZNET_BENCH_H_
+#define WIZNET_BENCH_H_
+
+
+
+#include "wiznet_sim.h"
+
+#include <stdio.h>
+
+
+
+/*
+ *  Benchmarks of the library running against the simulated chip (see wiznet_sim.h). Build
+ *  them on a host machine along with the library and the model, e.g.:
+ *
+ *    cc -DWIZNET_USE_HAL=0 -DWIZNET_BENCH_MAIN wiznet.c wiznet_sim.c wiznet_bench.c -o wiznet_bench
+ *    ./wiznet_bench > results.json
+ *
+ *  The program runs the whole suite (see wiznet_bench_json()) and prints the results as JSON to
+ *  the standard output, log of the library goes to the standard error then. Bus time is the
+ *  virtual time of the model so it's reproducible and can be compared between versions of the
+ *  library, CPU time is measured on the host and is only indicative
+ */
+
+
+/*
+ *  Average SPI cost of a single API call
+ */
+typedef struct WiznetBenchCost {
+    float transactions;  // CS assertions
+    float bus_calls;  // separate bus transfers
+    float idle_gaps;  // pauses between transfers within the same CS assertion
+    float bytes;  // total clocked bytes
+    float time_us;  // bus time (virtual time of the model)
+} wiznet_bench_cost_t;
+
+
+/*
+ *  Result of a benchmark of repeated calls: averages per call and totals
+ */
+typedef struct WiznetBenchResult {
+    uint32_t calls;
+    uint32_t payload_bytes;  // moved by all calls
+    float time_us;  // bus time (virtual time of the model)
+    float time_max_us;
+    float cpu_ns;  // host time spent by the library and the model
+    float transactions;  // CS assertions
+    float spi_bytes;  // total clocked bytes
+    float spi_per_payload;  // SPI bytes per payload byte
+    float mbit_s;  // payload rate over the bus time
+    uint32_t wraps;  // calls which have crossed the end of HW RX ring (drain benchmarks)
+} wiznet_bench_result_t;
+
+
+void wiznet_bench_spi_frames(uint16_t payload, bool legacy_phases,
+                             wiznet_bench_cost_t *sendto_cost, wiznet_bench_cost_t *recv_cost);
+void wiznet_bench_sendto(sock_type_t type, uint16_t payload, wiznet_bench_result_t *result);
+void wiznet_bench_drain(bool use_alloc, uint16_t payload, wiznet_bench_result_t *result);
+void wiznet_bench_reg_poll(bool sock_reg, wiznet_bench_result_t *result);
+void wiznet_bench_socket_setup(sock_type_t type, wiznet_bench_result_t *result);
+void wiznet_bench_json(FILE *out);
+
+
+
+#endif /* WIZNET_BENCH_H_ */
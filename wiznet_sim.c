@@ -0,0 +1,763 @@
+#include "wiznet_sim.h"
+
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/spi/spidev.h>
+#include <sys/ioctl.h>
+#endif
+
+
+/*
+ *  Registers the library doesn't use (yet) but the model needs to know about
+ */
+#define SIM_IR 0x0015
+
+#define SIM_UDP_HEADER_SIZE 8
+#define SIM_MACRAW_HEADER_SIZE 2
+
+
+static uint16_t _get16(const uint8_t *reg) {
+    return (reg[0]<<8) | reg[1];
+}
+
+static void _set16(uint8_t *reg, uint16_t value) {
+    reg[0] = value >> 8;
+    reg[1] = value & 0xFF;
+}
+
+static void _set_reg(uint8_t *reg, uint16_t value, uint8_t width) {
+    if (width == 2) _set16(reg, value);
+    else reg[0] = value;
+}
+
+
+/*
+ *  Access semantics of the register byte at 'addr' of 'block' (COMMON_REGISTERS or
+ *  SOCKET_0_REGISTERS) as given by WIZNET_REGS. Bytes not in the table are plain memory
+ */
+static wiznet_reg_access_t _reg_access(uint8_t block, uint16_t addr) {
+#define REG_ACCESS(name, blk, offset, width, access, reset) \
+    if ((block == WIZNET_REG_BLOCK_##blk) && ((uint16_t)(addr-(offset)) < (width))) return WIZNET_REG_##access;
+    WIZNET_REGS(REG_ACCESS)
+#undef REG_ACCESS
+    return WIZNET_REG_RW;
+}
+
+
+/*
+ *  Put reset values of the registers of 'block' from WIZNET_REGS into 'regs'
+ */
+static void _reg_reset(uint8_t block, uint8_t *regs) {
+#define REG_RESET(name, blk, offset, width, access, reset) \
+    if (block == WIZNET_REG_BLOCK_##blk) _set_reg(&regs[offset], reset, width);
+    WIZNET_REGS(REG_RESET)
+#undef REG_RESET
+}
+
+
+/*
+ *  Size of TX (RX) buffer of socket 'n' in bytes as set in Sn_TXBUF_SIZE (Sn_RXBUF_SIZE)
+ */
+static uint16_t _tx_size(wiznet_sim_t *sim, uint8_t n) {
+    return sim->sock_regs[n][Sn_TXBUF_SIZE] * 1024;
+}
+
+static uint16_t _rx_size(wiznet_sim_t *sim, uint8_t n) {
+    return sim->sock_regs[n][Sn_RXBUF_SIZE] * 1024;
+}
+
+
+/*
+ *  Recalculate registers the chip derives from the pointers
+ */
+static void _update_sizes(wiznet_sim_t *sim, uint8_t n) {
+    uint8_t *regs = sim->sock_regs[n];
+    uint16_t tx_used = _get16(&regs[Sn_TX_WR]) - _get16(&regs[Sn_TX_RD]);
+    uint16_t rx_used = _get16(&regs[Sn_RX_WR]) - sim->_rx_rd[n];
+    _set16(&regs[Sn_TX_FSR], (tx_used > _tx_size(sim, n)) ? 0 : _tx_size(sim, n)-tx_used);
+    _set16(&regs[Sn_RX_RSR], rx_used);
+}
+
+
+static void _reset_socket(wiznet_sim_t *sim, uint8_t n) {
+    uint8_t *regs = sim->sock_regs[n];
+    memset(regs, 0, WIZNET_SIM_SOCK_REGS_SIZE);
+    _reg_reset(SOCKET_0_REGISTERS, regs);
+    sim->_rx_rd[n] = 0;
+    sim->_pending_status[n] = -1;
+    sim->_send_pending[n] = false;
+    _update_sizes(sim, n);
+}
+
+
+/*
+ *  Put the chip into the state it has right after the RST pin toggling
+ */
+void wiznet_sim_hw_reset(wiznet_sim_t *sim) {
+    pthread_mutex_lock(&sim->_lock);
+    memset(sim->common, 0, WIZNET_SIM_COMMON_REGS_SIZE);
+    _reg_reset(COMMON_REGISTERS, sim->common);
+    if (sim->link_up) sim->common[PHYCFGR] |= 1<<LNK;
+    for (uint8_t n=0; n<NUM_OF_SOCKETS; n++) _reset_socket(sim, n);
+    sim->_cs = false;
+    pthread_mutex_unlock(&sim->_lock);
+}
+
+
+/*
+ *  Initialize the model with the default values: link is up, peers accept connections
+ *  immediately and all outgoing data is discarded
+ */
+void wiznet_sim_init(wiznet_sim_t *sim) {
+    memset(sim, 0, sizeof(wiznet_sim_t));
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&sim->_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&sim->_worker_lock, NULL);
+    pthread_cond_init(&sim->_worker_cond, NULL);
+    pthread_mutex_init(&sim->_queue_lock, NULL);
+
+    sim->spi_clock_hz = WIZNET_SIM_SPI_CLOCK_HZ;
+    sim->call_overhead_ns = WIZNET_SIM_CALL_OVERHEAD_NS;
+    sim->cs_overhead_ns = WIZNET_SIM_CS_OVERHEAD_NS;
+    sim->link_up = true;
+    wiznet_sim_hw_reset(sim);
+}
+
+
+/*
+ *  Apply delayed status changes (connection establishment etc.) which time has come
+ */
+static void _process_pending(wiznet_sim_t *sim) {
+    for (uint8_t n=0; n<NUM_OF_SOCKETS; n++) {
+        if ((sim->_pending_status[n] >= 0) && (sim->now_ns >= sim->_pending_due[n])) {
+            sim->sock_regs[n][Sn_SR] = sim->_pending_status[n];
+            sim->sock_regs[n][Sn_IR] |= sim->_pending_ir[n];
+            sim->_pending_status[n] = -1;
+        }
+        if (sim->_send_pending[n] && (sim->now_ns >= sim->_send_due[n])) {
+            _set16(&sim->sock_regs[n][Sn_TX_RD], sim->_send_tx_rd[n]);
+            sim->sock_regs[n][Sn_IR] |= sim->_send_ir[n];
+            sim->_send_pending[n] = false;
+            _update_sizes(sim, n);
+        }
+    }
+}
+
+
+static void _schedule(wiznet_sim_t *sim, uint8_t n, uint8_t status, uint8_t ir, uint32_t delay_ms) {
+    sim->_pending_status[n] = status;
+    sim->_pending_ir[n] = ir;
+    sim->_pending_due[n] = sim->now_ns + (uint64_t)delay_ms*1000000;
+    _process_pending(sim);
+}
+
+
+/*
+ *  Time (in milliseconds) the chip spends on unanswered ARP requests according to RTR and RCR
+ */
+static uint32_t _arp_timeout_ms(wiznet_sim_t *sim) {
+    return (uint32_t)_get16(&sim->common[RTR]) * (sim->common[RCR]+1) / 10;
+}
+
+
+/*
+ *  Emulate Sn_CR command 'cmd' of socket 'n'
+ */
+static void _command(wiznet_sim_t *sim, uint8_t n, uint8_t cmd) {
+    uint8_t *regs = sim->sock_regs[n];
+    uint8_t status = regs[Sn_SR];
+    sim->counters.commands++;
+
+    switch (cmd) {
+    case SOCK_CMD_OPEN:
+        switch (regs[Sn_MR] & 0x0F) {
+        case SOCK_TYPE_TCP: status = SOCK_STATUS_INIT; break;
+        case SOCK_TYPE_UDP: status = SOCK_STATUS_UDP; break;
+        case SOCK_TYPE_MACRAW: status = (n == 0) ? SOCK_STATUS_MACRAW : SOCK_STATUS_CLOSED; break;
+        default: status = SOCK_STATUS_CLOSED; break;
+        }
+        regs[Sn_SR] = status;
+        _set16(&regs[Sn_TX_RD], 0); _set16(&regs[Sn_TX_WR], 0);
+        _set16(&regs[Sn_RX_RD], 0); _set16(&regs[Sn_RX_WR], 0);
+        sim->_rx_rd[n] = 0;
+        sim->_pending_status[n] = -1;
+        sim->_send_pending[n] = false;
+        break;
+
+    case SOCK_CMD_LISTEN:
+        if (status == SOCK_STATUS_INIT) regs[Sn_SR] = SOCK_STATUS_LISTEN;
+        break;
+
+    case SOCK_CMD_CONNECT:
+        if (status != SOCK_STATUS_INIT) break;
+        if (sim->peer_unreachable) _schedule(sim, n, SOCK_STATUS_CLOSED, 1<<SOCK_IR_TIMEOUT, _arp_timeout_ms(sim));
+        else if (sim->peer_refuses) _schedule(sim, n, SOCK_STATUS_CLOSED, 1<<SOCK_IR_TIMEOUT, sim->connect_latency_ms);
+        else _schedule(sim, n, SOCK_STATUS_ESTABLISHED, 1<<SOCK_IR_CON, sim->connect_latency_ms);
+        break;
+
+    case SOCK_CMD_DISCON:
+        if ((status == SOCK_STATUS_ESTABLISHED) || (status == SOCK_STATUS_CLOSE_WAIT))
+            _schedule(sim, n, SOCK_STATUS_CLOSED, 1<<SOCK_IR_DISCON, sim->connect_latency_ms);
+        break;
+
+    case SOCK_CMD_CLOSE:
+        regs[Sn_SR] = SOCK_STATUS_CLOSED;
+        sim->_pending_status[n] = -1;
+        sim->_send_pending[n] = false;
+        break;
+
+    case SOCK_CMD_SEND:
+    case SOCK_CMD_SEND_MAC:
+    case SOCK_CMD_SEND_KEEP: {
+        if ((status != SOCK_STATUS_ESTABLISHED) && (status != SOCK_STATUS_CLOSE_WAIT) &&
+            (status != SOCK_STATUS_UDP) && (status != SOCK_STATUS_MACRAW)) break;
+        uint16_t tx_rd = _get16(&regs[Sn_TX_RD]);
+        uint16_t len = _get16(&regs[Sn_TX_WR]) - tx_rd;
+        uint16_t mask = _tx_size(sim, n) - 1;
+        if (len > _tx_size(sim, n)) len = _tx_size(sim, n);
+        for (uint16_t i=0; i<len; i++) sim->_scratch[i] = sim->tx_buf[n][(uint16_t)(tx_rd+i) & mask];
+        sim->_send_tx_rd[n] = tx_rd+len;
+        sim->_send_due[n] = sim->now_ns;
+        // destination doesn't answer ARP requests: the data is dropped after all retries
+        if (sim->peer_unreachable && (status == SOCK_STATUS_UDP)) {
+            sim->_send_ir[n] = 1<<SOCK_IR_TIMEOUT;
+            sim->_send_due[n] += (uint64_t)_arp_timeout_ms(sim)*1000000;
+            sim->_send_pending[n] = true;
+            _process_pending(sim);
+            break;
+        }
+        if (len) {
+            sim->counters.tx_packets++;
+            sim->counters.tx_bytes += len;
+        }
+        if (sim->on_send && len) sim->on_send(sim, n, sim->_scratch, len, sim->user);
+        // the data leaves HW TX buffer when it has been transmitted at the link rate
+        sim->_send_ir[n] = 1<<SOCK_IR_SEND_OK;
+        if (sim->link_rate_bps) sim->_send_due[n] += (uint64_t)len*8*1000000000/sim->link_rate_bps;
+        sim->_send_pending[n] = true;
+        _process_pending(sim);
+        break;
+    }
+
+    case SOCK_CMD_RECV:
+        sim->_rx_rd[n] = _get16(&regs[Sn_RX_RD]);
+        break;
+    }
+
+    _update_sizes(sim, n);
+}
+
+
+/*
+ *  Bus-level read and write of a single byte of the memory. 'bank' is BSB[4:0] bits
+ */
+static uint8_t _read_byte(wiznet_sim_t *sim, uint8_t bank, uint16_t addr) {
+    if (bank == COMMON_REGISTERS) {
+        if (addr == SIR) {
+            uint8_t sir = 0;
+            for (uint8_t n=0; n<NUM_OF_SOCKETS; n++)
+                if (sim->sock_regs[n][Sn_IR] & sim->sock_regs[n][Sn_IMR]) sir |= 1<<n;
+            return sir;
+        }
+        return (addr < WIZNET_SIM_COMMON_REGS_SIZE) ? sim->common[addr] : 0;
+    }
+
+    uint8_t n = bank >> 2;
+    switch (bank & 0b11) {
+    case 0b01:
+        return (addr < WIZNET_SIM_SOCK_REGS_SIZE) ? sim->sock_regs[n][addr] : 0;
+    case 0b10:
+        return sim->tx_buf[n][addr & (_tx_size(sim, n)-1)];
+    case 0b11:
+        return sim->rx_buf[n][addr & (_rx_size(sim, n)-1)];
+    }
+    return 0;  // reserved block
+}
+
+static void _write_byte(wiznet_sim_t *sim, uint8_t bank, uint16_t addr, uint8_t byte) {
+    if (bank == COMMON_REGISTERS) {
+        if (addr >= WIZNET_SIM_COMMON_REGS_SIZE) return;
+        if (_reg_access(COMMON_REGISTERS, addr) == WIZNET_REG_RO) return;  // PHY configuration isn't modeled
+        switch (addr) {
+        case MR:
+            if (byte & (1<<MR_RST)) wiznet_sim_hw_reset(sim);  // SW reset
+            else sim->common[MR] = byte;
+            break;
+        case SIM_IR:
+            sim->common[SIM_IR] &= ~byte;  // write '1' to clear
+            break;
+        default:
+            sim->common[addr] = byte;
+        }
+        return;
+    }
+
+    uint8_t n = bank >> 2;
+    uint8_t *regs = sim->sock_regs[n];
+    switch (bank & 0b11) {
+    case 0b01:
+        if (addr >= WIZNET_SIM_SOCK_REGS_SIZE) return;
+        switch (_reg_access(SOCKET_0_REGISTERS, addr)) {
+        case WIZNET_REG_RO:
+            return;
+        case WIZNET_REG_W1C:
+            regs[addr] &= ~byte;
+            return;
+        case WIZNET_REG_CMD:
+            _command(sim, n, byte);
+            return;
+        default:
+            break;
+        }
+        switch (addr) {
+        case Sn_RXBUF_SIZE:
+        case Sn_TXBUF_SIZE:
+            if ((byte <= 16) && ((byte & (byte-1)) == 0)) regs[addr] = byte;
+            _update_sizes(sim, n);
+            break;
+        default:
+            regs[addr] = byte;
+            if ((addr == Sn_TX_WR) || (addr == Sn_TX_WR+1)) _update_sizes(sim, n);
+        }
+        break;
+    case 0b10:
+        sim->tx_buf[n][addr & (_tx_size(sim, n)-1)] = byte;
+        break;
+    case 0b11:
+        sim->rx_buf[n][addr & (_rx_size(sim, n)-1)] = byte;
+        break;
+    }
+}
+
+
+static void _count_data_byte(wiznet_sim_t *sim, uint8_t bank) {
+    if (bank == COMMON_REGISTERS) sim->counters.bytes_common++;
+    else if ((bank & 0b11) == 0b01) sim->counters.bytes_sock_regs++;
+    else if ((bank & 0b11) == 0b10) sim->counters.bytes_tx_buf++;
+    else if ((bank & 0b11) == 0b11) sim->counters.bytes_rx_buf++;
+}
+
+
+/*
+ *  Assert ('select' is true) or release CS line of the chip. Releasing CS finishes the
+ *  current SPI frame
+ */
+void wiznet_sim_cs(wiznet_sim_t *sim, bool select) {
+    pthread_mutex_lock(&sim->_lock);
+    if (select && sim->_cs) sim->counters.cs_collisions++;
+    if (select && !sim->_cs) {
+        sim->counters.transactions++;
+        sim->_frame_pos = 0;
+        sim->_frame_calls = 0;
+    }
+    sim->_cs = select;
+    sim->now_ns += sim->cs_overhead_ns;
+    _process_pending(sim);
+    pthread_mutex_unlock(&sim->_lock);
+}
+
+
+/*
+ *  Clock 'len' bytes through the bus in full-duplex manner as a single transfer. 'tx' can be
+ *  NULL (zeros are sent), 'rx' can be NULL (received bytes are discarded). Bytes clocked
+ *  while CS is released are ignored by the chip (unless it's tied low, see 'cs_tied'). In the
+ *  fixed length data mode (OM bits of Control Phase) the next frame starts right after 1, 2 or 4
+ *  bytes of data
+ */
+void wiznet_sim_spi(wiznet_sim_t *sim, const uint8_t *tx, uint8_t *rx, uint16_t len) {
+    pthread_mutex_lock(&sim->_lock);
+    sim->counters.bus_calls++;
+    sim->counters.bytes += len;
+    sim->now_ns += sim->call_overhead_ns + (uint64_t)len*8*1000000000/sim->spi_clock_hz;
+    _process_pending(sim);
+
+    if (!sim->_cs && !sim->cs_tied) {
+        if (rx) memset(rx, 0, len);
+        pthread_mutex_unlock(&sim->_lock);
+        return;
+    }
+    if (sim->_frame_calls++) sim->counters.idle_gaps++;
+
+    for (uint16_t i=0; i<len; i++) {
+        uint8_t in = tx ? tx[i] : 0x00;
+        uint8_t out = 0x00;
+        // Address Phase
+        if (sim->_frame_pos < 2) {
+            sim->_addr = (sim->_frame_pos == 0) ? (in<<8) : (sim->_addr | in);
+        }
+        // Control Phase
+        else if (sim->_frame_pos == 2) {
+            sim->_ctrl = in;
+        }
+        // Data Phase (address auto-increments)
+        else {
+            uint8_t bank = sim->_ctrl >> 3;
+            if (sim->_ctrl & (1<<RWB)) _write_byte(sim, bank, sim->_addr, in);
+            else out = _read_byte(sim, bank, sim->_addr);
+            _count_data_byte(sim, bank);
+            sim->_addr++;
+        }
+        sim->_frame_pos++;
+        if (rx) rx[i] = out;
+
+        uint8_t om = sim->_ctrl & 0b11;
+        if ((om != OM_VDM) && (sim->_frame_pos == (3u + (1u << (om-1))))) {
+            sim->counters.fixed_frames++;
+            sim->_frame_pos = 0;
+            sim->_frame_calls = 0;
+        }
+    }
+    pthread_mutex_unlock(&sim->_lock);
+}
+
+
+/*
+ *  Emulate the reception of 'len' bytes of 'data' by socket 'sock_n' from the remote host
+ *  'src_ip':'src_port'. Depending on Sn_MR, the data is prepended by the same headers the
+ *  chip adds (8 bytes for UDP, 2 bytes for MACRAW). Returns number of payload bytes accepted:
+ *  TCP takes as much as fits in the RX buffer, UDP and MACRAW drop whole datagrams (frames)
+ */
+static uint16_t _deliver(wiznet_sim_t *sim, uint8_t sock_n, const uint8_t src_ip[4], uint16_t src_port,
+                         const uint8_t *data, uint16_t len) {
+
+    uint8_t *regs = sim->sock_regs[sock_n];
+    uint8_t header[SIM_UDP_HEADER_SIZE];
+    uint16_t header_len = 0;
+
+    switch (regs[Sn_SR]) {
+    case SOCK_STATUS_ESTABLISHED:
+        break;
+    case SOCK_STATUS_UDP:
+        memcpy(header, src_ip, 4);
+        _set16(&header[4], src_port);
+        _set16(&header[6], len);
+        header_len = SIM_UDP_HEADER_SIZE;
+        break;
+    case SOCK_STATUS_MACRAW:
+        _set16(header, len+SIM_MACRAW_HEADER_SIZE);
+        header_len = SIM_MACRAW_HEADER_SIZE;
+        break;
+    default:
+        return 0;  // socket can't receive anything
+    }
+
+    uint16_t rx_wr = _get16(&regs[Sn_RX_WR]);
+    uint16_t rx_free = _rx_size(sim, sock_n) - (uint16_t)(rx_wr - sim->_rx_rd[sock_n]);
+    if (header_len+len > rx_free) {
+        if (header_len) {
+            sim->counters.rx_drops++;
+            return 0;
+        }
+        len = rx_free;  // TCP window is full
+    }
+    if (!len && !header_len) return 0;
+
+    uint16_t mask = _rx_size(sim, sock_n) - 1;
+    for (uint16_t i=0; i<header_len; i++) sim->rx_buf[sock_n][rx_wr++ & mask] = header[i];
+    for (uint16_t i=0; i<len; i++) sim->rx_buf[sock_n][rx_wr++ & mask] = data[i];
+    _set16(&regs[Sn_RX_WR], rx_wr);
+    regs[Sn_IR] |= 1<<SOCK_IR_RECV;
+    _update_sizes(sim, sock_n);
+
+    sim->counters.rx_packets++;
+    sim->counters.rx_bytes += len;
+    return len;
+}
+
+uint16_t wiznet_sim_deliver(wiznet_sim_t *sim, uint8_t sock_n, const uint8_t src_ip[4], uint16_t src_port,
+                            const uint8_t *data, uint16_t len) {
+    pthread_mutex_lock(&sim->_lock);
+    len = _deliver(sim, sock_n, src_ip, src_port, data, len);
+    pthread_mutex_unlock(&sim->_lock);
+    return len;
+}
+
+
+/*
+ *  Emulate an incoming TCP connection from 'src_ip':'src_port' to local 'port': the lowest
+ *  socket listening on it gets ESTABLISHED status and CON interrupt. Returns the number of that
+ *  socket or -1 if nobody listens (the peer would get RST)
+ */
+int8_t wiznet_sim_connect_in(wiznet_sim_t *sim, uint16_t port, const uint8_t src_ip[4], uint16_t src_port) {
+    pthread_mutex_lock(&sim->_lock);
+    _process_pending(sim);
+    int8_t sock_n = -1;
+    for (uint8_t n=0; n<NUM_OF_SOCKETS; n++) {
+        uint8_t *regs = sim->sock_regs[n];
+        if ((regs[Sn_SR] == SOCK_STATUS_LISTEN) && (_get16(&regs[Sn_PORT]) == port)) {
+            regs[Sn_SR] = SOCK_STATUS_ESTABLISHED;
+            regs[Sn_IR] |= 1<<SOCK_IR_CON;
+            memcpy(&regs[Sn_DIPR], src_ip, 4);
+            _set16(&regs[Sn_DPORT], src_port);
+            sock_n = n;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sim->_lock);
+    return sock_n;
+}
+
+
+/*
+ *  Emulate FIN from the peer of TCP socket 'sock_n' (status becomes CLOSE_WAIT, DISCON interrupt)
+ */
+void wiznet_sim_peer_close(wiznet_sim_t *sim, uint8_t sock_n) {
+    pthread_mutex_lock(&sim->_lock);
+    uint8_t *regs = sim->sock_regs[sock_n];
+    if (regs[Sn_SR] == SOCK_STATUS_ESTABLISHED) {
+        regs[Sn_SR] = SOCK_STATUS_CLOSE_WAIT;
+        regs[Sn_IR] |= 1<<SOCK_IR_DISCON;
+    }
+    pthread_mutex_unlock(&sim->_lock);
+}
+
+
+/*
+ *  State of INTn pin: 'true' if any unmasked socket interrupt is pending
+ */
+bool wiznet_sim_int_asserted(wiznet_sim_t *sim) {
+    pthread_mutex_lock(&sim->_lock);
+    _process_pending(sim);
+    bool is_asserted = (_read_byte(sim, COMMON_REGISTERS, SIR) & sim->common[SIMR]) != 0;
+    pthread_mutex_unlock(&sim->_lock);
+    return is_asserted;
+}
+
+
+uint32_t wiznet_sim_millis(wiznet_sim_t *sim) {
+    pthread_mutex_lock(&sim->_lock);
+    uint32_t ms = sim->now_ns / 1000000;
+    pthread_mutex_unlock(&sim->_lock);
+    return ms;
+}
+
+
+/*
+ *  Move virtual time forward by 'ms' milliseconds (e.g. to emulate application work)
+ */
+void wiznet_sim_advance(wiznet_sim_t *sim, uint32_t ms) {
+    pthread_mutex_lock(&sim->_lock);
+    sim->now_ns += (uint64_t)ms*1000000;
+    _process_pending(sim);
+    pthread_mutex_unlock(&sim->_lock);
+}
+
+
+void wiznet_sim_counters_reset(wiznet_sim_t *sim) {
+    pthread_mutex_lock(&sim->_lock);
+    memset(&sim->counters, 0, sizeof(wiznet_sim_counters_t));
+    pthread_mutex_unlock(&sim->_lock);
+}
+
+
+
+/*
+ *  Transport of the model. It drives the bus exactly as the STM32 HAL port does so the
+ *  counters reflect the cost of the real hardware. With 'legacy_phases' set it issues
+ *  Address, Control and Data Phases as 3 separate transfers (as the library used to do). With
+ *  'racy_frames' set concurrent frames can overlap like on the real bus: the library must
+ *  serialize them by itself (see WIZNET_THREAD_SAFE). CS isn't touched for the Wiznet in the
+ *  fixed length data mode (see WIZNET_USE_FDM), set 'cs_tied' of the model then
+ */
+static void _sim_transfer(wiznet_t *wiznet, wiznet_frame_t *frame) {
+    wiznet_sim_t *sim = wiznet->transport_ctx;
+    bool is_write = frame->header[2] & (1<<RWB);
+    bool is_serialized = !sim->racy_frames;
+
+    bool is_fdm = false;
+#if WIZNET_USE_FDM
+    is_fdm = wiznet->fdm;
+#endif
+
+    if (is_serialized) pthread_mutex_lock(&sim->_lock);
+    if (!is_fdm) wiznet_sim_cs(sim, true);
+    if (!is_serialized) sched_yield();  // widen the window for overlapping frames
+    if (sim->legacy_phases) {
+        wiznet_sim_spi(sim, frame->header, NULL, 2);
+        wiznet_sim_spi(sim, &frame->header[2], NULL, 1);
+        wiznet_sim_spi(sim, is_write ? frame->data : NULL, is_write ? NULL : frame->data, frame->len);
+    }
+    else if (frame->len <= WIZNET_SPI_FRAME_BUF_SIZE) {
+        uint8_t tx_buf[3+WIZNET_SPI_FRAME_BUF_SIZE];
+        uint8_t rx_buf[3+WIZNET_SPI_FRAME_BUF_SIZE];
+        memcpy(tx_buf, frame->header, 3);
+        if (is_write) memcpy(&tx_buf[3], frame->data, frame->len);
+        else memset(&tx_buf[3], 0, frame->len);
+        wiznet_sim_spi(sim, tx_buf, rx_buf, 3+frame->len);
+        if (!is_write) memcpy(frame->data, &rx_buf[3], frame->len);
+    }
+    else {
+        wiznet_sim_spi(sim, frame->header, NULL, 3);
+        wiznet_sim_spi(sim, is_write ? frame->data : NULL, is_write ? NULL : frame->data, frame->len);
+    }
+    if (!is_fdm) wiznet_sim_cs(sim, false);
+    if (is_serialized) pthread_mutex_unlock(&sim->_lock);
+}
+
+
+static uint32_t _sim_millis(wiznet_t *wiznet) {
+    return wiznet_sim_millis(wiznet->transport_ctx);
+}
+
+
+// host time in nanoseconds (not the virtual one: it measures CPU work of the library)
+static uint32_t _sim_cycles(wiznet_t *wiznet) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec*1000000000u + (uint32_t)ts.tv_nsec;
+}
+
+
+static void _sim_hw_reset(wiznet_t *wiznet) {
+    wiznet_sim_t *sim = wiznet->transport_ctx;
+    wiznet_sim_hw_reset(sim);
+    wiznet_sim_advance(sim, 2);  // same delays as in the HAL port
+}
+
+
+const wiznet_transport_t wiznet_sim_transport = {
+    .transfer = _sim_transfer,
+    .millis = _sim_millis,
+    .hw_reset = _sim_hw_reset,
+    .cycles = _sim_cycles
+};
+
+
+/*
+ *  Make 'wiznet' to communicate with the model 'sim'. Call it before wiznet_init()
+ */
+void wiznet_sim_attach(wiznet_sim_t *sim, wiznet_t *wiznet) {
+    wiznet->transport = &wiznet_sim_transport;
+    wiznet->transport_ctx = sim;
+}
+
+
+
+/*
+ *  Asynchronous transport of the model: frames are clocked by the worker thread which then
+ *  completes them (see wiznet_xfer_complete()) as a DMA completion interrupt would do
+ */
+static void *_sim_worker(void *arg) {
+    wiznet_sim_t *sim = arg;
+
+    pthread_mutex_lock(&sim->_worker_lock);
+    while (1) {
+        while (sim->_worker_run && (sim->_async_frame == NULL))
+            pthread_cond_wait(&sim->_worker_cond, &sim->_worker_lock);
+        if (!sim->_worker_run) break;
+
+        wiznet_frame_t *frame = sim->_async_frame;
+        sim->_async_frame = NULL;
+        pthread_mutex_unlock(&sim->_worker_lock);
+
+        _sim_transfer(sim->_async_wiznet, frame);
+        wiznet_xfer_complete(sim->_async_wiznet);
+
+        pthread_mutex_lock(&sim->_worker_lock);
+    }
+    pthread_mutex_unlock(&sim->_worker_lock);
+
+    return NULL;
+}
+
+
+static void _sim_start(wiznet_t *wiznet, wiznet_frame_t *frame) {
+    wiznet_sim_t *sim = wiznet->transport_ctx;
+    pthread_mutex_lock(&sim->_worker_lock);
+    sim->_async_frame = frame;
+    pthread_cond_signal(&sim->_worker_cond);
+    pthread_mutex_unlock(&sim->_worker_lock);
+}
+
+
+static uint32_t _sim_lock(wiznet_t *wiznet) {
+    wiznet_sim_t *sim = wiznet->transport_ctx;
+    pthread_mutex_lock(&sim->_queue_lock);
+    return 0;
+}
+
+
+static void _sim_unlock(wiznet_t *wiznet, uint32_t state) {
+    wiznet_sim_t *sim = wiznet->transport_ctx;
+    pthread_mutex_unlock(&sim->_queue_lock);
+}
+
+
+const wiznet_transport_t wiznet_sim_async_transport = {
+    .transfer = _sim_transfer,
+    .millis = _sim_millis,
+    .hw_reset = _sim_hw_reset,
+    .cycles = _sim_cycles,
+    .start = _sim_start,
+    .lock = _sim_lock,
+    .unlock = _sim_unlock
+};
+
+
+/*
+ *  Same as wiznet_sim_attach() but SPI frames are served by the worker thread. Call
+ *  wiznet_sim_detach() to stop it
+ */
+void wiznet_sim_attach_async(wiznet_sim_t *sim, wiznet_t *wiznet) {
+    wiznet->transport = &wiznet_sim_async_transport;
+    wiznet->transport_ctx = sim;
+
+    sim->_async_wiznet = wiznet;
+    sim->_async_frame = NULL;
+    sim->_worker_run = true;
+    pthread_create(&sim->_worker, NULL, _sim_worker, sim);
+}
+
+
+/*
+ *  Wait for all queued transfers and stop the worker thread (if any)
+ */
+void wiznet_sim_detach(wiznet_sim_t *sim) {
+    if (!sim->_worker_run) return;
+    while (sim->_async_wiznet->_xfer_head != NULL);
+
+    pthread_mutex_lock(&sim->_worker_lock);
+    sim->_worker_run = false;
+    pthread_cond_signal(&sim->_worker_cond);
+    pthread_mutex_unlock(&sim->_worker_lock);
+    pthread_join(sim->_worker, NULL);
+}
+
+
+
+#ifdef __linux__
+/*
+ *  Replacement of ioctl() for wiznet_spidev_t ('ioctl' hook, 'ctx' is the model): plays
+ *  SPI_IOC_MESSAGE requests as the spidev driver would (CS is asserted for the whole message
+ *  and released between transfers with 'cs_change'). Configuration requests are accepted as is
+ */
+int wiznet_sim_spidev_ioctl(void *ctx, int fd, unsigned long request, void *arg) {
+    wiznet_sim_t *sim = ctx;
+
+    if ((_IOC_TYPE(request) != SPI_IOC_MAGIC) || (_IOC_NR(request) != 0)) return 0;
+
+    struct spi_ioc_transfer *xfers = arg;
+    uint32_t num = _IOC_SIZE(request) / sizeof(struct spi_ioc_transfer);
+    int len = 0;
+
+    pthread_mutex_lock(&sim->_lock);
+    for (uint32_t i=0; i<num; i++) {
+        if (!sim->_cs) wiznet_sim_cs(sim, true);
+        wiznet_sim_spi(sim, (const uint8_t *)(uintptr_t)xfers[i].tx_buf, (uint8_t *)(uintptr_t)xfers[i].rx_buf,
+                       xfers[i].len);
+        len += xfers[i].len;
+        if (xfers[i].cs_change && (i != (num-1))) wiznet_sim_cs(sim, false);
+    }
+    if (sim->_cs) wiznet_sim_cs(sim, false);
+    pthread_mutex_unlock(&sim->_lock);
+
+    return len;
+}
+#endif
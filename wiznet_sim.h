@@ -0,0 +1,159 @@
+#ifndef WIZNET_SIM_H_
+#define WIZNET_SIM_H_
+
+
+
+#include "wiznet.h"
+
+#include <pthread.h>
+
+
+
+/*
+ *  In-process model of the W5500 chip. It behaves as an SPI slave (address, control and
+ *  data phases, auto-increment, per-socket TX/RX buffers) and emulates the side effects of
+ *  Sn_CR commands, socket statuses and interrupt flags. Network side is replaced by a
+ *  'wiznet_sim_deliver()' call (incoming data) and an 'on_send' hook (outgoing data).
+ *
+ *  Use it to run and benchmark the library on a host machine:
+ *
+ *    wiznet_sim_t sim;
+ *    wiznet_sim_init(&sim);
+ *
+ *    wiznet_t wiznet = wiznet_t_init();
+ *    wiznet_sim_attach(&sim, &wiznet);
+ *    wiznet_init(&wiznet);
+ *
+ *  Time in the model is virtual: it moves forward only with SPI traffic (according to the
+ *  configured bus clock and overheads) and 'wiznet_sim_advance()' calls so the results are
+ *  fully reproducible.
+ *
+ *  'wiznet_sim_attach_async()' serves SPI frames by a worker thread instead (like a DMA would
+ *  do), so the asynchronous transfers queue of the library can be exercised. All public
+ *  functions of the model are thread-safe.
+ *
+ *  'wiznet_sim_spidev_ioctl()' puts the model under the Linux spidev transport instead of the
+ *  real device (see wiznet_spidev.h)
+ */
+
+
+#define WIZNET_SIM_COMMON_REGS_SIZE 0x0040
+#define WIZNET_SIM_SOCK_REGS_SIZE 0x0030
+#define WIZNET_SIM_BUFFER_SIZE 0x4000  // whole 16 KB of TX (RX) memory can go to one socket
+
+// defaults of the bus timing model
+#define WIZNET_SIM_SPI_CLOCK_HZ 21000000  // STM32F4 APB1 / 2
+#define WIZNET_SIM_CALL_OVERHEAD_NS 2000  // setup of a single blocking HAL SPI call
+#define WIZNET_SIM_CS_OVERHEAD_NS 500  // GPIO write plus CS setup/hold time
+
+
+typedef struct WiznetSim wiznet_sim_t;
+
+/*
+ *  SPI traffic counters of the model. 'transactions' is a number of CS assertions,
+ *  'bus_calls' is a number of separate transfers done within them and 'idle_gaps' counts
+ *  pauses of the bus between such transfers while CS is still asserted
+ */
+typedef struct WiznetSimCounters {
+    uint32_t transactions;
+    uint32_t bus_calls;
+    uint32_t idle_gaps;
+    uint32_t bytes;  // including 3-byte headers
+    uint32_t bytes_common;  // data phase bytes by bank
+    uint32_t bytes_sock_regs;
+    uint32_t bytes_tx_buf;
+    uint32_t bytes_rx_buf;
+    uint32_t commands;  // Sn_CR writes
+    uint32_t tx_packets;  // SEND commands with non-empty payload
+    uint32_t tx_bytes;
+    uint32_t rx_packets;  // wiznet_sim_deliver() calls accepted by the chip
+    uint32_t rx_bytes;
+    uint32_t rx_drops;  // datagrams/frames dropped due to RX buffer overflow
+    uint32_t cs_collisions;  // CS asserted while another frame is in progress (see 'racy_frames')
+    uint32_t fixed_frames;  // frames of the fixed length data mode (they don't need CS)
+} wiznet_sim_counters_t;
+
+struct WiznetSim {
+    // memory of the chip (registers are stored in Wiznet byte-ordering)
+    uint8_t common[WIZNET_SIM_COMMON_REGS_SIZE];
+    uint8_t sock_regs[NUM_OF_SOCKETS][WIZNET_SIM_SOCK_REGS_SIZE];
+    uint8_t tx_buf[NUM_OF_SOCKETS][WIZNET_SIM_BUFFER_SIZE];
+    uint8_t rx_buf[NUM_OF_SOCKETS][WIZNET_SIM_BUFFER_SIZE];
+
+    // private members
+    uint16_t _rx_rd[NUM_OF_SOCKETS];  // Sn_RX_RD as it was at last RECV command
+    int16_t _pending_status[NUM_OF_SOCKETS];  // status to switch to at '_pending_due', -1 - none
+    uint8_t _pending_ir[NUM_OF_SOCKETS];
+    uint64_t _pending_due[NUM_OF_SOCKETS];
+    bool _send_pending[NUM_OF_SOCKETS];  // SEND is being transmitted till '_send_due'
+    uint16_t _send_tx_rd[NUM_OF_SOCKETS];
+    uint64_t _send_due[NUM_OF_SOCKETS];
+    uint8_t _send_ir[NUM_OF_SOCKETS];  // SEND_OK or TIMEOUT
+    bool _cs;  // CS asserted
+    uint32_t _frame_pos;  // bytes clocked since CS assertion
+    uint32_t _frame_calls;  // bus calls since CS assertion
+    uint16_t _addr;
+    uint8_t _ctrl;
+    uint8_t _scratch[WIZNET_SIM_BUFFER_SIZE];
+    pthread_mutex_t _lock;  // protects the model (recursive)
+
+    // worker thread of wiznet_sim_async_transport
+    pthread_t _worker;
+    pthread_mutex_t _worker_lock;
+    pthread_cond_t _worker_cond;
+    pthread_mutex_t _queue_lock;  // lock/unlock ops of the transport
+    bool _worker_run;
+    wiznet_t *_async_wiznet;
+    wiznet_frame_t *_async_frame;
+
+    // virtual time and bus timing model
+    uint64_t now_ns;
+    uint32_t spi_clock_hz;
+    uint32_t call_overhead_ns;
+    uint32_t cs_overhead_ns;
+    bool legacy_phases;  // emulate 3 transfers per frame (for comparison)
+    bool racy_frames;  // don't serialize frames of different threads (as a real bus wouldn't)
+    bool cs_tied;  // CS of the chip is tied low: frames are delimited only by the fixed length mode
+
+    // network side behavior
+    bool link_up;
+    bool peer_refuses;  // TCP CONNECT ends with TIMEOUT
+    bool peer_unreachable;  // no ARP replies: CONNECT and UDP SEND end with TIMEOUT after RTR/RCR retries
+    uint32_t connect_latency_ms;  // time for CONNECT/DISCON to complete
+    uint32_t link_rate_bps;  // time for SEND to complete (SEND_OK), 0 - immediately
+    void (*on_send)(wiznet_sim_t *sim, uint8_t sock_n, const uint8_t *data, uint16_t len, void *user);
+    void *user;
+
+    wiznet_sim_counters_t counters;
+};
+
+
+extern const wiznet_transport_t wiznet_sim_transport;
+extern const wiznet_transport_t wiznet_sim_async_transport;
+
+
+void wiznet_sim_init(wiznet_sim_t *sim);
+void wiznet_sim_attach(wiznet_sim_t *sim, wiznet_t *wiznet);
+void wiznet_sim_attach_async(wiznet_sim_t *sim, wiznet_t *wiznet);
+void wiznet_sim_detach(wiznet_sim_t *sim);
+#ifdef __linux__
+int wiznet_sim_spidev_ioctl(void *ctx, int fd, unsigned long request, void *arg);
+#endif
+void wiznet_sim_hw_reset(wiznet_sim_t *sim);
+
+void wiznet_sim_cs(wiznet_sim_t *sim, bool select);
+void wiznet_sim_spi(wiznet_sim_t *sim, const uint8_t *tx, uint8_t *rx, uint16_t len);
+
+uint16_t wiznet_sim_deliver(wiznet_sim_t *sim, uint8_t sock_n, const uint8_t src_ip[4], uint16_t src_port,
+                            const uint8_t *data, uint16_t len);
+int8_t wiznet_sim_connect_in(wiznet_sim_t *sim, uint16_t port, const uint8_t src_ip[4], uint16_t src_port);
+void wiznet_sim_peer_close(wiznet_sim_t *sim, uint8_t sock_n);
+bool wiznet_sim_int_asserted(wiznet_sim_t *sim);
+
+uint32_t wiznet_sim_millis(wiznet_sim_t *sim);
+void wiznet_sim_advance(wiznet_sim_t *sim, uint32_t ms);
+void wiznet_sim_counters_reset(wiznet_sim_t *sim);
+
+
+
+#endif /* WIZNET_SIM_H_ */
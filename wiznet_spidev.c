@@ -0,0 +1,239 @@
+#include "wiznet_spidev.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+
+
+static int _sys_ioctl(void *ctx, int fd, unsigned long request, void *arg) {
+    return ioctl(fd, request, arg);
+}
+
+
+/*
+ *  Initialize 'spidev' structure with default values
+ */
+wiznet_spidev_t wiznet_spidev_t_init(void) {
+
+    wiznet_spidev_t spidev = {
+        .fd = -1,
+        .speed_hz = WIZNET_SPIDEV_SPEED_HZ,
+        .hw_reset = NULL,
+        .ioctl = _sys_ioctl,
+        .ioctl_ctx = NULL,
+
+        .syscalls = 0,
+        .errors = 0,
+
+        ._num_xfers = 0,
+        ._len = 0,
+        ._used = 0,
+        ._num_copies = 0
+    };
+
+    return spidev;
+}
+
+
+/*
+ *  Open spidev device 'path' (e.g. "/dev/spidev0.0") and configure it. Returns '0' at success
+ */
+int32_t wiznet_spidev_open(wiznet_spidev_t *spidev, const char *path) {
+    spidev->fd = open(path, O_RDWR);
+    if (spidev->fd < 0) {
+        printf("Can't open %s\n", path);
+        return -1;
+    }
+    return wiznet_spidev_setup(spidev);
+}
+
+
+/*
+ *  Set SPI mode 0 (W5500 supports modes 0 and 3), 8-bit words and the clock 'speed_hz' of
+ *  'spidev'. Returns '0' at success
+ */
+int32_t wiznet_spidev_setup(wiznet_spidev_t *spidev) {
+    uint8_t mode = SPI_MODE_0;
+    uint8_t bits = 8;
+    uint32_t speed_hz = spidev->speed_hz;
+    if ((spidev->ioctl(spidev->ioctl_ctx, spidev->fd, SPI_IOC_WR_MODE, &mode) < 0) ||
+        (spidev->ioctl(spidev->ioctl_ctx, spidev->fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0) ||
+        (spidev->ioctl(spidev->ioctl_ctx, spidev->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) < 0)) {
+        printf("Can't configure spidev\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+void wiznet_spidev_close(wiznet_spidev_t *spidev) {
+    if (spidev->fd >= 0) close(spidev->fd);
+    spidev->fd = -1;
+}
+
+
+/*
+ *  Make 'wiznet' to communicate through 'spidev'. Call it before wiznet_init()
+ */
+void wiznet_spidev_attach(wiznet_spidev_t *spidev, wiznet_t *wiznet) {
+    wiznet->transport = &wiznet_spidev_transport;
+    wiznet->transport_ctx = spidev;
+}
+
+
+
+/*
+ *  Send the message built so far as a single ioctl and copy the results of short reads
+ */
+static void _spidev_flush(wiznet_spidev_t *spidev) {
+    if (spidev->_num_xfers == 0) return;
+
+    // CS is released at the end of the message anyway ('cs_change' of the last transfer would
+    // keep it asserted)
+    spidev->_xfers[spidev->_num_xfers-1].cs_change = 0;
+
+    spidev->syscalls++;
+    if (spidev->ioctl(spidev->ioctl_ctx, spidev->fd, SPI_IOC_MESSAGE(spidev->_num_xfers), spidev->_xfers) < 0) {
+        spidev->errors++;
+        printf("SPI_IOC_MESSAGE has failed\n");
+    }
+
+    for (uint8_t i=0; i<spidev->_num_copies; i++)
+        memcpy(spidev->_copy_dst[i], &spidev->_rx[spidev->_copy_src[i]], spidev->_copy_len[i]);
+
+    spidev->_num_xfers = 0;
+    spidev->_len = 0;
+    spidev->_used = 0;
+    spidev->_num_copies = 0;
+}
+
+
+static struct spi_ioc_transfer *_spidev_add_xfer(wiznet_spidev_t *spidev, const uint8_t *tx, uint8_t *rx,
+                                                 uint32_t len) {
+    struct spi_ioc_transfer *xfer = &spidev->_xfers[spidev->_num_xfers++];
+    memset(xfer, 0, sizeof(struct spi_ioc_transfer));
+    xfer->tx_buf = (uintptr_t)tx;
+    xfer->rx_buf = (uintptr_t)rx;
+    xfer->len = len;
+    xfer->speed_hz = spidev->speed_hz;
+    xfer->bits_per_word = 8;
+    spidev->_len += len;
+    return xfer;
+}
+
+
+/*
+ *  Add 'len' bytes of the Data Phase of 'frame' starting from 'offset' to the message as a
+ *  separate frame (the chip increments the address by itself so a long frame can be split)
+ */
+static void _spidev_add_frame(wiznet_spidev_t *spidev, wiznet_frame_t *frame, uint16_t offset, uint16_t len) {
+
+    bool is_write = frame->header[2] & (1<<RWB);
+    bool is_short = (len <= WIZNET_SPI_FRAME_BUF_SIZE);
+
+    // make room for the header and the data
+    uint8_t num_xfers = is_short ? 1 : 2;
+    if (((spidev->_num_xfers+num_xfers) > WIZNET_SPIDEV_MAX_XFERS) ||
+        ((spidev->_len+3+len) > WIZNET_SPIDEV_BUFSIZ) ||
+        (spidev->_num_copies == WIZNET_SPIDEV_MAX_XFERS)) _spidev_flush(spidev);
+
+    uint16_t addr = ((frame->header[0]<<8) | frame->header[1]) + offset;
+    uint8_t *tx = &spidev->_tx[spidev->_used];
+    tx[0] = addr >> 8;
+    tx[1] = addr & 0xFF;
+    tx[2] = frame->header[2];
+
+    struct spi_ioc_transfer *xfer;
+    if (is_short) {
+        // whole frame in a single transfer (reads get dummy bytes after the header)
+        if (is_write) memcpy(&tx[3], frame->data+offset, len);
+        else memset(&tx[3], 0, len);
+        xfer = _spidev_add_xfer(spidev, tx, is_write ? NULL : &spidev->_rx[spidev->_used], 3+len);
+        if (!is_write) {
+            spidev->_copy_dst[spidev->_num_copies] = frame->data+offset;
+            spidev->_copy_src[spidev->_num_copies] = spidev->_used+3;
+            spidev->_copy_len[spidev->_num_copies] = len;
+            spidev->_num_copies++;
+        }
+        spidev->_used += 3+len;
+    }
+    else {
+        // the header and then the data right from/to the buffer of the library
+        _spidev_add_xfer(spidev, tx, NULL, 3);
+        xfer = _spidev_add_xfer(spidev, is_write ? frame->data+offset : NULL, is_write ? NULL : frame->data+offset, len);
+        spidev->_used += 3;
+    }
+    // release CS before the next frame
+    xfer->cs_change = 1;
+}
+
+
+/*
+ *  Put 'num' frames 'frames' into as few messages as the driver allows (usually a single one)
+ */
+static void _spidev_transfer_batch(wiznet_t *wiznet, wiznet_frame_t *frames[], uint8_t num) {
+    wiznet_spidev_t *spidev = wiznet->transport_ctx;
+
+    for (uint8_t i=0; i<num; i++) {
+        uint16_t offset = 0;
+        do {
+            uint16_t len = frames[i]->len - offset;
+            if (len > (WIZNET_SPIDEV_BUFSIZ-3)) len = WIZNET_SPIDEV_BUFSIZ-3;
+            _spidev_add_frame(spidev, frames[i], offset, len);
+            offset += len;
+        } while (offset < frames[i]->len);
+    }
+
+    _spidev_flush(spidev);
+}
+
+
+static void _spidev_transfer(wiznet_t *wiznet, wiznet_frame_t *frame) {
+    _spidev_transfer_batch(wiznet, &frame, 1);
+}
+
+
+// monotonic clock so timeouts aren't affected by the system time changes
+static uint32_t _spidev_millis(wiznet_t *wiznet) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec*1000u + (uint32_t)(ts.tv_nsec/1000000);
+}
+
+
+static uint32_t _spidev_cycles(wiznet_t *wiznet) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec*1000000000u + (uint32_t)ts.tv_nsec;
+}
+
+
+static void _spidev_hw_reset(wiznet_t *wiznet) {
+    wiznet_spidev_t *spidev = wiznet->transport_ctx;
+
+    if (spidev->hw_reset != NULL) {
+        spidev->hw_reset(spidev);
+        return;
+    }
+
+    // no access to RST pin: reset by MR register (the chip clears the bit when it's done,
+    // wiznet_hw_reset() waits for the PHY then)
+    uint8_t mr = 1<<MR_RST;
+    wiznet_frame_t frame = {.header = {MR >> 8, MR & 0xFF, (COMMON_REGISTERS << 3) | (1<<RWB)},
+                            .data = &mr, .len = sizeof(uint8_t)};
+    _spidev_transfer(wiznet, &frame);
+    usleep(1000);
+}
+
+
+const wiznet_transport_t wiznet_spidev_transport = {
+    .transfer = _spidev_transfer,
+    .millis = _spidev_millis,
+    .hw_reset = _spidev_hw_reset,
+    .cycles = _spidev_cycles,
+    .transfer_batch = _spidev_transfer_batch
+};
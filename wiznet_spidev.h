@@ -0,0 +1,84 @@
+#ifndef WIZNET_SPIDEV_H_
+#define WIZNET_SPIDEV_H_
+
+
+
+#include "wiznet.h"
+
+#include <linux/spi/spidev.h>
+
+
+
+/*
+ *  Transport for Linux userspace through the spidev driver (/dev/spidevB.C). Every call of the
+ *  transport is a single SPI_IOC_MESSAGE ioctl: the header and the data of a frame go as
+ *  adjacent transfers of one message and CS is released between frames with 'cs_change'. Frames
+ *  given by wiznet_xfer_submit_many() (e.g. the data, Sn_TX_WR and SEND command of a packet) are
+ *  packed into the same message, so the number of system calls per packet is minimal.
+ *
+ *    wiznet_spidev_t spidev = wiznet_spidev_t_init();
+ *    wiznet_spidev_open(&spidev, "/dev/spidev0.0");
+ *
+ *    wiznet_t wiznet = wiznet_t_init();
+ *    wiznet_spidev_attach(&spidev, &wiznet);
+ *    wiznet_init(&wiznet);
+ *
+ *  Build with WIZNET_USE_HAL=0. Set 'ioctl' hook to run the library without the hardware (see
+ *  wiznet_sim_spidev_ioctl())
+ */
+
+
+#define WIZNET_SPIDEV_SPEED_HZ 20000000  // W5500 guarantees 33.3 MHz, 80 MHz in practice
+
+// 'bufsiz' parameter of the spidev module: maximum number of bytes in a single message
+#ifndef WIZNET_SPIDEV_BUFSIZ
+#define WIZNET_SPIDEV_BUFSIZ 4096
+#endif
+// maximum number of transfers in a single message (every frame takes 1 or 2 of them)
+#ifndef WIZNET_SPIDEV_MAX_XFERS
+#define WIZNET_SPIDEV_MAX_XFERS 32
+#endif
+
+
+typedef struct WiznetSpidev wiznet_spidev_t;
+
+struct WiznetSpidev {
+    int fd;
+    uint32_t speed_hz;
+    // optional: toggle RST pin of the chip (e.g. through libgpiod), NULL - software reset by MR
+    void (*hw_reset)(wiznet_spidev_t *spidev);
+    // system call used to talk to the device, ioctl() by default
+    int (*ioctl)(void *ctx, int fd, unsigned long request, void *arg);
+    void *ioctl_ctx;
+
+    uint32_t syscalls;  // SPI_IOC_MESSAGE requests made
+    uint32_t errors;  // failed ones
+
+    // private members: message being built. Headers and short frames are assembled in the
+    // scratch buffers, long data phases are clocked right from/to the buffers of the library
+    struct spi_ioc_transfer _xfers[WIZNET_SPIDEV_MAX_XFERS];
+    uint8_t _num_xfers;
+    uint32_t _len;  // bytes in the message
+    uint16_t _used;  // bytes of the scratch buffers
+    uint8_t _tx[WIZNET_SPIDEV_BUFSIZ];
+    uint8_t _rx[WIZNET_SPIDEV_BUFSIZ];
+    // short reads to be copied from '_rx' after the message
+    uint8_t *_copy_dst[WIZNET_SPIDEV_MAX_XFERS];
+    uint16_t _copy_src[WIZNET_SPIDEV_MAX_XFERS];
+    uint16_t _copy_len[WIZNET_SPIDEV_MAX_XFERS];
+    uint8_t _num_copies;
+};
+
+
+extern const wiznet_transport_t wiznet_spidev_transport;
+
+
+wiznet_spidev_t wiznet_spidev_t_init(void);
+int32_t wiznet_spidev_open(wiznet_spidev_t *spidev, const char *path);
+int32_t wiznet_spidev_setup(wiznet_spidev_t *spidev);
+void wiznet_spidev_close(wiznet_spidev_t *spidev);
+void wiznet_spidev_attach(wiznet_spidev_t *spidev, wiznet_t *wiznet);
+
+
+
+#endif /* WIZNET_SPIDEV_H_ */
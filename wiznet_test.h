@@ -0,0 +1,126 @@
+#ifndef WIZNET_TEST_H_
+#define WIZNET_TEST_H_
+
+
+
+#include "wiznet_sim.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+
+
+/*
+ *  Common part of the host tests. Every test is a separate program running the library against
+ *  the simulated chip (see wiznet_sim.h), it prints failed checks and returns non-zero if there
+ *  were any. Build and run all of them (in all configurations) by
+ *
+ *    make test
+ *
+ *  Log of the library goes to the standard output along with the results
+ */
+
+
+static uint32_t test_failures;
+
+#define TEST_CHECK(cond) do {                                                   \
+    if (!(cond)) {                                                              \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);         \
+        __atomic_fetch_add(&test_failures, 1, __ATOMIC_RELAXED);                \
+    }                                                                           \
+} while (0)
+
+
+static const uint8_t test_peer_ip[4] = {192,168,1,214};
+static const uint16_t test_peer_port = 1200;
+
+
+#if WIZNET_THREAD_SAFE
+/*
+ *  OS hooks of the thread-safe mode on top of pthreads
+ */
+static inline void *_test_mutex_create(void) {
+    pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return mutex;
+}
+
+static inline void _test_mutex_lock(void *mutex) {
+    pthread_mutex_lock(mutex);
+}
+
+static inline void _test_mutex_unlock(void *mutex) {
+    pthread_mutex_unlock(mutex);
+}
+
+static inline void _test_yield(void) {
+    sched_yield();
+}
+
+static inline const wiznet_os_t *test_os(void) {
+    static const wiznet_os_t os = {
+        .mutex_create = _test_mutex_create,
+        .mutex_lock = _test_mutex_lock,
+        .mutex_unlock = _test_mutex_unlock,
+        .yield = _test_yield
+    };
+    return &os;
+}
+#endif
+
+
+/*
+ *  Fill 'wiznet' with the test network settings. The transport is left to the caller
+ */
+static inline void test_wiznet_t_init(wiznet_t *wiznet, uint8_t n) {
+    *wiznet = wiznet_t_init();
+    for (uint8_t i=0; i<6; i++) {
+        wiznet->mac_addr[i] = (uint8_t[]){44,45,46,47,48,49+n}[i];
+        if (i < 4) {
+            wiznet->ip_addr[i] = (uint8_t[]){192,168,1,100+n}[i];
+            wiznet->ip_gateway_addr[i] = (uint8_t[]){192,168,1,1}[i];
+            wiznet->subnet_mask[i] = (uint8_t[]){255,255,255,0}[i];
+        }
+    }
+#if WIZNET_THREAD_SAFE
+    wiznet->os = test_os();
+#endif
+}
+
+
+/*
+ *  Start the simulated chip 'sim' and register 'wiznet' (n-th one) working with it
+ */
+static inline int32_t test_wiznet(wiznet_sim_t *sim, wiznet_t *wiznet, uint8_t n) {
+    wiznet_sim_init(sim);
+    test_wiznet_t_init(wiznet, n);
+    wiznet_sim_attach(sim, wiznet);
+    return wiznet_init(wiznet);
+}
+
+
+/*
+ *  Open the socket 'sock' of 'type' on 'wiznet' talking to the test peer
+ */
+static inline sock_status_t test_socket(wiznet_t *wiznet, socket_t *sock, sock_type_t type) {
+    *sock = socket_t_init();
+    sock->type = type;
+    memcpy(sock->ip, test_peer_ip, 4);
+    sock->port = test_peer_port;
+    return socket(wiznet, sock);
+}
+
+
+static inline int test_result(const char *name) {
+    printf("%s: %s\n", name, test_failures ? "FAILED" : "OK");
+    return test_failures ? 1 : 0;
+}
+
+
+
+#endif /* WIZNET_TEST_H_ */
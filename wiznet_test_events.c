@@ -0,0 +1,101 @@
+#include "wiznet_test.h"
+
+#include <pthread.h>
+
+
+/*
+ *  Stress test of the interrupt events queue (see wiznet_isr_handler()): one thread produces
+ *  events as the interrupt would do, another one drains them by wiznet_process_events(). Every
+ *  event should be either delivered to the handler or counted as an overflow. The time of the
+ *  model moves by 1 ms before every event so timestamps of the delivered ones must strictly
+ *  grow (a reordered, repeated or not yet written record would break it). Built with the
+ *  default WIZNET_EVENT_QUEUE_SIZE (overflows are likely) and with a large one
+ */
+
+
+#define EVENTS_NUM 100000
+
+static wiznet_sim_t sim;
+static wiznet_t wiznet;
+static socket_t udp;
+
+static volatile bool producer_done;
+static uint32_t events_produced;
+static uint32_t events_delivered;
+static uint32_t last_timestamp;
+static uint32_t events_misordered;
+static uint32_t events_corrupted;
+
+
+static void _on_recv(socket_t *sock, sock_isr_type_t type, void *arg) {
+    const wiznet_event_t *event = wiznet_current_event(&wiznet);
+    if ((sock != &udp) || (type != SOCK_IR_RECV) || (event == NULL) || (event->sock_n != udp._id) ||
+        (event->ir != (1<<SOCK_IR_RECV)) || (event->sr != SOCK_STATUS_UDP)) {
+        events_corrupted++;
+        return;
+    }
+    if ((events_delivered > 0) && (event->timestamp <= last_timestamp)) events_misordered++;
+    last_timestamp = event->timestamp;
+    events_delivered++;
+}
+
+
+/*
+ *  Every iteration puts a datagram into the RX buffer of the socket (so RECV flag is raised) and
+ *  runs the interrupt handler: exactly one event per iteration. Only this thread touches SPI, the
+ *  consumer doesn't need it for the events of a UDP socket
+ */
+static void *_producer(void *arg) {
+    static uint8_t rx_buf[WIZNET_SIM_BUFFER_SIZE];
+    uint8_t data[32];
+
+    for (uint32_t i=0; i<EVENTS_NUM; i++) {
+        memcpy(data, &i, sizeof(i));
+        if (wiznet_sim_deliver(&sim, udp._id, test_peer_ip, test_peer_port, data, sizeof(data)) == 0) {
+            // RX buffer is full: free it and try again
+            recv(&udp, rx_buf, sizeof(rx_buf));
+            TEST_CHECK(wiznet_sim_deliver(&sim, udp._id, test_peer_ip, test_peer_port, data, sizeof(data)) > 0);
+        }
+        wiznet_sim_advance(&sim, 1);
+        wiznet_isr_handler(&wiznet);
+        events_produced++;
+    }
+
+    __atomic_store_n(&producer_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+
+static void *_consumer(void *arg) {
+    while (!__atomic_load_n(&producer_done, __ATOMIC_ACQUIRE)) {
+        if (wiznet_process_events(&wiznet) == 0) sched_yield();
+    }
+    // the producer has stopped, take the rest
+    while (wiznet_process_events(&wiznet) > 0);
+    return NULL;
+}
+
+
+int main(void) {
+    TEST_CHECK(test_wiznet(&sim, &wiznet, 0) == 0);
+    TEST_CHECK(test_socket(&wiznet, &udp, SOCK_TYPE_UDP) == SOCK_STATUS_UDP);
+    sock_set_callback(&udp, SOCK_IR_RECV, _on_recv, NULL);
+
+    pthread_t producer, consumer;
+    pthread_create(&consumer, NULL, _consumer, NULL);
+    pthread_create(&producer, NULL, _producer, NULL);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+
+    uint32_t overflows = wiznet_events_overflows(&wiznet);
+    printf("queue of %d: %u events produced, %u delivered, %u overflows\n", WIZNET_EVENT_QUEUE_SIZE,
+           events_produced, events_delivered, overflows);
+    TEST_CHECK(events_produced == EVENTS_NUM);
+    TEST_CHECK(events_delivered + overflows == events_produced);
+    TEST_CHECK(events_delivered > 0);
+    TEST_CHECK(events_misordered == 0);
+    TEST_CHECK(events_corrupted == 0);
+    TEST_CHECK(wiznet_current_event(&wiznet) == NULL);
+
+    return test_result("wiznet_test_events");
+}
@@ -0,0 +1,232 @@
+#include "wiznet_test.h"
+
+#include <pthread.h>
+
+
+/*
+ *  Tests of several Wiznets working at the same time (built with NUM_OF_WIZNETS=4): registration
+ *  and reuse of the slots, balancing of new sockets between the chips (socket_any(),
+ *  wiznet_pick()) and the exclusive access of the chips to the shared SPI bus (wiznet_bus_t)
+ */
+
+
+#if NUM_OF_WIZNETS != 4
+#error "build the test with NUM_OF_WIZNETS=4"
+#endif
+
+#define BUS_DATAGRAMS 500
+#define BUS_PAYLOAD 256
+
+static wiznet_sim_t sims[NUM_OF_WIZNETS+1];
+static wiznet_t wiznets[NUM_OF_WIZNETS+1];
+
+
+static void _deinit_all(void) {
+    for (uint8_t i=0; i<=NUM_OF_WIZNETS; i++) {
+        if (wiznets[i]._id >= 0) wiznet_deinit(&wiznets[i]);
+        wiznets[i] = wiznet_t_init();
+    }
+}
+
+
+/*
+ *  Chips take the first free slot, the one freed by wiznet_deinit() is reused and re-initialized
+ *  chip stays where it is
+ */
+static void _test_slots(void) {
+    for (uint8_t i=0; i<NUM_OF_WIZNETS; i++) {
+        TEST_CHECK(test_wiznet(&sims[i], &wiznets[i], i) == 0);
+        TEST_CHECK(wiznets[i]._id == i);
+    }
+
+    // no more slots
+    TEST_CHECK(test_wiznet(&sims[NUM_OF_WIZNETS], &wiznets[NUM_OF_WIZNETS], NUM_OF_WIZNETS) != 0);
+
+    // re-initialization keeps the slot and doesn't take another one
+    TEST_CHECK(wiznet_init(&wiznets[2]) == 0);
+    TEST_CHECK(wiznets[2]._id == 2);
+
+    // the freed slot goes to the next chip
+    wiznet_deinit(&wiznets[1]);
+    TEST_CHECK(wiznet_init(&wiznets[NUM_OF_WIZNETS]) == 0);
+    TEST_CHECK(wiznets[NUM_OF_WIZNETS]._id == 1);
+
+    // and it's the only free one
+    TEST_CHECK(wiznet_init(&wiznets[1]) != 0);
+
+    _deinit_all();
+}
+
+
+static void _udp_t_init(socket_t *sock, uint16_t port, uint8_t buf_size) {
+    *sock = socket_t_init();
+    sock->type = SOCK_TYPE_UDP;
+    memcpy(sock->ip, test_peer_ip, 4);
+    sock->port = port;
+    sock->rx_buf_size = buf_size;
+    sock->tx_buf_size = buf_size;
+}
+
+
+/*
+ *  New sockets go to the chip with the most free HW sockets and then with the most free memory
+ */
+static void _test_balancing(void) {
+    static socket_t socks[12];
+    socket_t sock;
+
+    for (uint8_t i=0; i<3; i++) TEST_CHECK(test_wiznet(&sims[i], &wiznets[i], i) == 0);
+
+    // sockets are spread evenly
+    for (uint8_t i=0; i<9; i++) {
+        _udp_t_init(&socks[i], 5000+i, 1);
+        TEST_CHECK(socket_any(&socks[i]) == SOCK_STATUS_UDP);
+    }
+    for (uint8_t i=0; i<3; i++) TEST_CHECK(wiznets[i]._sockets_cnt == 3);
+
+    // the chip with the most free sockets wins
+    _udp_t_init(&socks[9], 6000, 8);
+    TEST_CHECK(socket(&wiznets[0], &socks[9]) == SOCK_STATUS_UDP);
+    _udp_t_init(&socks[10], 6001, 4);
+    TEST_CHECK(socket(&wiznets[1], &socks[10]) == SOCK_STATUS_UDP);
+    _udp_t_init(&sock, 6002, 1);
+    TEST_CHECK(wiznet_pick(&sock) == &wiznets[2]);
+
+    // equal number of free sockets: the chip with the most free memory wins. Chips have 3, 7 and 9
+    // KB left (Socket0 keeps its 2 KB, 3 sockets of 1 KB and the last one)
+    _udp_t_init(&socks[11], 6003, 2);
+    TEST_CHECK(socket(&wiznets[2], &socks[11]) == SOCK_STATUS_UDP);
+    TEST_CHECK(wiznet_pick(&sock) == &wiznets[2]);
+    sock.rx_buf_size = sock.tx_buf_size = 4;
+    TEST_CHECK(wiznet_pick(&sock) == &wiznets[2]);
+
+    // MACRAW needs Socket0 which is left free by the other sockets
+    socket_t macraw[3];
+    for (uint8_t i=0; i<3; i++) {
+        macraw[i] = socket_t_init();
+        macraw[i].type = SOCK_TYPE_MACRAW;
+        TEST_CHECK(socket_any(&macraw[i]) == SOCK_STATUS_MACRAW);
+    }
+    TEST_CHECK((macraw[0]._host_wiznet != macraw[1]._host_wiznet) &&
+               (macraw[1]._host_wiznet != macraw[2]._host_wiznet) &&
+               (macraw[0]._host_wiznet != macraw[2]._host_wiznet));
+    socket_t extra = socket_t_init();
+    extra.type = SOCK_TYPE_MACRAW;
+    TEST_CHECK(wiznet_pick(&extra) == NULL);
+    TEST_CHECK(socket_any(&extra) < 0);
+
+    // chips which can't fit the buffers are skipped, no chip - no socket
+    sock.rx_buf_size = sock.tx_buf_size = 8;
+    TEST_CHECK(wiznet_pick(&sock) == &wiznets[2]);
+    TEST_CHECK(socket_any(&sock) == SOCK_STATUS_UDP);
+    TEST_CHECK(sock._host_wiznet == &wiznets[2]);
+    _udp_t_init(&sock, 6004, 4);
+    TEST_CHECK(wiznet_pick(&sock) == &wiznets[1]);
+    sock.rx_buf_size = sock.tx_buf_size = 8;
+    TEST_CHECK(wiznet_pick(&sock) == NULL);
+    TEST_CHECK(socket_any(&sock) < 0);
+
+    _deinit_all();
+}
+
+
+/*
+ *  Transport of the chips on the shared bus: the model wrapped by a check that no other frame is
+ *  on the bus at the same time
+ */
+static wiznet_transport_t bus_transport;
+static volatile uint32_t bus_users;
+static volatile uint32_t bus_overlaps;
+
+static void _bus_transfer(wiznet_t *wiznet, wiznet_frame_t *frame) {
+    if (__atomic_fetch_add(&bus_users, 1, __ATOMIC_ACQ_REL) != 0)
+        __atomic_fetch_add(&bus_overlaps, 1, __ATOMIC_RELAXED);
+    sched_yield();  // give the other chip a chance to break in
+    wiznet_sim_transport.transfer(wiznet, frame);
+    __atomic_fetch_sub(&bus_users, 1, __ATOMIC_ACQ_REL);
+}
+
+
+static uint32_t sent_ok[2];
+
+static void _on_send(wiznet_sim_t *sim, uint8_t sock_n, const uint8_t *data, uint16_t len, void *user) {
+    uint32_t n = (uintptr_t)user;
+    uint32_t seq;
+    memcpy(&seq, data, sizeof(seq));
+    bool is_intact = (len == BUS_PAYLOAD) && (seq == sent_ok[n]);
+    for (uint16_t i=sizeof(seq); i<len; i++) is_intact = is_intact && (data[i] == (uint8_t)(seq+i+n));
+    TEST_CHECK(is_intact);
+    if (is_intact) sent_ok[n]++;
+}
+
+
+static void *_bus_sender(void *arg) {
+    socket_t *sock = arg;
+    uint32_t n = sock->_host_wiznet->_id;
+    uint8_t data[BUS_PAYLOAD];
+    for (uint32_t seq=0; seq<BUS_DATAGRAMS; seq++) {
+        memcpy(data, &seq, sizeof(seq));
+        for (uint16_t i=sizeof(seq); i<sizeof(data); i++) data[i] = seq+i+n;
+        sendto(sock, data, sizeof(data));
+    }
+    return NULL;
+}
+
+
+/*
+ *  2 chips on one bus driven by 2 threads: frames never overlap and all the data goes out intact.
+ *  'bus' is NULL to see the overlaps of the chips on separate buses
+ */
+static uint32_t _run_shared_bus(wiznet_bus_t *bus) {
+    static socket_t socks[2];
+
+    bus_transport = wiznet_sim_transport;
+    bus_transport.transfer = _bus_transfer;
+    bus_overlaps = 0;
+
+    for (uint8_t i=0; i<2; i++) {
+        wiznet_sim_init(&sims[i]);
+        sims[i].on_send = _on_send;
+        sims[i].user = (void *)(uintptr_t)i;
+        test_wiznet_t_init(&wiznets[i], i);
+        wiznets[i].transport = &bus_transport;
+        wiznets[i].transport_ctx = &sims[i];
+        wiznets[i].bus = bus;
+        TEST_CHECK(wiznet_init(&wiznets[i]) == 0);
+        TEST_CHECK(wiznets[i]._id == i);
+        TEST_CHECK(test_socket(&wiznets[i], &socks[i], SOCK_TYPE_UDP) == SOCK_STATUS_UDP);
+        sent_ok[i] = 0;
+    }
+
+    pthread_t threads[2];
+    for (uint8_t i=0; i<2; i++) pthread_create(&threads[i], NULL, _bus_sender, &socks[i]);
+    for (uint8_t i=0; i<2; i++) pthread_join(threads[i], NULL);
+
+    for (uint8_t i=0; i<2; i++) TEST_CHECK(sent_ok[i] == BUS_DATAGRAMS);
+    uint32_t overlaps = bus_overlaps;
+    _deinit_all();
+    return overlaps;
+}
+
+
+static void _test_shared_bus(void) {
+    wiznet_bus_t bus = wiznet_bus_t_init();
+    uint32_t overlaps = _run_shared_bus(&bus);
+    printf("shared bus: %u overlapping frames\n", overlaps);
+    TEST_CHECK(overlaps == 0);
+    TEST_CHECK(bus._next_ticket == bus._now_serving);
+
+    // not asserted, just shows that the chips on separate buses do work in parallel
+    printf("separate buses: %u overlapping frames\n", _run_shared_bus(NULL));
+}
+
+
+int main(void) {
+    for (uint8_t i=0; i<=NUM_OF_WIZNETS; i++) wiznets[i] = wiznet_t_init();
+
+    _test_slots();
+    _test_balancing();
+    _test_shared_bus();
+
+    return test_result("wiznet_test_multi");
+}
@@ -0,0 +1,709 @@
+#include "wiznet_test.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include "wiznet_spidev.h"
+#endif
+
+
+/*
+ *  Scenarios of the whole public API (UDP, TCP client and server, MACRAW, zero-copy and
+ *  allocating receive, interrupts, polling, non-blocking operations) run against the simulated
+ *  chip through every host transport: the blocking model, the model served by a worker thread
+ *  (asynchronous transport) and the spidev transport on top of the model. Every scenario starts
+ *  with a freshly reset chip.
+ *
+ *  The same program is built in several configurations of the library (see Makefile): default,
+ *  thread-safe, no-heap, multi-chip and fixed length data mode (FDM, the asynchronous transport
+ *  is skipped there as the mode doesn't support it)
+ */
+
+
+typedef enum TestTransport {
+    TEST_TRANSPORT_SIM,
+    TEST_TRANSPORT_SIM_ASYNC,
+#ifdef __linux__
+    TEST_TRANSPORT_SPIDEV,
+#endif
+    NUM_OF_TEST_TRANSPORTS
+} test_transport_t;
+
+static const char *transport_names[] = {
+    "sim",
+    "sim_async",
+#ifdef __linux__
+    "spidev"
+#endif
+};
+
+static wiznet_sim_t sim;
+static wiznet_t wiznet;
+#ifdef __linux__
+static wiznet_spidev_t spidev;
+#endif
+
+// everything the chip has sent, in order
+static uint8_t sent[WIZNET_SIM_BUFFER_SIZE];
+static uint32_t sent_len;
+static uint32_t sent_packets;
+
+
+static void _on_send(wiznet_sim_t *sim, uint8_t sock_n, const uint8_t *data, uint16_t len, void *user) {
+    if (sent_len+len <= sizeof(sent)) memcpy(&sent[sent_len], data, len);
+    sent_len += len;
+    sent_packets++;
+}
+
+static void _sent_reset(void) {
+    sent_len = 0;
+    sent_packets = 0;
+}
+
+
+static void _fill(uint8_t *data, uint32_t len, uint8_t seed) {
+    for (uint32_t i=0; i<len; i++) data[i] = (i*7 + seed) & 0xFF;
+}
+
+static bool _is_sent(const uint8_t *data, uint32_t len) {
+    return (sent_len == len) && (memcmp(sent, data, len) == 0);
+}
+
+
+static bool _setup(test_transport_t transport) {
+    wiznet_sim_init(&sim);
+    sim.on_send = _on_send;
+    _sent_reset();
+    test_wiznet_t_init(&wiznet, 0);
+
+    switch (transport) {
+    case TEST_TRANSPORT_SIM:
+        wiznet_sim_attach(&sim, &wiznet);
+        break;
+    case TEST_TRANSPORT_SIM_ASYNC:
+#if WIZNET_USE_FDM
+        return false;
+#endif
+        wiznet_sim_attach_async(&sim, &wiznet);
+        break;
+#ifdef __linux__
+    case TEST_TRANSPORT_SPIDEV:
+        spidev = wiznet_spidev_t_init();
+        spidev.ioctl = wiznet_sim_spidev_ioctl;
+        spidev.ioctl_ctx = &sim;
+        wiznet_spidev_attach(&spidev, &wiznet);
+        break;
+#endif
+    default:
+        return false;
+    }
+
+#if WIZNET_USE_FDM
+    wiznet.fdm = true;
+    sim.cs_tied = true;
+#endif
+
+    return true;
+}
+
+static void _teardown(test_transport_t transport) {
+    wiznet_deinit(&wiznet);
+    if (transport == TEST_TRANSPORT_SIM_ASYNC) wiznet_sim_detach(&sim);
+}
+
+
+static uint16_t _reg16(const uint8_t *reg) {
+    return (reg[0]<<8) | reg[1];
+}
+
+
+/*
+ *  Network settings and the retransmission timer go to the chip
+ */
+static void _test_common_regs(void) {
+    TEST_CHECK(wiznet_get_version(&wiznet) == 4);
+    TEST_CHECK(memcmp(&sim.common[SHAR], wiznet.mac_addr, 6) == 0);
+    TEST_CHECK(memcmp(&sim.common[SIPR], wiznet.ip_addr, 4) == 0);
+    TEST_CHECK(memcmp(&sim.common[GAR], wiznet.ip_gateway_addr, 4) == 0);
+    TEST_CHECK(memcmp(&sim.common[SUBR], wiznet.subnet_mask, 4) == 0);
+
+    wiznet_set_retry(&wiznet, 500, 3);
+    TEST_CHECK(_reg16(&sim.common[RTR]) == 500);
+    TEST_CHECK(sim.common[RCR] == 3);
+#if WIZNET_USE_FDM
+    TEST_CHECK(sim.counters.fixed_frames > 0);
+    TEST_CHECK(sim.counters.cs_collisions == 0);
+#endif
+}
+
+
+/*
+ *  Datagrams to the default and to other destinations, single and batched receive
+ */
+static void _test_udp(void) {
+    socket_t sock;
+    TEST_CHECK(test_socket(&wiznet, &sock, SOCK_TYPE_UDP) == SOCK_STATUS_UDP);
+    TEST_CHECK(_reg16(&sim.sock_regs[sock._id][Sn_PORT]) == test_peer_port);
+
+    uint8_t data[300];
+    _fill(data, sizeof(data), 1);
+    sendto(&sock, data, sizeof(data));
+    TEST_CHECK(_is_sent(data, sizeof(data)));
+    TEST_CHECK(memcmp(&sim.sock_regs[sock._id][Sn_DIPR], test_peer_ip, 4) == 0);
+    TEST_CHECK(_reg16(&sim.sock_regs[sock._id][Sn_DPORT]) == test_peer_port);
+
+    const uint8_t other_ip[4] = {192,168,1,215};
+    _sent_reset();
+    TEST_CHECK(sendto_addr(&sock, other_ip, 1300, data, 100) == 100);
+    TEST_CHECK(_is_sent(data, 100));
+    TEST_CHECK(memcmp(&sim.sock_regs[sock._id][Sn_DIPR], other_ip, 4) == 0);
+    TEST_CHECK(_reg16(&sim.sock_regs[sock._id][Sn_DPORT]) == 1300);
+
+    // 3 datagrams from different ports, the last one doesn't fit its buffer
+    uint8_t in[3][40];
+    for (uint8_t i=0; i<3; i++) {
+        _fill(in[i], sizeof(in[i]), 10+i);
+        TEST_CHECK(wiznet_sim_deliver(&sim, sock._id, test_peer_ip, 2000+i, in[i], 20+10*i) > 0);
+    }
+    uint8_t bufs[3][40];
+    sock_datagram_t msgs[4];
+    for (uint8_t i=0; i<4; i++) msgs[i] = (sock_datagram_t){ .buf = bufs[i%3], .buf_size = (i == 2) ? 30 : 40 };
+    TEST_CHECK(recvmmsg(&sock, msgs, 4) == 3);
+    for (uint8_t i=0; i<3; i++) {
+        TEST_CHECK(msgs[i].len == 20+10*i);
+        TEST_CHECK(memcmp(msgs[i].buf, in[i], (i == 2) ? 30 : msgs[i].len) == 0);
+        TEST_CHECK(memcmp(msgs[i].ip, test_peer_ip, 4) == 0);
+        TEST_CHECK(msgs[i].port == 2000+i);
+    }
+
+    uint8_t buf[64], ip[4];
+    uint16_t port;
+    TEST_CHECK(recvfrom(&sock, buf, sizeof(buf), ip, &port) == 0);
+    TEST_CHECK(wiznet_sim_deliver(&sim, sock._id, other_ip, 3000, in[0], 33) > 0);
+    TEST_CHECK(recvfrom(&sock, buf, sizeof(buf), ip, &port) == 33);
+    TEST_CHECK((memcmp(buf, in[0], 33) == 0) && (memcmp(ip, other_ip, 4) == 0) && (port == 3000));
+
+    sock_close(&sock);
+    TEST_CHECK(sock.status == SOCK_STATUS_CLOSED);
+    TEST_CHECK(sim.sock_regs[sock._id][Sn_SR] == SOCK_STATUS_CLOSED);
+    sock_deinit(&sock);
+}
+
+
+/*
+ *  TCP client: streams bigger than the HW buffers both ways, then the peer closes the connection
+ */
+#define STREAM_SIZE 8000
+
+static void _test_tcp(void) {
+    static uint8_t data[STREAM_SIZE], buf[WIZNET_SIM_BUFFER_SIZE];
+
+    sim.connect_latency_ms = 3;
+    socket_t sock;
+    TEST_CHECK(test_socket(&wiznet, &sock, SOCK_TYPE_TCP) == SOCK_STATUS_ESTABLISHED);
+
+    _fill(data, sizeof(data), 3);
+    TEST_CHECK(send_stream(&sock, data, sizeof(data), 1000) == sizeof(data));
+    TEST_CHECK(_is_sent(data, sizeof(data)));
+    TEST_CHECK(sent_packets > 1);
+
+    _fill(data, sizeof(data), 4);
+    uint32_t delivered = 0, received = 0;
+    for (uint32_t i=0; (i < 1000) && (received < sizeof(data)); i++) {
+        if (delivered < sizeof(data))
+            delivered += wiznet_sim_deliver(&sim, sock._id, test_peer_ip, test_peer_port, &data[delivered],
+                                            sizeof(data)-delivered);
+        received += recv(&sock, &buf[received], sizeof(buf)-received);
+    }
+    TEST_CHECK((received == sizeof(data)) && (memcmp(buf, data, sizeof(data)) == 0));
+
+    wiznet_sim_peer_close(&sim, sock._id);
+    sock_poll_set_t interest = { .closed = SOCK_POLL_MASK(&sock) }, ready;
+    TEST_CHECK(wiznet_poll(&wiznet, &interest, &ready, 0) > 0);
+    TEST_CHECK(ready.closed == SOCK_POLL_MASK(&sock));
+    sock_discon(&sock);
+    TEST_CHECK(sock.status == SOCK_STATUS_CLOSED);
+    sock_deinit(&sock);
+}
+
+
+/*
+ *  recv_alloc() and recv_peek() over the data crossing the end of the HW RX ring
+ */
+static uint8_t *_peek_sink(socket_t *sock, uint16_t offset, uint16_t len, uint16_t total, void *arg) {
+    return (uint8_t *)arg + offset;
+}
+
+static void _test_recv_alloc(void) {
+    socket_t sock;
+    TEST_CHECK(test_socket(&wiznet, &sock, SOCK_TYPE_TCP) == SOCK_STATUS_ESTABLISHED);
+
+    uint8_t data[700], peeked[700];
+    uint8_t *buf = NULL;
+    // 2 KB ring is wrapped several times
+    for (uint8_t i=0; i<10; i++) {
+        _fill(data, sizeof(data), 20+i);
+        TEST_CHECK(wiznet_sim_deliver(&sim, sock._id, test_peer_ip, test_peer_port, data, sizeof(data)) ==
+                   sizeof(data));
+        if (i % 2) {
+            TEST_CHECK(recv_alloc(&sock, &buf) == sizeof(data));
+            TEST_CHECK((buf != NULL) && (memcmp(buf, data, sizeof(data)) == 0));
+        } else {
+            TEST_CHECK(recv_peek(&sock, _peek_sink, peeked) == sizeof(data));
+            TEST_CHECK(memcmp(peeked, data, sizeof(data)) == 0);
+            recv_consume(&sock, sizeof(data));
+        }
+    }
+    TEST_CHECK(recv_alloc(&sock, &buf) == 0);
+    recv_free(&sock, &buf);
+    TEST_CHECK(buf == NULL);
+
+#if WIZNET_USE_POOL
+    wiznet_pool_stats_t stats[WIZNET_POOL_NUM_CLASSES];
+    wiznet_pool_get_stats(&wiznet, stats);
+    for (uint8_t i=0; i<WIZNET_POOL_NUM_CLASSES; i++) {
+        TEST_CHECK(stats[i].in_use == 0);
+        TEST_CHECK((stats[i].failures == 0) && (stats[i].bad_frees == 0));
+    }
+#endif
+
+    sock_close(&sock);
+    sock_deinit(&sock);
+}
+
+
+/*
+ *  Batch of MACRAW frames into a ring, the one bigger than a slot is dropped
+ */
+#define RING_SLOTS 4
+#define RING_SLOT_SIZE 128
+
+static void _test_macraw(void) {
+    static uint8_t slots[RING_SLOTS*RING_SLOT_SIZE];
+    static uint16_t lens[RING_SLOTS];
+
+    socket_t sock = socket_t_init();
+    sock.type = SOCK_TYPE_MACRAW;
+    for (uint8_t i=0; i<6; i++) sock.macraw_dst[i] = 0xFF;
+    TEST_CHECK(socket(&wiznet, &sock) == SOCK_STATUS_MACRAW);
+    TEST_CHECK(sock._id == 0);
+
+    uint8_t frames[4][200];
+    const uint16_t frame_lens[4] = {60, 200, 100, 128};
+    for (uint8_t i=0; i<4; i++) {
+        _fill(frames[i], frame_lens[i], 30+i);
+        TEST_CHECK(wiznet_sim_deliver(&sim, sock._id, NULL, 0, frames[i], frame_lens[i]) > 0);
+    }
+
+    sock_frame_ring_t ring;
+    sock_frame_ring_init(&ring, slots, lens, RING_SLOT_SIZE, RING_SLOTS);
+    sock_frame_batch_t batch;
+    TEST_CHECK(recv_macraw(&sock, &ring, &batch) == 3);
+    TEST_CHECK((batch.frames == 3) && (batch.drops == 1) && !batch.ring_full);
+    for (uint8_t i=0; i<4; i++) {
+        if (i == 1) continue;
+        uint16_t len;
+        uint8_t *frame = sock_frame_ring_peek(&ring, &len);
+        TEST_CHECK((frame != NULL) && (len == frame_lens[i]) && (memcmp(frame, frames[i], len) == 0));
+        sock_frame_ring_pop(&ring);
+    }
+    uint16_t len;
+    TEST_CHECK(sock_frame_ring_peek(&ring, &len) == NULL);
+
+    sendto(&sock, frames[0], frame_lens[0]);
+    TEST_CHECK(_is_sent(frames[0], frame_lens[0]));
+
+    sock_close(&sock);
+    sock_deinit(&sock);
+}
+
+
+/*
+ *  Interrupt of the chip: readiness by wiznet_poll() and the callback by wiznet_process_events()
+ */
+static void _count_event(socket_t *sock, sock_isr_type_t type, void *arg) {
+    (*(uint32_t *)arg)++;
+}
+
+static void _test_events(void) {
+    socket_t sock;
+    TEST_CHECK(test_socket(&wiznet, &sock, SOCK_TYPE_UDP) == SOCK_STATUS_UDP);
+    uint32_t events = 0;
+    sock_set_callback(&sock, SOCK_IR_RECV, _count_event, &events);
+
+    sock_poll_set_t interest = { .readable = SOCK_POLL_MASK(&sock) }, ready;
+    TEST_CHECK(wiznet_poll(&wiznet, &interest, &ready, 0) == 0);
+    TEST_CHECK(!wiznet_sim_int_asserted(&sim));
+
+    uint8_t data[50];
+    _fill(data, sizeof(data), 5);
+    TEST_CHECK(wiznet_sim_deliver(&sim, sock._id, test_peer_ip, test_peer_port, data, sizeof(data)) > 0);
+    TEST_CHECK(wiznet_sim_int_asserted(&sim));
+    TEST_CHECK(wiznet_poll(&wiznet, &interest, &ready, 0) > 0);
+    TEST_CHECK(ready.readable == SOCK_POLL_MASK(&sock));
+
+    wiznet_isr_notify(&wiznet);
+    wiznet_process_events(&wiznet);
+    TEST_CHECK(events == 1);
+    TEST_CHECK(!wiznet_sim_int_asserted(&sim));
+
+    uint8_t buf[64], ip[4];
+    uint16_t port;
+    TEST_CHECK(recvfrom(&sock, buf, sizeof(buf), ip, &port) == sizeof(data));
+    TEST_CHECK(wiznet_poll(&wiznet, &interest, &ready, 0) == 0);
+
+    sock_close(&sock);
+    sock_deinit(&sock);
+}
+
+
+/*
+ *  wiznet_poll() waiting for the interrupt of one of 2 idle sockets: the other one isn't read
+ *  again. The datagram comes from another thread in the meantime
+ */
+static socket_t *late_sock;
+
+static uint32_t _frames(void) {
+#if WIZNET_USE_FDM
+    return sim.counters.fixed_frames;
+#else
+    return sim.counters.transactions;
+#endif
+}
+
+static void *_deliver_late(void *arg) {
+    uint8_t data[20] = {0};
+    usleep(10000);
+    wiznet_sim_deliver(&sim, late_sock->_id, test_peer_ip, test_peer_port, data, sizeof(data));
+    wiznet_isr_notify(&wiznet);
+    return NULL;
+}
+
+static void _test_poll_wait(void) {
+    socket_t socks[2];
+    uint32_t events = 0;
+    sock_poll_set_t interest = {0}, ready;
+    for (uint8_t i=0; i<2; i++) {
+        TEST_CHECK(test_socket(&wiznet, &socks[i], SOCK_TYPE_UDP) == SOCK_STATUS_UDP);
+        sock_set_callback(&socks[i], SOCK_IR_RECV, _count_event, &events);
+        interest.readable |= SOCK_POLL_MASK(&socks[i]);
+    }
+
+    late_sock = &socks[1];
+    pthread_t thread;
+    uint32_t frames = _frames();
+    pthread_create(&thread, NULL, _deliver_late, NULL);
+    TEST_CHECK(wiznet_poll(&wiznet, &interest, &ready, 1000) == 1);
+    pthread_join(thread, NULL);
+    TEST_CHECK(ready.readable == SOCK_POLL_MASK(&socks[1]));
+    // both sockets (Sn_RX_RSR), SIR, Sn_IR-Sn_SR and Sn_IR clearing, then Socket 1 only
+    frames = _frames() - frames;
+    TEST_CHECK(frames == 6);
+
+    for (uint8_t i=0; i<2; i++) {
+        sock_close(&socks[i]);
+        sock_deinit(&socks[i]);
+    }
+}
+
+
+/*
+ *  Non-blocking connection driven by wiznet_tick(): the one which succeeds and the one which
+ *  runs out of the retries of the socket
+ */
+static sock_status_t op_status;
+static uint32_t op_calls;
+
+static void _on_op(socket_t *sock, sock_status_t status, void *arg) {
+    op_status = status;
+    op_calls++;
+}
+
+static void _wait_op(void) {
+    for (uint32_t i=0; (i < 2000) && (op_calls == 0); i++) {
+        wiznet_tick(&wiznet);
+        wiznet_sim_advance(&sim, 1);
+    }
+}
+
+static void _test_connect_async(void) {
+    sim.connect_latency_ms = 20;
+    socket_t sock = socket_t_init();
+    sock.type = SOCK_TYPE_TCP;
+    memcpy(sock.ip, test_peer_ip, 4);
+    sock.port = test_peer_port;
+
+    op_calls = 0;
+    TEST_CHECK(socket_async(&wiznet, &sock, _on_op, NULL) > 0);
+    TEST_CHECK(sock_op_pending(&sock));
+    _wait_op();
+    TEST_CHECK((op_calls == 1) && (op_status == SOCK_STATUS_ESTABLISHED));
+    TEST_CHECK(!sock_op_pending(&sock));
+    sock_close(&sock);
+    sock_deinit(&sock);
+
+    sim.peer_unreachable = true;
+    sock = socket_t_init();
+    sock.type = SOCK_TYPE_TCP;
+    memcpy(sock.ip, test_peer_ip, 4);
+    sock.port = test_peer_port;
+    sock_set_retry(&sock, 100, 2);  // 10 ms, 2 retries
+
+    op_calls = 0;
+    TEST_CHECK(socket_async(&wiznet, &sock, _on_op, NULL) > 0);
+    _wait_op();
+    TEST_CHECK((op_calls == 1) && (op_status == SOCK_STATUS_CLOSED));
+    TEST_CHECK(_reg16(&sim.common[RTR]) == 100);
+    TEST_CHECK(sim.common[RCR] == 2);
+    sock_deinit(&sock);
+}
+
+
+/*
+ *  Blocking disconnection of a socket with DISCON and TIMEOUT handlers: the status isn't read
+ *  again until the interrupt. Time of the model is moved by another thread meanwhile (as the
+ *  waiting doesn't use SPI) which also plays the INTn line
+ */
+static volatile bool clock_run;
+
+static void *_clock(void *arg) {
+    while (__atomic_load_n(&clock_run, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+        wiznet_sim_advance(&sim, 1);
+        if (wiznet_sim_int_asserted(&sim)) wiznet_isr_notify(&wiznet);
+    }
+    return NULL;
+}
+
+static void _test_discon_wait(void) {
+    socket_t sock;
+    TEST_CHECK(test_socket(&wiznet, &sock, SOCK_TYPE_TCP) == SOCK_STATUS_ESTABLISHED);
+    uint32_t events = 0;
+    sock_set_callback(&sock, SOCK_IR_DISCON, _count_event, &events);
+    sock_set_callback(&sock, SOCK_IR_TIMEOUT, _count_event, &events);
+
+    sim.connect_latency_ms = 20;
+    clock_run = true;
+    pthread_t thread;
+    pthread_create(&thread, NULL, _clock, NULL);
+    uint32_t frames = _frames();
+    sock_discon(&sock);
+    frames = _frames() - frames;
+    __atomic_store_n(&clock_run, false, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+
+    TEST_CHECK(sock.status == SOCK_STATUS_CLOSED);
+    // DISCON command, Sn_SR, then SIR, Sn_IR-Sn_SR, Sn_IR clearing and Sn_SR again (and RTR/RCR of
+    // the socket, if any) instead of Sn_SR reads for 20 ms
+    TEST_CHECK(frames <= 8);
+    sock_deinit(&sock);
+}
+
+
+/*
+ *  TCP server: a pool of 2 listening sockets, a client comes, talks and leaves
+ */
+static void _test_listener(void) {
+    sock_listener_t listener = sock_listener_t_init();
+    listener.port = 8080;
+    socket_t socks[2] = {socket_t_init(), socket_t_init()};
+    TEST_CHECK(sock_listen(&wiznet, &listener, socks, 2) == 2);
+    TEST_CHECK(sock_accept(&listener) == NULL);
+
+    TEST_CHECK(wiznet_sim_connect_in(&sim, 8080, test_peer_ip, 40000) >= 0);
+    TEST_CHECK(sock_listener_poll(&listener) == 1);
+    socket_t *client = sock_accept(&listener);
+    TEST_CHECK(client != NULL);
+    if (client == NULL) {
+        sock_listener_close(&listener);
+        return;
+    }
+    TEST_CHECK(memcmp(client->ip, test_peer_ip, 4) == 0);
+    TEST_CHECK(sock_accept(&listener) == NULL);
+
+    uint8_t data[100], buf[128];
+    _fill(data, sizeof(data), 6);
+    TEST_CHECK(wiznet_sim_deliver(&sim, client->_id, test_peer_ip, 40000, data, sizeof(data)) == sizeof(data));
+    TEST_CHECK(recv(client, buf, sizeof(buf)) == sizeof(data));
+    TEST_CHECK(memcmp(buf, data, sizeof(data)) == 0);
+    TEST_CHECK(send_stream(client, buf, sizeof(data), 1000) == sizeof(data));
+    TEST_CHECK(_is_sent(data, sizeof(data)));
+
+    // the socket listens again after the client has gone
+    wiznet_sim_peer_close(&sim, client->_id);
+    sock_discon(client);
+    TEST_CHECK(sock_listener_poll(&listener) == 2);
+
+    sock_listener_close(&listener);
+    for (uint8_t i=0; i<2; i++) TEST_CHECK(sim.sock_regs[socks[i]._id][Sn_SR] == SOCK_STATUS_CLOSED);
+}
+
+
+/*
+ *  sendto_async() returns before the data is out, the callback tells when it is
+ */
+static void _on_sent(wiznet_t *wiznet, wiznet_xfer_t *xfer) {
+    __atomic_store_n((bool *)xfer->arg, true, __ATOMIC_RELEASE);
+}
+
+static void _test_sendto_async(void) {
+    socket_t sock;
+    TEST_CHECK(test_socket(&wiznet, &sock, SOCK_TYPE_UDP) == SOCK_STATUS_UDP);
+
+    static uint8_t data[500];
+    for (uint8_t i=0; i<3; i++) {
+        _fill(data, sizeof(data), 40+i);
+        _sent_reset();
+        bool done = false;
+        TEST_CHECK(sendto_async(&sock, data, sizeof(data), _on_sent, &done) == sizeof(data));
+        for (uint32_t j=0; (j < 1000000) && !__atomic_load_n(&done, __ATOMIC_ACQUIRE); j++) sched_yield();
+        TEST_CHECK(done);
+        TEST_CHECK(_is_sent(data, sizeof(data)));
+    }
+
+    sock_close(&sock);
+    sock_deinit(&sock);
+}
+
+
+/*
+ *  Statistics of the chip and its sockets against the counters of the model: the RX buffer of a
+ *  UDP socket is filled till the chip drops a datagram (twice) and peeked several times while
+ *  it's full, a TCP stream waits for the TX buffer on a slow link
+ */
+#define STATS_DATAGRAM 248  // 8 of them with their headers fill 2 KB buffer exactly
+
+static void _test_stats(void) {
+#if WIZNET_USE_STATS
+    static uint8_t data[STREAM_SIZE];
+    socket_t udp, tcp;
+    TEST_CHECK(test_socket(&wiznet, &udp, SOCK_TYPE_UDP) == SOCK_STATUS_UDP);
+    TEST_CHECK(test_socket(&wiznet, &tcp, SOCK_TYPE_TCP) == SOCK_STATUS_ESTABLISHED);
+    wiznet_reset_stats(&wiznet);
+    sock_reset_stats(&udp);
+    sock_reset_stats(&tcp);
+    wiznet_sim_counters_reset(&sim);
+
+    _fill(data, sizeof(data), 8);
+    for (uint8_t i=0; i<3; i++) sendto(&udp, data, 100);
+    uint8_t buf[STATS_DATAGRAM], ip[4];
+    uint16_t port;
+    for (uint8_t round=0; round<2; round++) {
+        while (wiznet_sim_deliver(&sim, udp._id, test_peer_ip, test_peer_port, data, STATS_DATAGRAM) > 0);
+        for (uint8_t i=0; i<3; i++) TEST_CHECK(recv_peek(&udp, NULL, NULL) == 2048);
+        while (recvfrom(&udp, buf, sizeof(buf), ip, &port) > 0);
+    }
+
+    sim.link_rate_bps = 1000000;
+    TEST_CHECK(send_stream(&tcp, data, sizeof(data), 1000) == sizeof(data));
+
+    wiznet_stats_t chip, udp_stats, tcp_stats;
+    wiznet_get_stats(&wiznet, &chip);
+    sock_get_stats(&udp, &udp_stats);
+    sock_get_stats(&tcp, &tcp_stats);
+
+    TEST_CHECK(chip.spi_bytes[WIZNET_STATS_COMMON] == sim.counters.bytes_common);
+    TEST_CHECK(chip.spi_bytes[WIZNET_STATS_SOCK_REGS] == sim.counters.bytes_sock_regs);
+    TEST_CHECK(chip.spi_bytes[WIZNET_STATS_TX_BUF] == sim.counters.bytes_tx_buf);
+    TEST_CHECK(chip.spi_bytes[WIZNET_STATS_RX_BUF] == sim.counters.bytes_rx_buf);
+    for (uint8_t i=WIZNET_STATS_SOCK_REGS; i<NUM_OF_STATS_BLOCKS; i++)
+        TEST_CHECK(udp_stats.spi_bytes[i] + tcp_stats.spi_bytes[i] == chip.spi_bytes[i]);
+    TEST_CHECK(udp_stats.spi_bytes[WIZNET_STATS_RX_BUF] == sim.counters.bytes_rx_buf);
+
+    TEST_CHECK(chip.tx_bytes == sim.counters.tx_bytes);
+    TEST_CHECK(udp_stats.tx_bytes == 3*100);
+    TEST_CHECK(tcp_stats.tx_bytes == sizeof(data));
+    TEST_CHECK(udp_stats.rx_bytes == sim.counters.rx_bytes + sim.counters.rx_packets*8);  // with UDP headers
+
+    TEST_CHECK(sim.counters.rx_drops == 2);
+    TEST_CHECK((udp_stats.rx_overflows == 2) && (chip.rx_overflows == 2));
+    TEST_CHECK((tcp_stats.tx_stalls > 0) && (tcp_stats.tx_stalls < sim.counters.tx_packets));
+    TEST_CHECK((udp_stats.tx_stalls == 0) && (tcp_stats.rx_overflows == 0));
+
+    sock_close(&tcp);
+    sock_deinit(&tcp);
+    sock_close(&udp);
+    sock_deinit(&udp);
+#endif
+}
+
+
+#if NUM_OF_WIZNETS > 1
+/*
+ *  Another chip (the plain model) takes the sockets in turns with the one under test
+ */
+static void _test_socket_any(void) {
+    static wiznet_sim_t sim2;
+    static wiznet_t wiznet2;
+    TEST_CHECK(test_wiznet(&sim2, &wiznet2, 1) == 0);
+
+    socket_t socks[4];
+    uint8_t on_first = 0;
+    for (uint8_t i=0; i<4; i++) {
+        socks[i] = socket_t_init();
+        socks[i].type = SOCK_TYPE_UDP;
+        memcpy(socks[i].ip, test_peer_ip, 4);
+        socks[i].port = 5000+i;
+        TEST_CHECK(socket_any(&socks[i]) == SOCK_STATUS_UDP);
+        if (socks[i]._host_wiznet == &wiznet) on_first++;
+    }
+    TEST_CHECK(on_first == 2);
+
+    uint8_t data[64];
+    _fill(data, sizeof(data), 7);
+    for (uint8_t i=0; i<4; i++) sendto(&socks[i], data, sizeof(data));
+    TEST_CHECK(sent_packets == 2);
+    TEST_CHECK(sim2.counters.tx_packets == 2);
+
+    for (uint8_t i=0; i<4; i++) {
+        sock_close(&socks[i]);
+        sock_deinit(&socks[i]);
+    }
+    wiznet_deinit(&wiznet2);
+}
+#endif
+
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} scenarios[] = {
+    { "common_regs", _test_common_regs },
+    { "udp", _test_udp },
+    { "tcp", _test_tcp },
+    { "recv_alloc", _test_recv_alloc },
+    { "macraw", _test_macraw },
+    { "events", _test_events },
+    { "poll_wait", _test_poll_wait },
+    { "connect_async", _test_connect_async },
+    { "discon_wait", _test_discon_wait },
+    { "listener", _test_listener },
+    { "sendto_async", _test_sendto_async },
+    { "stats", _test_stats },
+#if NUM_OF_WIZNETS > 1
+    { "socket_any", _test_socket_any },
+#endif
+};
+
+
+int main(void) {
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    for (uint8_t t=0; t<NUM_OF_TEST_TRANSPORTS; t++) {
+        for (uint8_t i=0; i<sizeof(scenarios)/sizeof(scenarios[0]); i++) {
+            if (!_setup(t)) {
+                printf("%s/%s: skipped\n", transport_names[t], scenarios[i].name);
+                continue;
+            }
+            uint32_t failures = test_failures;
+            if (wiznet_init(&wiznet) == 0) scenarios[i].run();
+            else TEST_CHECK(!"wiznet_init()");
+            _teardown(t);
+            printf("%s/%s: %s\n", transport_names[t], scenarios[i].name,
+                   (test_failures == failures) ? "OK" : "FAILED");
+        }
+    }
+
+    return test_result("wiznet_test_scenarios");
+}
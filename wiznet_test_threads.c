@@ -0,0 +1,189 @@
+#include "wiznet_test.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+/*
+ *  Stress test of the thread-safe mode (built with WIZNET_THREAD_SAFE=1): 3 UDP sockets of one
+ *  chip are driven by 3 threads (sendto() and recvfrom()) while another thread runs
+ *  wiznet_poll(), wiznet_process_events() and wiznet_tick(). The model lets frames of different
+ *  threads overlap as a real bus would ('racy_frames') so any frame the library doesn't serialize
+ *  is counted as a CS collision. Every datagram should reach the other side intact and in order.
+ *
+ *  The same run without OS hooks (i.e. without locks) is done first in a child process to show
+ *  that the test does catch the races. Its result isn't checked as it's up to the scheduler
+ */
+
+
+#if !WIZNET_THREAD_SAFE
+#error "build the test with WIZNET_THREAD_SAFE=1"
+#endif
+
+#define THREADS_NUM 3
+#define DATAGRAMS_NUM 300
+#define PAYLOAD_SIZE 200
+#define UNSAFE_RUN_TIMEOUT_S 5
+
+static wiznet_sim_t sim;
+static wiznet_t wiznet;
+static socket_t socks[THREADS_NUM];
+static int8_t thread_of_sock[NUM_OF_SOCKETS];
+
+static uint32_t sent_ok[THREADS_NUM];
+static uint32_t received_ok[THREADS_NUM];
+static volatile bool workers_done;
+static int report_fd = STDOUT_FILENO;
+
+
+// payload of datagram 'seq' of thread 'n' (outgoing ones differ from incoming by 'dir')
+static void _fill(uint8_t *data, uint8_t n, uint32_t seq, uint8_t dir) {
+    memcpy(data, &seq, sizeof(seq));
+    for (uint16_t i=sizeof(seq); i<PAYLOAD_SIZE; i++) data[i] = (seq*7 + i + n*31 + dir) & 0xFF;
+}
+
+static bool _is_intact(const uint8_t *data, uint16_t len, uint8_t n, uint32_t seq, uint8_t dir) {
+    uint8_t expected[PAYLOAD_SIZE];
+    _fill(expected, n, seq, dir);
+    return (len == PAYLOAD_SIZE) && (memcmp(data, expected, PAYLOAD_SIZE) == 0);
+}
+
+
+// called by the model for every SEND command (under its lock)
+static void _on_send(wiznet_sim_t *sim, uint8_t sock_n, const uint8_t *data, uint16_t len, void *user) {
+    int8_t n = thread_of_sock[sock_n];
+    if (n < 0) return;
+    if (_is_intact(data, len, n, sent_ok[n], 0)) sent_ok[n]++;
+}
+
+
+static void *_worker(void *arg) {
+    uint8_t n = (uintptr_t)arg;
+    socket_t *sock = &socks[n];
+    uint8_t data[PAYLOAD_SIZE];
+    uint8_t buf[PAYLOAD_SIZE+16];
+
+    for (uint32_t seq=0; seq<DATAGRAMS_NUM; seq++) {
+        _fill(data, n, seq, 0);
+        sendto(sock, data, sizeof(data));
+
+        _fill(data, n, seq, 1);
+        wiznet_sim_deliver(&sim, sock->_id, test_peer_ip, test_peer_port+n, data, sizeof(data));
+        wiznet_isr_notify(&wiznet);
+
+        uint8_t ip[4];
+        uint16_t port;
+        uint16_t len = recvfrom(sock, buf, sizeof(buf), ip, &port);
+        if (_is_intact(buf, len, n, seq, 1) && (memcmp(ip, test_peer_ip, 4) == 0) &&
+            (port == test_peer_port+n)) received_ok[n]++;
+    }
+    return NULL;
+}
+
+
+// the main loop of an application: serves interrupts and watches the sockets
+static void *_service(void *arg) {
+    sock_poll_set_t interest = {0};
+    for (uint8_t i=0; i<THREADS_NUM; i++) interest.readable |= SOCK_POLL_MASK(&socks[i]);
+
+    while (!__atomic_load_n(&workers_done, __ATOMIC_ACQUIRE)) {
+        sock_poll_set_t ready;
+        wiznet_poll(&wiznet, &interest, &ready, 0);
+        wiznet_process_events(&wiznet);
+        wiznet_tick(&wiznet);
+        sched_yield();
+    }
+    return NULL;
+}
+
+
+static void _report(bool use_os, const char *note) {
+    uint32_t ok = 0;
+    for (uint8_t n=0; n<THREADS_NUM; n++) ok += sent_ok[n] + received_ok[n];
+    dprintf(report_fd, "%s OS hooks: %u of %u datagrams sent and received intact, %u CS collisions%s\n",
+            use_os ? "with" : "without", ok, 2*THREADS_NUM*DATAGRAMS_NUM, sim.counters.cs_collisions, note);
+}
+
+
+/*
+ *  Run the whole stress with or without the OS hooks. Returns the number of lost or corrupted
+ *  datagrams
+ */
+static uint32_t _run(bool use_os) {
+    wiznet_sim_init(&sim);
+    sim.on_send = _on_send;
+    test_wiznet_t_init(&wiznet, 0);
+    if (!use_os) wiznet.os = NULL;
+    wiznet_sim_attach(&sim, &wiznet);
+    TEST_CHECK(wiznet_init(&wiznet) == 0);
+
+    memset(thread_of_sock, -1, sizeof(thread_of_sock));
+    for (uint8_t n=0; n<THREADS_NUM; n++) {
+        TEST_CHECK(test_socket(&wiznet, &socks[n], SOCK_TYPE_UDP) == SOCK_STATUS_UDP);
+        thread_of_sock[socks[n]._id] = n;
+    }
+
+    // from now frames of different threads can overlap unless the library serializes them
+    wiznet_sim_counters_reset(&sim);
+    sim.racy_frames = true;
+
+    pthread_t workers[THREADS_NUM], service;
+    pthread_create(&service, NULL, _service, NULL);
+    for (uint8_t n=0; n<THREADS_NUM; n++) pthread_create(&workers[n], NULL, _worker, (void *)(uintptr_t)n);
+    for (uint8_t n=0; n<THREADS_NUM; n++) pthread_join(workers[n], NULL);
+    __atomic_store_n(&workers_done, true, __ATOMIC_RELEASE);
+    pthread_join(service, NULL);
+
+    uint32_t lost = 0;
+    for (uint8_t n=0; n<THREADS_NUM; n++) lost += 2*DATAGRAMS_NUM - sent_ok[n] - received_ok[n];
+    _report(use_os, "");
+    return lost;
+}
+
+
+static void _unsafe_run_timeout(int sig) {
+    _report(false, ", hung");
+    _exit(1);
+}
+
+
+/*
+ *  Run without the OS hooks in a child process: it can corrupt the state of the library or hang.
+ *  Log of the library is dropped, it's flooded with errors then
+ */
+static void _show_unsafe_run(void) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        report_fd = dup(STDOUT_FILENO);
+        freopen("/dev/null", "w", stdout);
+        signal(SIGALRM, _unsafe_run_timeout);
+        alarm(UNSAFE_RUN_TIMEOUT_S);
+        uint32_t lost = _run(false);
+        _exit(((lost > 0) || (sim.counters.cs_collisions > 0)) ? 1 : 0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (WIFSIGNALED(status)) printf("without OS hooks: crashed (signal %d)\n", WTERMSIG(status));
+    else if (WEXITSTATUS(status) == 0) printf("without OS hooks: no races this time\n");
+}
+
+
+int main(void) {
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    _show_unsafe_run();
+
+    uint32_t lost = _run(true);
+    TEST_CHECK(sim.counters.cs_collisions == 0);
+    TEST_CHECK(lost == 0);
+    for (uint8_t n=0; n<THREADS_NUM; n++) {
+        TEST_CHECK(sent_ok[n] == DATAGRAMS_NUM);
+        TEST_CHECK(received_ok[n] == DATAGRAMS_NUM);
+    }
+
+    return test_result("wiznet_test_threads");
+}